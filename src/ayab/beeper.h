@@ -35,8 +35,18 @@ constexpr uint8_t BEEP_NUM_FINISHEDLINE = 3U;
 constexpr uint8_t BEEP_NUM_ENDWORK = 10U;
 constexpr uint8_t BEEP_NUM_ERROR = 15U;
 
+// Timer1 drives the PWM on PIEZO_PIN, at about 490 Hz, counting up to
+// this. With the edge log (`-DENABLE_EDGE_LOG=1`) it also times the
+// encoder edges, so it counts at clk/8 up to 4095 instead of at clk/64
+// up to 255, and the duty is scaled to match.
+#if ENABLE_EDGE_LOG
+constexpr uint16_t BEEP_PWM_TOP = 4095U;
+#else
+constexpr uint16_t BEEP_PWM_TOP = 255U;
+#endif
+
 constexpr uint8_t BEEP_ON_DUTY = 0U;
-constexpr uint8_t BEEP_OFF_DUTY = 20U;
+constexpr uint16_t BEEP_OFF_DUTY = 20U * (BEEP_PWM_TOP + 1U) / 256U;
 constexpr uint8_t BEEP_NO_DUTY = 255U;
 
 class BeeperInterface {
@@ -30,36 +30,312 @@
  * \brief Initialize serial communication.
  */
 void Com::init() {
+  for (uint8_t i = 0U; i <= NUM_LINE_BUFFERS; i++) {
+    m_lines[i] = lineBuffer[i];
+  }
+  m_baudRate = 0U;
+  m_baudRatePending = false;
+  m_txHigh.clear();
+  m_txLow.clear();
+  m_txRemaining = 0U;
+  m_txDropped = 0U;
+  memset(m_rxCount, 0, sizeof(m_rxCount));
+  m_rxRejected = 0U;
+  m_rxUnrecognized = 0U;
   m_packetSerial.begin(SERIAL_BAUDRATE);
-#ifndef AYAB_TESTS
-  m_packetSerial.setPacketHandler(GlobalCom::onPacketReceived);
-#endif // AYAB_TESTS
 }
 
 /*!
  * \brief Service the serial connection.
  */
 void Com::update() {
-  m_packetSerial.update();
+  while (Serial.available() > 0) {
+    receive(static_cast<uint8_t>(Serial.read()));
+  }
+  drainTx(false);
+  if (m_baudRatePending && (millis() - m_baudRateTime >= SERIAL_FALLBACK_MS)) {
+    // The host has not followed the change of rate.
+    m_baudRatePending = false;
+    setBaudRate(m_fallbackBaudRate);
+  }
+}
+
+/*!
+ * \brief Decode a received byte.
+ * \param c The byte, SLIP encoded.
+ *
+ * Messages are unescaped as they arrive. The pattern data of an
+ * uncompressed `cnfLine` goes straight into the staging row, inverted,
+ * while its checksum is accumulated, so that it is neither buffered
+ * nor copied.
+ */
+void Com::receive(uint8_t c) {
+  if (c == SLIP::END) {
+    endOfPacket();
+    return;
+  }
+  if (c == SLIP::ESC) {
+    m_rxEscape = true;
+    return;
+  }
+  if (m_rxEscape) {
+    m_rxEscape = false;
+    if (c == SLIP::ESC_END) {
+      c = SLIP::END;
+    } else if (c == SLIP::ESC_ESC) {
+      c = SLIP::ESC;
+    }
+  }
+
+  if (m_rxStaged) {
+    auto machineType = static_cast<uint8_t>(GlobalKnitter::getMachineType());
+    uint8_t i = m_rxLen - 4U;
+    if (i < LINE_BUFFER_LEN[machineType]) {
+      // Values have to be inverted because of needle states
+      m_lines[NUM_LINE_BUFFERS][i] = ~c;
+    } else if (i > LINE_BUFFER_LEN[machineType]) {
+      // ignore anything after the checksum
+      return;
+    }
+    m_rxCrc.update(c);
+    m_rxLen++;
+    return;
+  }
+
+  if (m_rxLen == MAX_MSG_BUFFER_LEN) {
+    m_rxOverflow = true;
+    return;
+  }
+  m_rxBuffer[m_rxLen++] = c;
+  if ((m_rxLen == 4U) &&
+      (m_rxBuffer[0] == static_cast<uint8_t>(AYAB_API::cnfLine)) &&
+      (lineEncoding(m_rxBuffer[3]) == LineEncoding::raw)) {
+    m_rxStaged = true;
+    m_rxCrc.reset();
+    m_rxCrc.update(m_rxBuffer, 4U);
+  }
+}
+
+/*!
+ * \brief Act on a complete message and get ready for the next one.
+ *
+ * Messages that overflow the receive buffer are rejected, with the
+ * reply they would get if they failed their checks.
+ */
+void Com::endOfPacket() {
+  if (m_rxStaged) {
+    auto machineType = static_cast<uint8_t>(GlobalKnitter::getMachineType());
+    ApiMessage msg;
+    memcpy_P(&msg, &API_MESSAGES[apiSlot(static_cast<uint8_t>(AYAB_API::cnfLine))],
+             sizeof(msg));
+    countMessage(msg);
+    // The checksum covers the header and the pattern data,
+    // so the checksum of the whole message is 0.
+    if (!(msg.states & opStateBit(GlobalFsm::getState()))) {
+      ++m_rxRejected;
+      reject(msg.reply, ErrorCode::wrong_machine_state);
+    } else if (m_rxLen < LINE_BUFFER_LEN[machineType] + 5U) {
+      ++m_rxRejected;
+      GlobalKnitter::nackLine(ErrorCode::expected_longer_message);
+    } else if (m_rxCrc.value() != 0U) {
+      ++m_rxRejected;
+      GlobalKnitter::nackLine(ErrorCode::checksum_error);
+    } else {
+      m_baudRatePending = false;
+      commitLine(m_rxBuffer[1], m_rxBuffer[3]);
+    }
+  } else if (m_rxOverflow) {
+    rejectOverflow(m_rxBuffer[0]);
+  } else {
+    onPacketReceived(m_rxBuffer, m_rxLen);
+  }
+  m_rxLen = 0U;
+  m_rxEscape = false;
+  m_rxOverflow = false;
+  m_rxStaged = false;
+}
+
+/*!
+ * \brief Get the rate of the serial connection.
+ * \return Rate in baud.
+ */
+uint32_t Com::getBaudRate() const {
+  return SERIAL_BAUDRATES[m_baudRate];
+}
+
+/*!
+ * \brief Change the rate of the serial connection.
+ * \param baudRate Index into `SERIAL_BAUDRATES`.
+ *
+ * Waits until the last message has been sent at the old rate.
+ */
+void Com::setBaudRate(uint8_t baudRate) {
+  while (drainTx(true)) {
+  }
+  Serial.flush();
+  m_packetSerial.begin(SERIAL_BAUDRATES[baudRate]);
+  m_baudRate = baudRate;
+}
+
+/*!
+ * \brief Whether a message can wait for, or make way for, other messages.
+ * \param payload The message.
+ *
+ * State reports, test output, and debug messages are low priority.
+ * Replies, line requests, and errors are high priority.
+ */
+bool Com::lowPriority(const uint8_t *payload) {
+  switch (static_cast<AYAB_API_t>(payload[0])) {
+  case AYAB_API::indState:
+    return payload[1] == static_cast<uint8_t>(ErrorCode::success);
+  case AYAB_API::indPositions:
+  case AYAB_API::testRes:
+  case AYAB_API::debug:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*!
+ * \brief Queue a message for the serial port.
+ * \param payload A pointer to a data buffer.
+ * \param length The number of bytes in the data buffer.
+ * \param mayDrop Drop the message if its queue is full, even when
+ *   not knitting.
+ * \return `false` if the message was dropped.
+ *
+ * While knitting, nothing waits for the serial port: a message is
+ * dropped if there is no room for it once the serial port has taken
+ * what it can. Otherwise waits, writing out queued messages, until
+ * there is room.
+ * A message too long for an empty queue is written out directly once
+ * the queues are empty, or dropped while knitting.
+ */
+bool Com::enqueue(const uint8_t *payload, size_t length, bool mayDrop) const {
+  TxQueue &queue = lowPriority(payload) ? m_txLow : m_txHigh;
+  auto wait = [mayDrop]() {
+    return !mayDrop && (GlobalFsm::getState() != OpState::knit);
+  };
+  // the message and an end marker at each end
+  size_t encodedLength = length + 2U;
+  for (size_t i = 0U; i < length; i++) {
+    if ((payload[i] == SLIP::END) || (payload[i] == SLIP::ESC)) {
+      encodedLength++;
+    }
+  }
+
+  if (encodedLength >= TX_QUEUE_LEN) {
+    if (!wait()) {
+      ++m_txDropped;
+      return false;
+    }
+    while (drainTx(true)) {
+    }
+    encode(payload, length, nullptr);
+    return true;
+  }
+  // room for the message and its length
+  while (queue.space() <= encodedLength) {
+    if (!wait()) {
+      // write out what the serial port takes without waiting
+      drainTx(false);
+      if (queue.space() > encodedLength) {
+        break;
+      }
+      ++m_txDropped;
+      return false;
+    }
+    drainTx(true);
+  }
+  queue.push(static_cast<uint8_t>(encodedLength));
+  encode(payload, length, &queue);
+  return true;
+}
+
+/*!
+ * \brief SLIP encode a message.
+ * \param payload A pointer to a data buffer.
+ * \param length The number of bytes in the data buffer.
+ * \param queue Transmit queue, or `nullptr` to write to the serial port.
+ */
+void Com::encode(const uint8_t *payload, size_t length, TxQueue *queue) const {
+  auto put = [queue](uint8_t c) {
+    if (queue != nullptr) {
+      queue->push(c);
+    } else {
+      Serial.write(c);
+    }
+  };
+  // the leading end marker flushes out any line noise
+  put(SLIP::END);
+  for (size_t i = 0U; i < length; i++) {
+    if (payload[i] == SLIP::END) {
+      put(SLIP::ESC);
+      put(SLIP::ESC_END);
+    } else if (payload[i] == SLIP::ESC) {
+      put(SLIP::ESC);
+      put(SLIP::ESC_ESC);
+    } else {
+      put(payload[i]);
+    }
+  }
+  put(SLIP::END);
+}
+
+/*!
+ * \brief Write queued messages to the serial port.
+ * \param wait Write at least one byte, waiting for the serial port if
+ *   its transmit buffer is full.
+ * \return `false` if there was nothing to write.
+ *
+ * Otherwise only writes as many bytes as the transmit buffer has room
+ * for, so that it never blocks. A message is always written out whole
+ * before the next one is started.
+ */
+bool Com::drainTx(bool wait) const {
+  while (wait || (Serial.availableForWrite() > 0)) {
+    if (m_txRemaining == 0U) {
+      m_txCurrent = (m_txHigh.size() > 0U) ? &m_txHigh : &m_txLow;
+      if (!m_txCurrent->pop(m_txRemaining)) {
+        return false;
+      }
+    }
+    uint8_t c = 0U;
+    m_txCurrent->pop(c);
+    Serial.write(c);
+    m_txRemaining--;
+    wait = false;
+  }
+  return true;
 }
 
 /*!
  * \brief Send a packet of data.
  * \param payload A pointer to a data buffer.
  * \param length The number of bytes in the data buffer.
+ *
+ * The packet is queued, and written out by `update()` as the serial
+ * port has room for it. While knitting, low priority packets are
+ * dropped if their queue is full, so that knitting never waits for
+ * the serial port.
  */
 void Com::send(uint8_t *payload, size_t length) const {
   // TODO(TP): insert a workaround for hardware test code
   /*
   #ifdef AYAB_HW_TEST
-    Serial.print("Sent: ");
+    Serial.print(F("Sent: "));
     for (uint8_t i = 0; i < length; ++i) {
       Serial.print(payload[i]);
     }
-    Serial.print(", Encoded as: ");
+    Serial.print(F(", Encoded as: "));
   #endif
   */
-  m_packetSerial.send(payload, length);
+  if (length == 0U) {
+    return;
+  }
+  enqueue(payload, length, false);
+  drainTx(false);
 }
 
 /*!
@@ -76,6 +352,25 @@ void Com::sendMsg(AYAB_API_t id, const char *msg) {
   send(msgBuffer, length);
 }
 
+/*!
+ * \brief Send a string from program memory.
+ * \param id The msgid to be sent.
+ * \param msg Pointer to a null-terminated string in program memory,
+ *   such as one made with `PSTR()`.
+ *
+ * String literals take up RAM on AVR unless they are kept in program
+ * memory, so fixed messages should be sent with this function.
+ */
+void Com::sendMsg_P(AYAB_API_t id, const char *msg) {
+  uint8_t length = 0;
+  msgBuffer[length++] = static_cast<uint8_t>(id);
+  uint8_t c = 0U;
+  while ((c = pgm_read_byte(msg++)) != 0U) {
+    msgBuffer[length++] = c;
+  }
+  send(msgBuffer, length);
+}
+
 /*!
  * \brief Send `reqLine` message.
  * \param lineNumber The line number requested (0-indexed and modulo 256).
@@ -113,10 +408,108 @@ void Com::send_indState(Carriage_t carriage, uint8_t position,
   send(static_cast<uint8_t *>(payload), INDSTATE_LEN);
 }
 
+/*!
+ * \brief Send `indPositions` message.
+ * \param carriage Type of carriage.
+ * \param direction Direction of the carriage.
+ * \param passed Number of positions passed since the last report.
+ * \param positions The last positions passed, oldest first.
+ * \param count Number of positions, at most `REPORT_BATCH_LEN`.
+ * \return `true` if the message was queued, `false` if there is no room
+ *   for it in the transmit queue.
+ *
+ * Unlike `indState`, this is dropped if the queue is full even when
+ * not knitting, so that reporting can never hold up knitting.
+ */
+bool Com::send_indPositions(Carriage_t carriage, Direction_t direction,
+                            uint16_t passed, const uint8_t *positions,
+                            uint8_t count) const {
+  if (count > REPORT_BATCH_LEN) {
+    count = REPORT_BATCH_LEN;
+  }
+  uint8_t length = INDPOSITIONS_HEADER_LEN + count;
+  // `payload` will be allocated on stack since length is compile-time constant
+  uint8_t payload[INDPOSITIONS_HEADER_LEN + REPORT_BATCH_LEN];
+  payload[0] = static_cast<uint8_t>(AYAB_API::indPositions);
+  payload[1] = static_cast<uint8_t>(carriage);
+  payload[2] = static_cast<uint8_t>(direction);
+  payload[3] = highByte(passed);
+  payload[4] = lowByte(passed);
+  payload[5] = count;
+  memcpy(payload + INDPOSITIONS_HEADER_LEN, positions, count);
+  bool queued = enqueue(payload, length, true);
+  drainTx(false);
+  return queued;
+}
+
+// Messages from the host, by slot (see `apiSlot()`), with the states
+// in which they are accepted. Messages sent in any other state are
+// answered with their reply and `wrong_machine_state`.
+// clang-format off
+#define API_MESSAGE(id, counter, minLength, states, crc, reply, handler) \
+  {static_cast<uint8_t>(AYAB_API::id), counter, minLength, states, crc, \
+   static_cast<uint8_t>(reply), &Com::handler}
+#define API_TEST_CMD(id, counter, handler) \
+  API_MESSAGE(id, counter, 1U, TEST_OPSTATES, false, AYAB_API::cnfTest, \
+              h_testCmd<GlobalTester::handler>)
+#define API_NONE {0U, 0U, 0U, 0U, false, 0U, nullptr}
+constexpr uint8_t INIT_OPSTATES = opStateBit(OpState::wait_for_machine);
+constexpr uint8_t START_OPSTATES = opStateBit(OpState::ready);
+constexpr uint8_t MOTIF_OPSTATES = opStateBit(OpState::init) | opStateBit(OpState::ready);
+constexpr uint8_t LINE_OPSTATES = opStateBit(OpState::knit);
+constexpr uint8_t REQTEST_OPSTATES = opStateBit(OpState::wait_for_machine) |
+                                     opStateBit(OpState::init) | opStateBit(OpState::ready);
+constexpr uint8_t TEST_OPSTATES = opStateBit(OpState::test);
+const Com::ApiMessage Com::API_MESSAGES[API_SLOTS] PROGMEM = {
+  /* 0x00 */ API_NONE,
+  /* 0x01 */ API_MESSAGE(reqStart, 0U, 5U, START_OPSTATES, true, AYAB_API::cnfStart, h_reqStart),
+  /* 0x42 */ API_MESSAGE(cnfLine, 1U, 5U, LINE_OPSTATES, false, AYAB_API::reqLine, h_cnfLine),
+  /* 0x03 */ API_MESSAGE(reqInfo, 2U, 1U, ANY_OPSTATE, false, 0U, h_reqInfo),
+  /* 0x04 */ API_MESSAGE(reqTest, 3U, 1U, REQTEST_OPSTATES, false, AYAB_API::cnfTest, h_reqTest),
+  /* 0x05 */ API_MESSAGE(reqInit, 4U, 3U, INIT_OPSTATES, true, AYAB_API::cnfInit, h_reqInit),
+  /* 0x06 */ API_MESSAGE(reqMotif, 5U, 8U, MOTIF_OPSTATES, true, AYAB_API::cnfMotif, h_reqMotif),
+  /* 0x07 */ API_MESSAGE(reqStats, 6U, 1U, ANY_OPSTATE, false, 0U, h_reqStats),
+  /* 0x08 */ API_MESSAGE(reqCounters, 7U, 1U, ANY_OPSTATE, false, 0U, h_reqCounters),
+  /* 0x09 */ API_MESSAGE(reqEdges, 8U, 1U, ANY_OPSTATE, false, 0U, h_reqEdges),
+  /* 0x0A */ API_NONE,
+  /* 0x0B */ API_NONE,
+  /* 0x0C */ API_NONE,
+  /* 0x0D */ API_NONE,
+  /* 0x0E */ API_NONE,
+  /* 0x0F */ API_NONE,
+  /* 0x20 */ API_NONE,
+  /* 0x21 */ API_NONE,
+  /* 0x22 */ API_NONE,
+  /* 0x23 */ API_NONE,
+  /* 0x24 */ API_NONE,
+  /* 0x25 */ API_TEST_CMD(helpCmd, 9U, helpCmd),
+  /* 0x26 */ API_TEST_CMD(sendCmd, 10U, sendCmd),
+  /* 0x27 */ API_TEST_CMD(beepCmd, 11U, beepCmd),
+  /* 0x28 */ API_MESSAGE(setSingleCmd, 12U, 3U, TEST_OPSTATES, false, AYAB_API::cnfTest,
+                         h_testCmdArgs<GlobalTester::setSingleCmd>),
+  /* 0x29 */ API_MESSAGE(setAllCmd, 13U, 3U, TEST_OPSTATES, false, AYAB_API::cnfTest,
+                         h_testCmdArgs<GlobalTester::setAllCmd>),
+  /* 0x2A */ API_TEST_CMD(readEOLsensorsCmd, 14U, readEOLsensorsCmd),
+  /* 0x2B */ API_TEST_CMD(readEncodersCmd, 15U, readEncodersCmd),
+  /* 0x2C */ API_MESSAGE(autoReadCmd, 16U, 1U, TEST_OPSTATES, false, AYAB_API::cnfTest,
+                         h_testCmdArgs<GlobalTester::autoReadCmd>),
+  /* 0x2D */ API_TEST_CMD(autoTestCmd, 17U, autoTestCmd),
+  /* 0x2E */ API_TEST_CMD(stopCmd, 18U, stopCmd),
+  /* 0x2F */ API_TEST_CMD(quitCmd, 19U, quitCmd),
+};
+#undef API_MESSAGE
+#undef API_TEST_CMD
+#undef API_NONE
+// clang-format on
+
 /*!
  * \brief Callback for PacketSerial.
  * \param buffer A pointer to a data buffer.
  * \param size The number of bytes in the data buffer.
+ *
+ * The message is looked up in `API_MESSAGES`, and only handed to its
+ * handler once its length, the state of the machine, and its checksum
+ * have been checked.
  */
 void Com::onPacketReceived(const uint8_t *buffer, size_t size) {
   // Ignore empty packets (sliplib in Python emits END bytes at the start of packets)
@@ -124,75 +517,104 @@ void Com::onPacketReceived(const uint8_t *buffer, size_t size) {
     return;
   }
 
-  switch (buffer[0]) {
-  case static_cast<uint8_t>(AYAB_API::reqInit):
-    h_reqInit(buffer, size);
-    break;
-
-  case static_cast<uint8_t>(AYAB_API::reqStart):
-    h_reqStart(buffer, size);
-    break;
-
-  case static_cast<uint8_t>(AYAB_API::cnfLine):
-    h_cnfLine(buffer, size);
-    break;
-
-  case static_cast<uint8_t>(AYAB_API::reqInfo):
-    h_reqInfo();
-    break;
-
-  case static_cast<uint8_t>(AYAB_API::reqTest):
-    h_reqTest();
-    break;
-
-  case static_cast<uint8_t>(AYAB_API::helpCmd):
-    GlobalTester::helpCmd();
-    break;
-
-  case static_cast<uint8_t>(AYAB_API::sendCmd):
-    GlobalTester::sendCmd();
-    break;
+  bool crcValid = (size > 1U) && (Crc8::compute(buffer, size) == 0U);
+  // Any message that ends in a valid checksum confirms a new serial rate.
+  if (m_baudRatePending && crcValid) {
+    m_baudRatePending = false;
+  }
 
-  case static_cast<uint8_t>(AYAB_API::beepCmd):
-    GlobalTester::beepCmd();
-    break;
+  uint8_t slot = apiSlot(buffer[0]);
+  ApiMessage msg;
+  memcpy_P(&msg, &API_MESSAGES[slot], sizeof(msg));
+  if ((msg.id != buffer[0]) || (msg.handler == nullptr)) {
+    ++m_rxUnrecognized;
+    h_unrecognized();
+    return;
+  }
+  countMessage(msg);
 
-  case static_cast<uint8_t>(AYAB_API::setSingleCmd):
-    GlobalTester::setSingleCmd(buffer, size);
-    break;
+  Err_t error = ErrorCode::success;
+  if (size < msg.minLength) {
+    error = ErrorCode::expected_longer_message;
+  } else if ((msg.states != ANY_OPSTATE) &&
+             !(msg.states & opStateBit(GlobalFsm::getState()))) {
+    error = ErrorCode::wrong_machine_state;
+  } else if (msg.crc && !crcValid) {
+    error = ErrorCode::checksum_error;
+  }
+  if (error != ErrorCode::success) {
+    ++m_rxRejected;
+    reject(msg.reply, error);
+    return;
+  }
+  (this->*msg.handler)(buffer, size);
+}
 
-  case static_cast<uint8_t>(AYAB_API::setAllCmd):
-    GlobalTester::setAllCmd(buffer, size);
-    break;
+/*!
+ * \brief Reject a message that is too long for the receive buffer.
+ * \param id Message ID.
+ *
+ * A compressed `cnfLine` is requested again, so that the host can
+ * send the line uncompressed instead of waiting for the timeout.
+ */
+void Com::rejectOverflow(uint8_t id) {
+  uint8_t slot = apiSlot(id);
+  ApiMessage msg;
+  memcpy_P(&msg, &API_MESSAGES[slot], sizeof(msg));
+  if ((msg.id != id) || (msg.handler == nullptr)) {
+    ++m_rxUnrecognized;
+    return;
+  }
+  countMessage(msg);
+  ++m_rxRejected;
+  reject(msg.reply, ErrorCode::argument_invalid);
+}
 
-  case static_cast<uint8_t>(AYAB_API::readEOLsensorsCmd):
-    GlobalTester::readEOLsensorsCmd();
-    break;
+/*!
+ * \brief Count a message from the host for `reqCounters`.
+ * \param msg The message, as found in `API_MESSAGES`.
+ *
+ * Counts stop at 255 rather than wrapping.
+ */
+void Com::countMessage(const ApiMessage &msg) {
+  if (m_rxCount[msg.counter] < UINT8_MAX) {
+    ++m_rxCount[msg.counter];
+  }
+}
 
-  case static_cast<uint8_t>(AYAB_API::readEncodersCmd):
-    GlobalTester::readEncodersCmd();
+/*!
+ * \brief Tell the host that a message has been rejected.
+ * \param reply Message ID of the reply, or 0 for none.
+ * \param error Error code.
+ */
+void Com::reject(uint8_t reply, Err_t error) {
+  switch (reply) {
+  case 0U:
     break;
 
-  case static_cast<uint8_t>(AYAB_API::autoReadCmd):
-    GlobalTester::autoReadCmd();
+  case static_cast<uint8_t>(AYAB_API::reqLine):
+    // request the line again at once
+    GlobalKnitter::nackLine(error);
     break;
 
-  case static_cast<uint8_t>(AYAB_API::autoTestCmd):
-    GlobalTester::autoTestCmd();
+  case static_cast<uint8_t>(AYAB_API::cnfInit):
+    send_cnfInit(error, m_baudRate);
     break;
 
-  case static_cast<uint8_t>(AYAB_API::stopCmd):
-    GlobalTester::stopCmd();
+  case static_cast<uint8_t>(AYAB_API::cnfStart):
+    send_cnfStart(error);
     break;
 
-   case static_cast<uint8_t>(AYAB_API::quitCmd):
-    GlobalTester::quitCmd();
+  case static_cast<uint8_t>(AYAB_API::cnfTest):
+    send_cnfTest(error);
     break;
 
-  default:
-    h_unrecognized();
+  default: {
+    uint8_t payload[2] = {reply, static_cast<uint8_t>(error)};
+    send(payload, 2);
     break;
   }
+  }
 }
 
 // Serial command handling
@@ -203,25 +625,26 @@ void Com::onPacketReceived(const uint8_t *buffer, size_t size) {
  * \param size The number of bytes in the data buffer.
  */
 void Com::h_reqInit(const uint8_t *buffer, size_t size) {
-  if (size < 3U) {
-    // Need 3 bytes from buffer below.
-    send_cnfInit(ErrorCode::expected_longer_message);
-    return;
-  }
-
   auto machineType = static_cast<Machine_t>(buffer[1]);
 
-  uint8_t crc8 = buffer[2];
-  // Check crc on bytes 0-4 of buffer.
-  if (crc8 != CRC8(buffer, 2)) {
-    send_cnfInit(ErrorCode::checksum_error);
-    return;
-  }
+  // An optional byte before the checksum proposes a serial rate.
+  uint8_t baudRate = (size > 3U) ? buffer[2] : m_baudRate;
 
-  memset(lineBuffer, 0xFF, MAX_LINE_BUFFER_LEN);
+  memset(lineBuffer, 0xFF, sizeof(lineBuffer));
 
   Err_t error = GlobalKnitter::initMachine(machineType);
-  send_cnfInit(error);
+  if ((error != ErrorCode::success) || (baudRate >= NUM_SERIAL_BAUDRATES)) {
+    // keep the current rate
+    baudRate = m_baudRate;
+  }
+  send_cnfInit(error, baudRate);
+
+  if (baudRate != m_baudRate) {
+    m_fallbackBaudRate = m_baudRate;
+    setBaudRate(baudRate);
+    m_baudRatePending = true;
+    m_baudRateTime = millis();
+  }
 }
 
 /*!
@@ -230,77 +653,185 @@ void Com::h_reqInit(const uint8_t *buffer, size_t size) {
  * \param size The number of bytes in the data buffer.
  */
 void Com::h_reqStart(const uint8_t *buffer, size_t size) {
-  if (size < 5U) {
-    // Need 5 bytes from buffer below.
-    send_cnfStart(ErrorCode::expected_longer_message);
-    return;
-  }
-
   uint8_t startNeedle = buffer[1];
   uint8_t stopNeedle = buffer[2];
   auto continuousReportingEnabled = static_cast<bool>(buffer[3] & 1);
   auto beeperEnabled = static_cast<bool>(buffer[3] & 2);
+  auto compressedLinesRequested = static_cast<bool>(buffer[3] & 4);
 
-  uint8_t crc8 = buffer[4];
-  // Check crc on bytes 0-4 of buffer.
-  if (crc8 != CRC8(buffer, 4)) {
-    send_cnfStart(ErrorCode::checksum_error);
+  // Two optional bytes before the checksum set the reporting policy.
+  auto reportMode = ReportMode::everyPosition;
+  uint8_t reportInterval = 0U;
+  if (size > 6U) {
+    reportMode = static_cast<ReportMode_t>(buffer[4]);
+    reportInterval = buffer[5];
+  }
+
+  if (reportMode > ReportMode::events) {
+    send_cnfStart(ErrorCode::argument_invalid);
     return;
   }
 
   GlobalBeeper::init(beeperEnabled);
-  memset(lineBuffer, 0xFF, MAX_LINE_BUFFER_LEN);
+  // The first line of a job is encoded against a blank line.
+  memset(lineBuffer, 0xFF, sizeof(lineBuffer));
+  m_compressedLines = compressedLinesRequested;
 
   // Note (August 2020): the return value of this function has changed.
   // Previously, it returned `true` for success and `false` for failure.
   // Now, it returns `0` for success and an informative error code otherwise.
+  GlobalKnitter::setReportPolicy(reportMode, reportInterval);
   Err_t error =
       GlobalKnitter::startKnitting(startNeedle, stopNeedle,
-                                   lineBuffer, continuousReportingEnabled);
+                                   m_lines, continuousReportingEnabled);
   send_cnfStart(error);
 }
 
+/*!
+ * \brief Handle `reqMotif` (upload motif) command.
+ * \param buffer A pointer to a data buffer.
+ * \param size The number of bytes in the data buffer.
+ *
+ * The message holds the motif width and height, the number of rows to
+ * knit (big-endian, 0 = until stopped), the first motif row in this
+ * message, whole motif rows, and a CRC.
+ */
+void Com::h_reqMotif(const uint8_t *buffer, size_t size) {
+  uint8_t width = buffer[1];
+  uint8_t height = buffer[2];
+  uint16_t rows = (buffer[3] << 8) | buffer[4];
+  uint8_t firstRow = buffer[5];
+
+  Err_t error = GlobalKnitter::setMotif(width, height, rows, firstRow,
+                                        buffer + 6, size - 7U);
+  send_cnfMotif(error);
+}
+
+/*!
+ * \brief Handle `reqStats` (request telemetry) command.
+ * \param buffer A pointer to a data buffer.
+ * \param size The number of bytes in the data buffer.
+ *
+ * An optional second byte with bit 0 set clears the telemetry
+ * once it has been sent.
+ */
+void Com::h_reqStats(const uint8_t *buffer, size_t size) {
+  bool reset = (size > 1U) && bitRead(buffer[1], 0U);
+  KnitterStats stats;
+  GlobalKnitter::getStats(stats, reset);
+  send_cnfStats(stats);
+  if (reset) {
+    m_txDropped = 0U;
+  }
+}
+
 /*!
  * \brief Handle `cnfLine` (configure line) command.
  * \param buffer A pointer to a data buffer.
  * \param size The number of bytes in the data buffer.
  *
- * \todo sl: Handle CRC-8 error?
- * \todo sl: Assert size? Handle error?
+ * A line that is too short or fails its checksum is requested again
+ * at once, with the error code. The checksum of an uncompressed line
+ * follows the data of one line, so it is checked here rather than
+ * in `onPacketReceived()`.
  */
 void Com::h_cnfLine(const uint8_t *buffer, size_t size) {
   auto machineType = static_cast<uint8_t>(GlobalKnitter::getMachineType());
   uint8_t lenLineBuffer = LINE_BUFFER_LEN[machineType];
-  if (size < lenLineBuffer + 5U) {
-    // message is too short
-    // TODO(sl): handle error?
-    // TODO(TP): send repeat request with error code?
-    return;
-  }
 
   uint8_t lineNumber = buffer[1];
   /* uint8_t color = buffer[2];  */ // currently unused
   uint8_t flags = buffer[3];
 
-  for (uint8_t i = 0U; i < lenLineBuffer; i++) {
-    // Values have to be inverted because of needle states
-    lineBuffer[i] = ~buffer[i + 4];
+  LineEncoding_t encoding = lineEncoding(flags);
+
+  // Uncompressed lines have a fixed length. Compressed lines end
+  // with the checksum, wherever that is.
+  size_t lenData = (encoding == LineEncoding::raw) ? lenLineBuffer : size - 5U;
+  if (size < lenData + 5U) {
+    // message is too short
+    ++m_rxRejected;
+    GlobalKnitter::nackLine(ErrorCode::expected_longer_message);
+    return;
   }
 
-  uint8_t crc8 = buffer[lenLineBuffer + 4];
+  uint8_t crc8 = buffer[lenData + 4];
   // Calculate checksum of buffer contents
-  if (crc8 != CRC8(buffer, lenLineBuffer + 4)) {
-    // TODO(sl): handle checksum error?
-    // TODO(TP): send repeat request with error code?
+  if (crc8 != CRC8(buffer, lenData + 4)) {
+    ++m_rxRejected;
+    GlobalKnitter::nackLine(ErrorCode::checksum_error);
     return;
   }
 
-  if (GlobalKnitter::setNextLine(lineNumber)) {
-    // Line was accepted
-    bool flagLastLine = bitRead(flags, 0U);
-    if (flagLastLine) {
-      GlobalKnitter::setLastLine();
+  if (encoding > LineEncoding::xorDelta) {
+    // unknown encoding
+    ++m_rxRejected;
+    GlobalKnitter::nackLine(ErrorCode::argument_invalid);
+    return;
+  }
+  if ((encoding != LineEncoding::raw) &&
+      (LineCodec::decodedLength(buffer + 4, lenData) != lenLineBuffer)) {
+    // compressed data does not decode to exactly one line
+    ++m_rxRejected;
+    GlobalKnitter::nackLine(ErrorCode::needle_value_invalid);
+    return;
+  }
+
+  // Decode into the staging row, so that no line buffer is changed
+  // unless the line is accepted.
+  uint8_t *line = m_lines[NUM_LINE_BUFFERS];
+  if (encoding == LineEncoding::raw) {
+    for (uint8_t i = 0U; i < lenLineBuffer; i++) {
+      // Values have to be inverted because of needle states
+      line[i] = ~buffer[i + 4];
     }
+  } else {
+    // If the line is accepted, the previous line is still in its slot.
+    const uint8_t *prevLine = m_lines[lineBufferSlot(lineNumber - 1U)];
+    LineCodec::decode(encoding, buffer + 4, lenData, prevLine, line,
+                      lenLineBuffer);
+  }
+  commitLine(lineNumber, flags);
+}
+
+/*!
+ * \brief Encoding of the pattern data in a `cnfLine` message.
+ * \param flags The flags byte of the message.
+ */
+LineEncoding_t Com::lineEncoding(uint8_t flags) const {
+  if (!m_compressedLines) {
+    // the encoding bits are only defined once compressed lines are negotiated
+    return LineEncoding::raw;
+  }
+  return static_cast<LineEncoding_t>((flags >> LINE_ENCODING_SHIFT) &
+                                     LINE_ENCODING_MASK);
+}
+
+/*!
+ * \brief Hand the line in the staging row to the knitter.
+ * \param lineNumber Line number (0-indexed and modulo 256).
+ * \param flags The flags byte of the `cnfLine` message.
+ *
+ * The staging row is swapped into the slot of the line before the
+ * knitter is told, since the knitter may take the line up at once.
+ * If the line is not accepted the rows are swapped back, since the
+ * slot of an unexpected line may still be in use.
+ */
+void Com::commitLine(uint8_t lineNumber, uint8_t flags) {
+  uint8_t slot = lineBufferSlot(lineNumber);
+  uint8_t *line = m_lines[slot];
+  m_lines[slot] = m_lines[NUM_LINE_BUFFERS];
+  m_lines[NUM_LINE_BUFFERS] = line;
+
+  if (!GlobalKnitter::setNextLine(lineNumber)) {
+    m_lines[NUM_LINE_BUFFERS] = m_lines[slot];
+    m_lines[slot] = line;
+    return;
+  }
+
+  bool flagLastLine = bitRead(flags, 0U);
+  if (flagLastLine) {
+    GlobalKnitter::setLastLine();
   }
 }
 
@@ -309,7 +840,9 @@ void Com::h_cnfLine(const uint8_t *buffer, size_t size) {
  * \param buffer A pointer to a data buffer.
  * \param size The number of bytes in the data buffer.
  */
-void Com::h_reqInfo() const {
+void Com::h_reqInfo(const uint8_t *buffer, size_t size) {
+  (void)buffer;
+  (void)size;
   send_cnfInfo();
 }
 
@@ -318,7 +851,9 @@ void Com::h_reqInfo() const {
  * \param buffer A pointer to a data buffer.
  * \param size The number of bytes in the data buffer.
  */
-void Com::h_reqTest() const {
+void Com::h_reqTest(const uint8_t *buffer, size_t size) {
+  (void)buffer;
+  (void)size;
   auto machineType = static_cast<Machine_t>(GlobalKnitter::getMachineType());
 
   // Note (August 2020): the return value of this function has changed.
@@ -328,6 +863,89 @@ void Com::h_reqTest() const {
   send_cnfTest(error);
 }
 
+/*!
+ * \brief Handle `reqCounters` (request message counters) command.
+ * \param buffer A pointer to a data buffer.
+ * \param size The number of bytes in the data buffer.
+ *
+ * Sends the number of messages that were not recognized and that were
+ * rejected, big-endian, followed by the message ID and count of each
+ * message received since the counters were cleared, one byte each.
+ * An optional second byte with bit 0 set clears the counters once they
+ * have been sent.
+ */
+void Com::h_reqCounters(const uint8_t *buffer, size_t size) {
+  // `payload` will be allocated on stack since length is compile-time constant
+  uint8_t payload[5U + 2U * API_COUNTERS];
+  uint8_t length = 0U;
+  payload[length++] = static_cast<uint8_t>(AYAB_API::cnfCounters);
+  payload[length++] = highByte(m_rxUnrecognized);
+  payload[length++] = lowByte(m_rxUnrecognized);
+  payload[length++] = highByte(m_rxRejected);
+  payload[length++] = lowByte(m_rxRejected);
+  for (uint8_t slot = 0U; slot < API_SLOTS; slot++) {
+    ApiMessage msg;
+    memcpy_P(&msg, &API_MESSAGES[slot], sizeof(msg));
+    if ((msg.handler != nullptr) && (m_rxCount[msg.counter] > 0U)) {
+      payload[length++] = msg.id;
+      payload[length++] = m_rxCount[msg.counter];
+    }
+  }
+  send(payload, length);
+
+  if ((size > 1U) && bitRead(buffer[1], 0U)) {
+    memset(m_rxCount, 0, sizeof(m_rxCount));
+    m_rxRejected = 0U;
+    m_rxUnrecognized = 0U;
+  }
+}
+
+/*!
+ * \brief Handle `reqEdges` (request encoder edge log) command.
+ * \param buffer A pointer to a data buffer.
+ * \param size The number of bytes in the data buffer.
+ *
+ * Sends the encoder edges in the log, oldest first, in as many `cnfEdges`
+ * messages as it takes. Each message has the timer ticks per microsecond
+ * of the edge times (0 if the firmware was built without the edge log),
+ * the number of edges lost because the log was full (since the last
+ * request, in the first message, otherwise 0), the number of edges that
+ * follow, and 1 if another `cnfEdges` follows, otherwise 0. Each edge is
+ * its time (big-endian), the position, and the direction. Edges are taken
+ * from the log as they are sent, so that repeated requests return each
+ * edge once. At most `EDGE_LOG_LEN` edges are sent for one request.
+ */
+void Com::h_reqEdges(const uint8_t *buffer, size_t size) {
+  (void)buffer;
+  (void)size;
+  uint8_t edgesLost = GlobalKnitter::getEdgesLost();
+  EdgeRecord edge;
+  bool more = GlobalKnitter::popEdge(edge);
+  uint8_t sent = 0U;
+  do {
+    // `payload` will be allocated on stack since length is compile-time constant
+    uint8_t payload[CNFEDGES_HEADER_LEN + CNFEDGES_EDGE_LEN * CNFEDGES_BATCH_LEN];
+    uint8_t length = CNFEDGES_HEADER_LEN;
+    uint8_t edges = 0U;
+    while (more && (edges < CNFEDGES_BATCH_LEN)) {
+      payload[length++] = highByte(edge.ticks);
+      payload[length++] = lowByte(edge.ticks);
+      payload[length++] = edge.position;
+      payload[length++] = static_cast<uint8_t>(edge.direction);
+      ++edges;
+      ++sent;
+      more = (sent < EDGE_LOG_LEN) && GlobalKnitter::popEdge(edge);
+    }
+    payload[0] = static_cast<uint8_t>(AYAB_API::cnfEdges);
+    payload[1] = EDGE_TICKS_PER_US;
+    payload[2] = edgesLost;
+    payload[3] = edges;
+    payload[4] = more ? 1U : 0U;
+    send(payload, length);
+    edgesLost = 0U;
+  } while (more);
+}
+
 // GCOVR_EXCL_START
 /*!
  * \brief Handle unrecognized command.
@@ -356,26 +974,34 @@ void Com::send_cnfInfo() const {
 /*!
  * \brief Send `cnfInit` message.
  * \param error Error code (0 = success, other values = error).
+ * \param baudRate Serial rate used after this message, as an index into
+ *   `SERIAL_BAUDRATES`.
  */
-void Com::send_cnfInit(Err_t error) const {
+void Com::send_cnfInit(Err_t error, uint8_t baudRate) const {
   // `payload` will be allocated on stack since length is compile-time constant
-  uint8_t payload[2];
+  uint8_t payload[3];
   payload[0] = static_cast<uint8_t>(AYAB_API::cnfInit);
   payload[1] = static_cast<uint8_t>(error);
-  send(payload, 2);
+  payload[2] = baudRate;
+  send(payload, 3);
 }
 
 
 /*!
  * \brief Send `cnfStart` message.
  * \param error Error code (0 = success, other values = error).
+ *
+ * The third byte echoes the `reqStart` options that the firmware has
+ * accepted, so that the host only sends compressed lines when the
+ * firmware understands them.
  */
 void Com::send_cnfStart(Err_t error) const {
   // `payload` will be allocated on stack since length is compile-time constant
-  uint8_t payload[2];
+  uint8_t payload[3];
   payload[0] = static_cast<uint8_t>(AYAB_API::cnfStart);
   payload[1] = static_cast<uint8_t>(error);
-  send(payload, 2);
+  payload[2] = m_compressedLines ? 4U : 0U;
+  send(payload, 3);
 }
 
 /*!
@@ -390,36 +1016,70 @@ void Com::send_cnfTest(Err_t error) const {
   send(payload, 2);
 }
 
+/*!
+ * \brief Send `cnfMotif` message.
+ * \param error Error code (0 = success, other values = error).
+ */
+void Com::send_cnfMotif(Err_t error) const {
+  // `payload` will be allocated on stack since length is compile-time constant
+  uint8_t payload[2];
+  payload[0] = static_cast<uint8_t>(AYAB_API::cnfMotif);
+  payload[1] = static_cast<uint8_t>(error);
+  send(payload, 2);
+}
+
+/*!
+ * \brief Send `cnfStats` message.
+ * \param stats Line telemetry.
+ *
+ * Each range is sent as minimum, average, and maximum. All values
+ * of more than one byte are big-endian. The minimum and average of
+ * an empty range are sent as 0. They are followed by the number of
+ * low priority messages dropped from the transmit queue, the number
+ * of lines requested again, and the number of illegal encoder transitions.
+ */
+void Com::send_cnfStats(const KnitterStats &stats) const {
+  // `payload` will be allocated on stack since length is compile-time constant
+  uint8_t payload[CNFSTATS_LEN];
+  uint8_t length = 0U;
+  auto put16 = [&payload, &length](uint16_t value) {
+    payload[length++] = highByte(value);
+    payload[length++] = lowByte(value);
+  };
+  auto putRange = [&put16](const SampleRange &range, uint16_t samples) {
+    put16(samples ? range.min : 0U);
+    put16(samples ? range.sum / samples : 0U);
+    put16(range.max);
+  };
+
+  payload[length++] = static_cast<uint8_t>(AYAB_API::cnfStats);
+  put16(stats.lines);
+  putRange(stats.latency, stats.lines);
+  putRange(stats.travel, stats.lines);
+  uint16_t slackSamples = 0U;
+  for (uint8_t i = 0U; i < SLACK_HISTOGRAM_BINS; i++) {
+    slackSamples += stats.slackHistogram[i];
+  }
+  putRange(stats.slack, slackSamples);
+  for (uint8_t i = 0U; i < SLACK_HISTOGRAM_BINS; i++) {
+    put16(stats.slackHistogram[i]);
+  }
+  payload[length++] = stats.encoderOverflows;
+  put16(stats.actuationLatencyMax);
+  put16(m_txDropped);
+  put16(stats.lineRetries);
+  payload[length++] = stats.illegalTransitions;
+  send(payload, length);
+}
+
 /*!
  * \brief Calculate CRC8 of a buffer.
  * \param buffer A pointer to a data buffer.
  * \param len The number of bytes of data in the data buffer.
  *
- * Based on
- * https://www.leonardomiliani.com/en/2013/un-semplice-crc8-per-arduino/
- *
- * CRC-8 - based on the CRC8 formulas by Dallas/Maxim
- * code released under the therms of the GNU GPL 3.0 license
- *
- * Faster code using a lookup table is available, if needed.
+ * CRC-8 - based on the CRC8 formulas by Dallas/Maxim,
+ * computed with a lookup table (see `Crc8`).
  */
 uint8_t Com::CRC8(const uint8_t *buffer, size_t len) const {
-  uint8_t crc = 0x00U;
-
-  while (len--) {
-    uint8_t extract = *buffer;
-    buffer++;
-
-    for (uint8_t tempI = 8U; tempI; tempI--) {
-      uint8_t sum = (crc ^ extract) & 0x01U;
-      crc >>= 1U;
-
-      if (sum) {
-        crc ^= 0x8CU;
-      }
-      extract >>= 1U;
-    }
-  }
-  return crc;
+  return Crc8::compute(buffer, len);
 }
-
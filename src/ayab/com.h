@@ -27,8 +27,11 @@
 #include <Arduino.h>
 #include <PacketSerial.h>
 
+#include "crc8.h"
 #include "encoders.h"
 #include "fsm.h"
+#include "line_codec.h"
+#include "ring_buffer.h"
 
 #ifndef AYAB_TESTS
   #include "version.h"
@@ -43,9 +46,43 @@ constexpr uint8_t API_VERSION = 6U;
 
 constexpr uint32_t SERIAL_BAUDRATE = 115200U;
 
+// Serial rates that the host can propose in `reqInit`, by index.
+// All of them are exact on a 16 MHz AVR.
+constexpr uint8_t NUM_SERIAL_BAUDRATES = 4U;
+constexpr uint32_t SERIAL_BAUDRATES[NUM_SERIAL_BAUDRATES] = {SERIAL_BAUDRATE, 250000U, 500000U, 1000000U};
+// After a change of rate the device goes back to the previous rate
+// unless the host sends a valid message at the new rate within this time.
+constexpr uint16_t SERIAL_FALLBACK_MS = 500U;
+
 constexpr uint8_t MAX_LINE_BUFFER_LEN = 25U;
 constexpr uint8_t MAX_MSG_BUFFER_LEN = 64U;
 
+// Length in bytes of each of the two transmit queues. Can be overridden
+// with a build flag, e.g. `-DTX_QUEUE_LEN=128`.
+#ifndef TX_QUEUE_LEN
+#define TX_QUEUE_LEN 64
+#endif
+
+// Number of pattern rows held on the device: the row that is being knitted
+// plus the rows that have been prefetched from the host. Can be overridden
+// with a build flag, e.g. `-DLINE_BUFFER_ROWS=4`.
+#ifndef LINE_BUFFER_ROWS
+#define LINE_BUFFER_ROWS 2
+#endif
+constexpr uint8_t NUM_LINE_BUFFERS = LINE_BUFFER_ROWS;
+// A power of two keeps the slot of a line number consistent when the
+// line number wraps around from 255 to 0.
+static_assert((NUM_LINE_BUFFERS > 0U) && ((NUM_LINE_BUFFERS & (NUM_LINE_BUFFERS - 1U)) == 0U),
+              "LINE_BUFFER_ROWS must be a power of two");
+
+/*!
+ * \brief Slot of the line buffer ring that holds a given line.
+ * \param lineNumber Line number (0-indexed and modulo 256).
+ */
+constexpr uint8_t lineBufferSlot(uint8_t lineNumber) {
+  return lineNumber & (NUM_LINE_BUFFERS - 1U);
+}
+
 enum class AYAB_API : unsigned char {
   reqStart = 0x01,
   cnfStart = 0xC1,
@@ -56,6 +93,7 @@ enum class AYAB_API : unsigned char {
   reqTest = 0x04,
   cnfTest = 0xC4,
   indState = 0x84,
+  indPositions = 0x85,
   helpCmd = 0x25,
   sendCmd = 0x26,
   beepCmd = 0x27,
@@ -69,6 +107,14 @@ enum class AYAB_API : unsigned char {
   quitCmd = 0x2F,
   reqInit = 0x05,
   cnfInit = 0xC5,
+  reqMotif = 0x06,
+  cnfMotif = 0xC6,
+  reqStats = 0x07,
+  cnfStats = 0xC7,
+  reqCounters = 0x08,
+  cnfCounters = 0xC8,
+  reqEdges = 0x09,
+  cnfEdges = 0xC9,
   testRes = 0xEE,
   debug = 0x9F
 };
@@ -76,7 +122,58 @@ using AYAB_API_t = enum AYAB_API;
 
 // API constants
 constexpr uint8_t INDSTATE_LEN = 10U;
+constexpr uint8_t INDPOSITIONS_HEADER_LEN = 6U;
 constexpr uint8_t REQLINE_LEN = 3U;
+constexpr uint8_t CNFSTATS_LEN = 45U;
+constexpr uint8_t CNFEDGES_HEADER_LEN = 5U;
+constexpr uint8_t CNFEDGES_EDGE_LEN = 4U;
+// Most edges carried by one `cnfEdges` message, so that it fits in
+// the transmit queue with its length, even if every byte is escaped
+constexpr uint8_t CNFEDGES_BATCH_LEN =
+    (TX_QUEUE_LEN - 3U - 2U * CNFEDGES_HEADER_LEN) / (2U * CNFEDGES_EDGE_LEN);
+static_assert(CNFEDGES_BATCH_LEN > 0U, "TX_QUEUE_LEN too short for cnfEdges");
+
+// Messages from the host are looked up in a table with this many slots.
+constexpr uint8_t API_SLOTS = 32U;
+// Messages from the host that are counted for `reqCounters`.
+constexpr uint8_t API_COUNTERS = 20U;
+
+/*!
+ * \brief Slot of a message from the host in the dispatch table.
+ * \param id Message ID.
+ *
+ * Requests 0x01 to 0x0F keep their number, tester commands 0x20 to
+ * 0x2F go to slots 16 to 31, and `cnfLine` (0x42) goes to slot 2.
+ * Other message IDs share these slots, and are told apart by the ID
+ * held in the table.
+ */
+constexpr uint8_t apiSlot(uint8_t id) {
+  return (id & 0x0FU) | ((id >> 1U) & 0x10U);
+}
+
+/*!
+ * \brief Bit of an `OpState` in the states in which a message is accepted.
+ */
+constexpr uint8_t opStateBit(OpState_t state) {
+  return 1U << static_cast<uint8_t>(state);
+}
+constexpr uint8_t ANY_OPSTATE = 0x3FU;
+
+// When the carriage position is reported while knitting, if continuous
+// reporting is enabled in `reqStart`.
+enum class ReportMode : unsigned char {
+  everyPosition = 0, // `indState` at every position
+  needles = 1,       // `indPositions` every N needles
+  time = 2,          // `indPositions` every N ms
+  events = 3,        // `indPositions` when the carriage turns or a line is finished
+};
+using ReportMode_t = enum ReportMode;
+
+// Most positions carried by one `indPositions` message (a power of two)
+constexpr uint8_t REPORT_BATCH_LEN = 8U;
+
+// defined in knitter.h, which includes this file
+struct KnitterStats;
 
 class ComInterface {
 public:
@@ -87,11 +184,16 @@ public:
   virtual void update() = 0;
   virtual void send(uint8_t *payload, size_t length) const = 0;
   virtual void sendMsg(AYAB_API_t id, const char *msg) = 0;
+  virtual void sendMsg_P(AYAB_API_t id, const char *msg) = 0;
   virtual void send_reqLine(const uint8_t lineNumber,
                             Err_t error = ErrorCode::success) const = 0;
   virtual void send_indState(Carriage_t carriage, uint8_t position,
                              Err_t error = ErrorCode::success) const = 0;
+  virtual bool send_indPositions(Carriage_t carriage, Direction_t direction,
+                                 uint16_t passed, const uint8_t *positions,
+                                 uint8_t count) const = 0;
   virtual void onPacketReceived(const uint8_t *buffer, size_t size) = 0;
+  virtual uint32_t getBaudRate() const = 0;
 };
 
 // Container class for the static methods that implement the serial API.
@@ -112,10 +214,15 @@ public:
   static void update();
   static void send(uint8_t *payload, size_t length);
   static void sendMsg(AYAB_API_t id, const char *msg);
+  static void sendMsg_P(AYAB_API_t id, const char *msg);
   static void send_reqLine(const uint8_t lineNumber, Err_t error = ErrorCode::success);
   static void send_indState(Carriage_t carriage, uint8_t position,
                              Err_t error = ErrorCode::success);
+  static bool send_indPositions(Carriage_t carriage, Direction_t direction,
+                                uint16_t passed, const uint8_t *positions,
+                                uint8_t count);
   static void onPacketReceived(const uint8_t *buffer, size_t size);
+  static uint32_t getBaudRate();
 
 private:
   static SLIPPacketSerial m_packetSerial;
@@ -127,28 +234,132 @@ public:
   void update() final;
   void send(uint8_t *payload, size_t length) const final;
   void sendMsg(AYAB_API_t id, const char *msg) final;
+  void sendMsg_P(AYAB_API_t id, const char *msg) final;
   void send_reqLine(const uint8_t lineNumber, Err_t error = ErrorCode::success) const final;
   void send_indState(Carriage_t carriage, uint8_t position,
                              Err_t error = ErrorCode::success) const final;
+  bool send_indPositions(Carriage_t carriage, Direction_t direction,
+                         uint16_t passed, const uint8_t *positions,
+                         uint8_t count) const final;
   void onPacketReceived(const uint8_t *buffer, size_t size) final;
+  uint32_t getBaudRate() const final;
 
 private:
-  PacketSerial_<SLIP, SLIP::END, MAX_MSG_BUFFER_LEN> m_packetSerial;
-  uint8_t lineBuffer[MAX_LINE_BUFFER_LEN] = {0};
+  // Only used to set the rate: messages are encoded by `enqueue()`
+  // and decoded by `receive()` as they arrive.
+  PacketSerial_<SLIP, SLIP::END, 1U> m_packetSerial;
+  // Pattern rows, reached through `m_lines` so that a row can be
+  // received into the spare staging row and committed by swapping
+  // pointers. The last entry of `m_lines` is the staging row.
+  uint8_t lineBuffer[NUM_LINE_BUFFERS + 1U][MAX_LINE_BUFFER_LEN] = {{0}};
+  uint8_t *m_lines[NUM_LINE_BUFFERS + 1U] = {nullptr};
   uint8_t msgBuffer[MAX_MSG_BUFFER_LEN] = {0};
+  // message being received, except for the pattern data of an
+  // uncompressed `cnfLine`, which goes to the staging row
+  uint8_t m_rxBuffer[MAX_MSG_BUFFER_LEN] = {0};
+  uint8_t m_rxLen = 0U;
+  bool m_rxEscape = false;
+  bool m_rxOverflow = false;
+  // the pattern data of an uncompressed `cnfLine` goes to the staging row
+  bool m_rxStaged = false;
+  Crc8 m_rxCrc;
+  // negotiated in `reqStart`
+  bool m_compressedLines = false;
+  // negotiated in `reqInit`, as an index into `SERIAL_BAUDRATES`
+  uint8_t m_baudRate = 0U;
+  uint8_t m_fallbackBaudRate = 0U;
+  bool m_baudRatePending = false;
+  unsigned long m_baudRateTime = 0U;
+  // Messages waiting to be written to the serial port, SLIP encoded and
+  // each preceded by its encoded length. Messages in the high priority
+  // queue go first. Mutable because sending does not change the state
+  // of the API.
+  using TxQueue = RingBuffer<uint8_t, TX_QUEUE_LEN>;
+  mutable TxQueue m_txHigh;
+  mutable TxQueue m_txLow;
+  // queue of the message being written, and its bytes still to write
+  mutable TxQueue *m_txCurrent = nullptr;
+  mutable uint8_t m_txRemaining = 0U;
+  // messages dropped while knitting, or because `mayDrop` was set
+  mutable uint16_t m_txDropped = 0U;
 
+  void setBaudRate(uint8_t baudRate);
+  static bool lowPriority(const uint8_t *payload);
+  bool enqueue(const uint8_t *payload, size_t length, bool mayDrop) const;
+  void encode(const uint8_t *payload, size_t length, TxQueue *queue) const;
+  bool drainTx(bool wait) const;
+  void receive(uint8_t c);
+  void endOfPacket();
+  LineEncoding_t lineEncoding(uint8_t flags) const;
+  void commitLine(uint8_t lineNumber, uint8_t flags);
+
+  // Handlers of messages from the host. The checks in `API_MESSAGES`
+  // have been passed by the time a handler is called.
+  using Handler = void (Com::*)(const uint8_t *buffer, size_t size);
+
+  /*!
+   * \brief How a message from the host is checked and handled.
+   */
+  struct ApiMessage {
+    uint8_t id;        // message ID, or 0 for an empty slot
+    uint8_t counter;   // index into `m_rxCount`
+    uint8_t minLength; // including the message ID and the checksum
+    uint8_t states;    // `OpState`s in which it is accepted, see `opStateBit()`
+    bool crc;          // ends in a checksum over the whole message
+    uint8_t reply;     // message reporting that it was rejected, or 0 for none
+    Handler handler;
+  };
+  // in program memory, by slot (see `apiSlot()`)
+  static const ApiMessage API_MESSAGES[API_SLOTS];
+
+  // messages received, by counter, and messages rejected or not recognized
+  uint8_t m_rxCount[API_COUNTERS] = {0};
+  uint16_t m_rxRejected = 0U;
+  uint16_t m_rxUnrecognized = 0U;
+
+  void reject(uint8_t reply, Err_t error);
+  void rejectOverflow(uint8_t id);
+  void countMessage(const ApiMessage &msg);
   void h_reqInit(const uint8_t *buffer, size_t size);
   void h_reqStart(const uint8_t *buffer, size_t size);
+  void h_reqMotif(const uint8_t *buffer, size_t size);
+  void h_reqStats(const uint8_t *buffer, size_t size);
+  void h_reqCounters(const uint8_t *buffer, size_t size);
+  void h_reqEdges(const uint8_t *buffer, size_t size);
   void h_cnfLine(const uint8_t *buffer, size_t size);
-  void h_reqInfo() const;
-  void h_reqTest() const;
+  void h_reqInfo(const uint8_t *buffer, size_t size);
+  void h_reqTest(const uint8_t *buffer, size_t size);
   void h_unrecognized() const;
 
+  // tester commands, with and without arguments
+  template <void (*command)()>
+  void h_testCmd(const uint8_t *buffer, size_t size) {
+    (void)buffer;
+    (void)size;
+    command();
+  }
+  template <void (*command)(const uint8_t *buffer, size_t size)>
+  void h_testCmdArgs(const uint8_t *buffer, size_t size) {
+    command(buffer, size);
+  }
+
   void send_cnfInfo() const;
-  void send_cnfInit(Err_t error) const;
+  void send_cnfInit(Err_t error, uint8_t baudRate) const;
   void send_cnfStart(Err_t error) const;
   void send_cnfTest(Err_t error) const;
+  void send_cnfMotif(Err_t error) const;
+  void send_cnfStats(const KnitterStats &stats) const;
   uint8_t CRC8(const uint8_t *buffer, size_t len) const;
+
+#if AYAB_TESTS
+  FRIEND_TEST(ComTest, test_cnfline_compressed);
+  FRIEND_TEST(ComTest, test_send_priority);
+  FRIEND_TEST(ComTest, test_reqStats);
+  FRIEND_TEST(ComTest, test_api_messages);
+  FRIEND_TEST(ComTest, test_dispatch);
+  FRIEND_TEST(ComTest, test_reqCounters);
+  FRIEND_TEST(ComBenchmark, bench_protocol);
+#endif
 };
 
 #endif // COM_H_
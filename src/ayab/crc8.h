@@ -0,0 +1,70 @@
+/*!
+ * \file crc8.h
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#ifndef CRC8_H_
+#define CRC8_H_
+
+#include <Arduino.h>
+
+// Lookup table for one byte of CRC-8 (Dallas/Maxim), in program memory
+extern const uint8_t CRC8_TABLE[256] PROGMEM;
+
+/*!
+ * \brief CRC-8 (Dallas/Maxim) checksum of the API messages.
+ *
+ * Reflected polynomial 0x8C with an initial value of 0. The checksum
+ * can be accumulated a byte at a time, for example while a message is
+ * being decoded, or computed over a whole buffer.
+ */
+class Crc8 final {
+public:
+  /*!
+   * \brief Add a byte to the checksum.
+   */
+  void update(uint8_t data) {
+    m_crc = pgm_read_byte(&CRC8_TABLE[m_crc ^ data]);
+  }
+
+  void update(const uint8_t *buffer, size_t len);
+
+  /*!
+   * \brief Checksum of the bytes added so far.
+   */
+  uint8_t value() const {
+    return m_crc;
+  }
+
+  /*!
+   * \brief Start a new checksum.
+   */
+  void reset() {
+    m_crc = 0x00U;
+  }
+
+  static uint8_t compute(const uint8_t *buffer, size_t len);
+
+private:
+  uint8_t m_crc = 0x00U;
+};
+
+#endif // CRC8_H_
@@ -30,12 +30,12 @@ This file is part of AYAB.
  */
 #ifdef DEBUG
 #define DEBUG_PRINT(str)                                                       \
-  Serial.print("#");                                                           \
+  Serial.print(F("#"));                                                        \
   Serial.print(millis());                                                      \
-  Serial.print(": ");                                                          \
+  Serial.print(F(": "));                                                       \
   Serial.print(__FUNCTION__);                                                  \
-  Serial.print("() in ");                                                      \
-  Serial.print(__FILE__);                                                      \
+  Serial.print(F("() in "));                                                   \
+  Serial.print(F(__FILE__));                                                   \
   Serial.print(':');                                                           \
   Serial.print(__LINE__);                                                      \
   Serial.print(' ');                                                           \
@@ -27,40 +27,71 @@
 #include <Arduino.h>
 
 #include "encoders.h"
+#include "fast_pin.h"
 
 
 /*!
  * \brief Service encoder A interrupt routine.
  *
- * Determines edge of signal and dispatches to private rising/falling functions.
- * `m_machineType` assumed valid.
+ * Decodes the encoder signals, and dispatches the edges of signal A
+ * to private rising/falling functions.
+ * `init()` must have been called to select the edge handlers.
  */
 void Encoders::encA_interrupt() {
-  m_hallActive = Direction_t::NoDirection;
+  decode();
+}
 
-  auto currentState = static_cast<bool>(digitalRead(ENC_PIN_A));
+/*!
+ * \brief Service encoder B interrupt routine.
+ *
+ * Decodes the encoder signals in the same way, since an edge of A
+ * that happens before the interrupt of A is serviced is found by
+ * this interrupt instead.
+ */
+void Encoders::encB_interrupt() {
+  decode();
+}
 
-  if (!m_oldState && currentState) {
-    encA_rising();
-  } else if (m_oldState && !currentState) {
-    encA_falling();
-  }
-  m_oldState = currentState;
+/*!
+ * \brief Service ADC conversion complete interrupt routine.
+ *
+ * Keeps the result for the sensor that was converted, and starts
+ * a conversion of the other sensor, so that the ADC runs on its own
+ * and the encoder interrupt never waits for it.
+ */
+void Encoders::adc_interrupt() {
+  auto channel = static_cast<uint8_t>(m_adcChannel);
+#ifdef __AVR__
+  m_hallValue[channel] = ADC;
+#else
+  // There is no ADC on the host, the analog input stands in for it.
+  m_hallValue[channel] = static_cast<uint16_t>(
+      analogRead(Direction_t::Left == m_adcChannel ? EOL_PIN_L : EOL_PIN_R));
+#endif
+  m_adcChannel = Direction_t::Left == m_adcChannel ? Direction_t::Right
+                                                   : Direction_t::Left;
+  startConversion();
 }
 
 /*!
  * \brief Read hall sensor on left and right.
  * \param pSensor Which sensor to read (left or right).
+ * \return Latest sample from the ADC.
  */
 uint16_t Encoders::getHallValue(Direction_t pSensor) {
+  uint16_t hallValue = 0U;
   switch (pSensor) {
   case Direction_t::Left:
-    return analogRead(EOL_PIN_L);
   case Direction_t::Right:
-    return analogRead(EOL_PIN_R);
+    // a sample is two bytes, and may be replaced in between
+    noInterrupts();
+    hallValue = m_hallValue[static_cast<uint8_t>(pSensor)];
+    interrupts();
+    break;
   default:
-    return 0;
+    break;
   }
+  return hallValue;
 }
 
 /*!
@@ -69,6 +100,20 @@ uint16_t Encoders::getHallValue(Direction_t pSensor) {
  */
 void Encoders::init(Machine_t machineType) {
   m_machineType = machineType;
+  switch (machineType) {
+  case Machine_t::Kh930:
+    m_encA_rising = &Encoders::encA_rising<Machine_t::Kh930>;
+    m_encA_falling = &Encoders::encA_falling<Machine_t::Kh930>;
+    break;
+  case Machine_t::Kh270:
+    m_encA_rising = &Encoders::encA_rising<Machine_t::Kh270>;
+    m_encA_falling = &Encoders::encA_falling<Machine_t::Kh270>;
+    break;
+  default:
+    m_encA_rising = &Encoders::encA_rising<Machine_t::Kh910>;
+    m_encA_falling = &Encoders::encA_falling<Machine_t::Kh910>;
+    break;
+  }
   m_position = 0U;
   m_direction = Direction_t::NoDirection;
   m_hallActive = Direction_t::NoDirection;
@@ -76,9 +121,27 @@ void Encoders::init(Machine_t machineType) {
   m_carriage = Carriage_t::NoCarriage;
   m_previousDetectedCarriageLeft = Carriage_t::NoCarriage;
   m_previousDetectedCarriageRight = Carriage_t::NoCarriage;
-  m_oldState = false;
+  // start decoding from the levels the signals have now
+  m_quadState = readQuadState();
+  m_illegalTransitions = 0U;
+  m_debounceTime = ENCODER_DEBOUNCE_US;
+  m_edgeTime = 0U;
   m_passedLeft = false;
   m_passedRight = false;
+
+  if (machineType == Machine_t::Kh910) {
+    probeLaceSignal();
+  } else {
+    pinMode(EOL_PIN_R, INPUT);
+  }
+#ifdef __AVR__
+  // Start converting the Hall sensors, unless already running.
+  if (bit_is_clear(ADCSRA, ADIE)) {
+    m_adcChannel = Direction_t::Left;
+    ADCSRA |= _BV(ADIE);
+    startConversion();
+  }
+#endif
 }
 
 /*!
@@ -123,48 +186,137 @@ Machine_t Encoders::getMachineType() {
   return m_machineType;
 }
 
+/*!
+ * \brief Get the number of illegal encoder transitions.
+ * \param reset Start counting afresh.
+ *
+ * An illegal transition is one in which both encoder signals have
+ * changed since the last edge, because an edge was missed or was
+ * a glitch. The direction cannot be told, so the position is left
+ * as it was until the carriage passes the next turn mark.
+ */
+uint8_t Encoders::getIllegalTransitions(bool reset) {
+  uint8_t illegalTransitions = m_illegalTransitions;
+  if (reset) {
+    m_illegalTransitions = 0U;
+  }
+  return illegalTransitions;
+}
+
 // Private Methods
 
-Carriage_t Encoders::detectCarriageLeft() {
-  uint16_t hallValue = analogRead(EOL_PIN_L);
-  if (hallValue > FILTER_L_MAX[static_cast<uint8_t>(m_machineType)]) {
+/*!
+ * \brief Read the levels of both encoder signals.
+ * \return Quadrature state, `QUADRATURE_A|B`.
+ */
+uint8_t Encoders::readQuadState() {
+  return (EncPinA::read() ? QUADRATURE_A : 0U) |
+         (EncPinB::read() ? QUADRATURE_B : 0U);
+}
+
+/*!
+ * \brief Quadrature decoder, called on the edges of either signal.
+ *
+ * The levels of both signals are compared with the last accepted
+ * state. A change of A alone is an edge that moves the carriage, in
+ * the direction given by the level of B, and is the only change that
+ * updates which Hall sensor is active. A change of B alone is only
+ * kept, and a change of both is counted as illegal. An interrupt
+ * after which neither signal has changed, as happens when a signal
+ * bounces back, does nothing.
+ */
+void Encoders::decode() {
+  uint8_t state = readQuadState();
+  uint8_t change = state ^ m_quadState;
+  if (0U == change) {
+    return;
+  }
+  if (m_debounceTime > 0U) {
+    // Ignored edges are not lost: the signals are read again
+    // at the next edge of either of them.
+    auto now = static_cast<uint16_t>(micros());
+    if (static_cast<uint16_t>(now - m_edgeTime) < m_debounceTime) {
+      return;
+    }
+    m_edgeTime = now;
+  }
+  m_quadState = state;
+
+  if ((QUADRATURE_A | QUADRATURE_B) == change) {
+    if (m_illegalTransitions < UINT8_MAX) {
+      ++m_illegalTransitions;
+    }
+  } else if (QUADRATURE_A == change) {
+    m_hallActive = Direction_t::NoDirection;
+    if (state & QUADRATURE_A) {
+      (this->*m_encA_rising)();
+    } else {
+      (this->*m_encA_falling)();
+    }
+  }
+}
+
+/*!
+ * \brief Start converting the Hall sensor `m_adcChannel`.
+ *
+ * The prescaler set up by the Arduino core gives 104 us per
+ * conversion, so each sensor is sampled every 208 us.
+ */
+void Encoders::startConversion() {
+#ifdef __AVR__
+  uint8_t pin = Direction_t::Left == m_adcChannel ? EOL_PIN_L : EOL_PIN_R;
+  // AVcc reference, as `analogRead()` uses by default
+  ADMUX = _BV(REFS0) | ((pin - A0) & 0x07);
+  ADCSRA |= _BV(ADSC);
+#endif
+}
+
+/*!
+ * \brief Set up the KH910 right sensor pins, and find out whether
+ * the lace signal is connected.
+ *
+ * Shields with the lace signal connected also have `EOL_PIN_R_DETECT`
+ * wired to `EOL_PIN_R_L`, so that driving it low pulls the lace signal
+ * low. It is released again afterwards, and the pins are left as the
+ * encoder interrupt reads them.
+ */
+void Encoders::probeLaceSignal() {
+  pinMode(EOL_PIN_R, INPUT_PULLUP);
+  pinMode(EOL_PIN_R_L, INPUT_PULLUP);
+  pinMode(EOL_PIN_R_DETECT, OUTPUT);
+  digitalWrite(EOL_PIN_R_DETECT, LOW);
+  delayMicroseconds(10);
+  m_laceSignal = digitalRead(EOL_PIN_R_L) == LOW;
+  pinMode(EOL_PIN_R_DETECT, INPUT);
+}
+
+template <Machine_t M> Carriage_t Encoders::detectCarriageLeft() {
+  uint16_t hallValue = m_hallValue[static_cast<uint8_t>(Direction_t::Left)];
+  if (hallValue > MachineTraits<M>::filterLMax) {
     return Carriage_t::Knit;
-  } else if (hallValue < FILTER_L_MIN[static_cast<uint8_t>(m_machineType)]){
+  } else if (hallValue < MachineTraits<M>::filterLMin){
     return Carriage_t::Lace;
   }
   return Carriage_t::NoCarriage;
 }
 
-Carriage_t Encoders::detectCarriageRight() {
-  if (m_machineType == MachineType::Kh910) {
-    pinMode(EOL_PIN_R_L, INPUT_PULLUP);
-    // Set EOL_PIN_R_DETECT to LOW to detect if it is connected to EOL_PIN_R_L
-    pinMode(EOL_PIN_R_DETECT, OUTPUT);
-    digitalWrite(EOL_PIN_R_DETECT, LOW);
-    delayMicroseconds(10);
-    // If pins EOL_PIN_R_DETECT and EOL_PIN_R_L are shorted,
-    // it means the lace signal is connected
-    if (digitalRead(EOL_PIN_R_L) == LOW) {
-      // Release EOL_PIN_R_DETECT
-      pinMode(EOL_PIN_R_DETECT, INPUT);
-      delayMicroseconds(10);
-      // If the lace signal goes high, it means the lace carriage is detected
-      if (digitalRead(EOL_PIN_R_L) == HIGH) {
-        return Carriage_t::Lace;
-      }
+template <Machine_t M> Carriage_t Encoders::detectCarriageRight() {
+  if (MachineTraits<M>::digitalRightSensor) {
+    // The pins were set up by `probeLaceSignal()`.
+    // The lace signal is active-high, if it is connected at all.
+    if (m_laceSignal && EolPinRL::read()) {
+      return Carriage_t::Lace;
     }
 
     // The knit signal is active-low
-    pinMode(EOL_PIN_R, INPUT_PULLUP);
-    if (digitalRead(EOL_PIN_R) == LOW) {
+    if (!EolPinR::read()) {
       return Carriage_t::Knit;
     }
   } else {
-    pinMode(EOL_PIN_R, INPUT);
-    uint16_t hallValue = analogRead(EOL_PIN_R);
-    if (hallValue > FILTER_R_MAX[static_cast<uint8_t>(m_machineType)]) {
+    uint16_t hallValue = m_hallValue[static_cast<uint8_t>(Direction_t::Right)];
+    if (hallValue > MachineTraits<M>::filterRMax) {
       return Carriage_t::Knit;
-    } else if (hallValue < FILTER_R_MIN[static_cast<uint8_t>(m_machineType)]){
+    } else if (hallValue < MachineTraits<M>::filterRMin){
       return Carriage_t::Lace;
     }
   }
@@ -174,26 +326,27 @@ Carriage_t Encoders::detectCarriageRight() {
 /*!
  * \brief Interrupt service subroutine.
  *
- * Called when encoder pin A is rising.
+ * Called by the decoder when encoder signal A is rising.
  * Must execute as fast as possible.
- * Bounds on `m_machineType` not checked.
+ * Instantiated for each machine type, so that the machine
+ * constants are known at compile time.
  */
-void Encoders::encA_rising() {
+template <Machine_t M> void Encoders::encA_rising() {
   // Update direction
-  m_direction = digitalRead(ENC_PIN_B) != 0 ? Direction_t::Right : Direction_t::Left;
+  m_direction = (m_quadState & QUADRATURE_B) ? Direction_t::Right : Direction_t::Left;
 
   // Update carriage position
   if (Direction_t::Right == m_direction) {
     m_position = m_position + (uint8_t) 1;
 
     // Reset carriage passed state when we know all magnets have cleared the turn mark.
-    if (m_position > ALL_MAGNETS_CLEARED_LEFT[static_cast<uint8_t>(m_machineType)]) {
+    if (m_position > MachineTraits<M>::allMagnetsClearedLeft) {
       m_passedLeft = false;
     }
   }
 
   // Scan for carriage in front of left Hall sensor
-  Carriage_t detected_carriage = detectCarriageLeft();
+  Carriage_t detected_carriage = detectCarriageLeft<M>();
   Carriage_t previous_detected_carriage = m_previousDetectedCarriageLeft;
   m_previousDetectedCarriageLeft = detected_carriage;
 
@@ -221,17 +374,17 @@ void Encoders::encA_rising() {
     // So there's no need to special-case position detection for the KH270 carriage.
 
     // KH270 has no belt shift
-    if (m_machineType != Machine_t::Kh270) {
+    if (MachineTraits<M>::hasBeltShift) {
       // Only set the belt shift the first time a magnet passes the turn mark.
       // Headed to the right.
       if (!m_passedLeft && Direction_t::Right == m_direction) {
         // Belt shift signal only decided in front of hall sensor
-        m_beltShift = digitalRead(ENC_PIN_C) != 0 ? BeltShift::Shifted : BeltShift::Regular;
+        m_beltShift = EncPinC::read() ? BeltShift::Shifted : BeltShift::Regular;
         m_passedLeft = true;
       }
     }
 
-    uint8_t start_position = END_LEFT_PLUS_OFFSET[static_cast<uint8_t>(m_machineType)];
+    uint8_t start_position = MachineTraits<M>::endLeftPlusOffset;
 
     if (m_carriage == Carriage_t::Lace &&
                detected_carriage == Carriage_t::Knit &&
@@ -265,26 +418,27 @@ void Encoders::encA_rising() {
 /*!
  * \brief Interrupt service subroutine.
  *
- * Called when encoder pin A is falling.
+ * Called by the decoder when encoder signal A is falling.
  * Must execute as fast as possible.
- * Bounds on `m_machineType` not checked.
+ * Instantiated for each machine type, so that the machine
+ * constants are known at compile time.
  */
-void Encoders::encA_falling() {
+template <Machine_t M> void Encoders::encA_falling() {
   // Update direction
-  m_direction = digitalRead(ENC_PIN_B) ? Direction_t::Left : Direction_t::Right;
+  m_direction = (m_quadState & QUADRATURE_B) ? Direction_t::Left : Direction_t::Right;
 
   // Update carriage position
   if (Direction_t::Left == m_direction) {
     m_position = m_position - (uint8_t) 1;
 
     // Reset carriage passed state when we know all magnets have cleared the turn mark.
-    if (m_position < ALL_MAGNETS_CLEARED_RIGHT[static_cast<uint8_t>(m_machineType)]) {
+    if (m_position < MachineTraits<M>::allMagnetsClearedRight) {
       m_passedRight = false;
     }
   }
 
   // Scan for carriage in front of right Hall sensor
-  Carriage_t detected_carriage = detectCarriageRight();
+  Carriage_t detected_carriage = detectCarriageRight<M>();
   Carriage_t previous_detected_carriage = m_previousDetectedCarriageRight;
   m_previousDetectedCarriageRight = detected_carriage;
 
@@ -312,19 +466,19 @@ void Encoders::encA_falling() {
     // So there's no need to special-case position detection for the KH270 carriage.
 
     // KH270 has no belt shift
-    if (m_machineType != Machine_t::Kh270) {
+    if (MachineTraits<M>::hasBeltShift) {
       // Only set the belt shift the first time a magnet passes the turn mark.
       // Headed to the left.
       if (!m_passedRight && Direction_t::Left == m_direction) {
         // Belt shift signal only decided in front of hall sensor
-        m_beltShift = digitalRead(ENC_PIN_C) != 0 ? BeltShift::Regular : BeltShift::Shifted;
+        m_beltShift = EncPinC::read() ? BeltShift::Regular : BeltShift::Shifted;
         m_passedRight = true;
 
         // Shift doesn't need to be swapped for the g-carriage in this direction.
       }
     }
 
-    uint8_t start_position = END_RIGHT_MINUS_OFFSET[static_cast<uint8_t>(m_machineType)];
+    uint8_t start_position = MachineTraits<M>::endRightMinusOffset;
 
     if (m_carriage == Carriage_t::Lace &&
                detected_carriage == Carriage_t::Knit &&
@@ -346,3 +500,12 @@ void Encoders::encA_falling() {
     m_position = start_position;
   }
 }
+
+#ifdef __AVR__
+/*!
+ * \brief ADC conversion complete.
+ */
+ISR(ADC_vect) {
+  GlobalEncoders::adc_interrupt();
+}
+#endif
@@ -86,6 +86,19 @@ constexpr uint8_t GARTER_SLOP = 2U;
 // we need to adjust the position by this distance when starting from the right.
 constexpr uint8_t GARTER_L_MAGNET_SPACING = 24U;
 
+// Quadrature state of the encoder signals, as kept by the decoder
+constexpr uint8_t QUADRATURE_A = 0x02U;
+constexpr uint8_t QUADRATURE_B = 0x01U;
+
+// Edges of the encoder signals that come sooner than this after the
+// previous edge are taken as contact bounce, and ignored. Off unless
+// set with a build flag, e.g. `-DENCODER_DEBOUNCE_TIME=20`, so that the
+// encoder interrupt does not call `micros()`.
+#ifndef ENCODER_DEBOUNCE_TIME
+#define ENCODER_DEBOUNCE_TIME 0 // us
+#endif
+constexpr uint16_t ENCODER_DEBOUNCE_US = ENCODER_DEBOUNCE_TIME;
+
 constexpr uint8_t START_OFFSET[NUM_MACHINES][NUM_DIRECTIONS][NUM_CARRIAGES] = {
     // KH910
     {
@@ -117,6 +130,34 @@ constexpr uint16_t FILTER_R_MAX[NUM_MACHINES] = {1023U, 600U, 600U};
 
 constexpr uint16_t SOLENOIDS_BITMASK = 0xFFFFU;
 
+/*!
+ * \brief Machine constants for one machine type, known at compile time.
+ *
+ * Code templated on the machine type uses these instead of
+ * indexing the tables above at run time.
+ */
+template <Machine_t M> struct MachineTraits {
+  static constexpr uint8_t index = static_cast<uint8_t>(M);
+  static_assert(index < NUM_MACHINES, "invalid machine type");
+
+  static constexpr uint8_t numNeedles = NUM_NEEDLES[index];
+  static constexpr uint8_t endOfLineOffsetL = END_OF_LINE_OFFSET_L[index];
+  static constexpr uint8_t endOfLineOffsetR = END_OF_LINE_OFFSET_R[index];
+  static constexpr uint8_t endLeftPlusOffset = END_LEFT_PLUS_OFFSET[index];
+  static constexpr uint8_t endRightMinusOffset = END_RIGHT_MINUS_OFFSET[index];
+  static constexpr uint8_t allMagnetsClearedLeft = ALL_MAGNETS_CLEARED_LEFT[index];
+  static constexpr uint8_t allMagnetsClearedRight = ALL_MAGNETS_CLEARED_RIGHT[index];
+  static constexpr uint16_t filterLMin = FILTER_L_MIN[index];
+  static constexpr uint16_t filterLMax = FILTER_L_MAX[index];
+  static constexpr uint16_t filterRMin = FILTER_R_MIN[index];
+  static constexpr uint16_t filterRMax = FILTER_R_MAX[index];
+
+  // KH270 has no belt shift
+  static constexpr bool hasBeltShift = M != Machine_t::Kh270;
+  // KH910 has separate digital signals for the right-hand sensor
+  static constexpr bool digitalRightSensor = M == Machine_t::Kh910;
+};
+
 /*!
  * \brief Encoder interface.
  *
@@ -128,6 +169,8 @@ public:
 
   // any methods that need to be mocked should go here
   virtual void encA_interrupt() = 0;
+  virtual void encB_interrupt() = 0;
+  virtual void adc_interrupt() = 0;
   virtual uint16_t getHallValue(Direction_t pSensor) = 0;
   virtual void init(Machine_t machineType) = 0;
   virtual Machine_t getMachineType() = 0;
@@ -136,6 +179,7 @@ public:
   virtual Direction_t getDirection() = 0;
   virtual Direction_t getHallActive() = 0;
   virtual uint8_t getPosition() = 0;
+  virtual uint8_t getIllegalTransitions(bool reset) = 0;
 };
 
 // Container class for the static methods for the encoders.
@@ -153,6 +197,8 @@ public:
   static EncodersInterface *m_instance;
 
   static void encA_interrupt();
+  static void encB_interrupt();
+  static void adc_interrupt();
   static uint16_t getHallValue(Direction_t pSensor);
   static void init(Machine_t machineType);
   static Machine_t getMachineType();
@@ -161,6 +207,7 @@ public:
   static Direction_t getDirection();
   static Direction_t getHallActive();
   static uint8_t getPosition();
+  static uint8_t getIllegalTransitions(bool reset);
 };
 
 class Encoders : public EncodersInterface {
@@ -168,6 +215,8 @@ public:
   Encoders() = default;
 
   void encA_interrupt() final;
+  void encB_interrupt() final;
+  void adc_interrupt() final;
   uint16_t getHallValue(Direction_t pSensor) final;
   void init(Machine_t machineType) final;
   Machine_t getMachineType() final;
@@ -176,6 +225,7 @@ public:
   Direction_t getDirection() final;
   Direction_t getHallActive() final;
   uint8_t getPosition() final;
+  uint8_t getIllegalTransitions(bool reset) final;
 
 private:
   Machine_t m_machineType;
@@ -187,14 +237,44 @@ private:
   volatile Direction_t m_direction;
   volatile Direction_t m_hallActive;
   volatile uint8_t m_position;
-  volatile bool m_oldState;
+  // last accepted levels of the encoder signals, `QUADRATURE_A|B`
+  volatile uint8_t m_quadState;
+  // edges after which both signals had changed, so that the
+  // direction could not be told
+  volatile uint8_t m_illegalTransitions;
+  // `ENCODER_DEBOUNCE_US`, or 0 for none, and the time of the last
+  // accepted edge
+  uint16_t m_debounceTime;
+  volatile uint16_t m_edgeTime;
   volatile bool m_passedLeft;
   volatile bool m_passedRight;
 
-  Carriage_t detectCarriageLeft();
-  Carriage_t detectCarriageRight();
-  void encA_rising();
-  void encA_falling();
+  // Latest Hall sensor samples, indexed by `Direction_t`. The ADC
+  // converts the sensors in turn, and the sensor being converted
+  // is `m_adcChannel`.
+  volatile uint16_t m_hallValue[NUM_DIRECTIONS];
+  volatile Direction_t m_adcChannel;
+
+  // KH910 lace signal connected, as found by `init()`
+  bool m_laceSignal;
+
+  static uint8_t readQuadState();
+  void decode();
+  void startConversion();
+  void probeLaceSignal();
+
+  // edge handlers for the machine type, selected in `init()`
+  void (Encoders::*m_encA_rising)();
+  void (Encoders::*m_encA_falling)();
+
+  template <Machine_t M> Carriage_t detectCarriageLeft();
+  template <Machine_t M> Carriage_t detectCarriageRight();
+  template <Machine_t M> void encA_rising();
+  template <Machine_t M> void encA_falling();
+
+#if AYAB_TESTS
+  FRIEND_TEST(EncodersTest, test_debounce);
+#endif
 };
 
 #endif // ENCODERS_H_
@@ -0,0 +1,87 @@
+/*!
+ * \file fast_pin.h
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#ifndef FAST_PIN_H_
+#define FAST_PIN_H_
+
+#include "board.h"
+
+/*!
+ * \brief Digital pin known at compile time.
+ *
+ * On the Uno, `read()` and `write()` compile to a single `sbic`/`sbis`,
+ * `sbi`, or `cbi` instruction on the pin's port, of 1 or 2 cycles,
+ * where `digitalRead()` and `digitalWrite()` take about 50 cycles to
+ * look the port up in the pin tables and turn off any PWM timer. Only
+ * use it for pins that are never driven by `analogWrite()`.
+ *
+ * On the host, it calls `digitalRead()` and `digitalWrite()`, so that
+ * the tests and the simulator see the same pin accesses as before.
+ */
+template <uint8_t P> class FastPin {
+  static_assert(P < 20U, "the Uno has digital pins 0 to 19");
+
+public:
+  static bool read() {
+#ifdef __AVR__
+    return bit_is_set(in(), BIT);
+#else
+    return digitalRead(P) != LOW;
+#endif
+  }
+
+  static void write(bool value) {
+#ifdef __AVR__
+    if (value) {
+      out() |= _BV(BIT);
+    } else {
+      out() &= static_cast<uint8_t>(~_BV(BIT));
+    }
+#else
+    digitalWrite(P, value ? HIGH : LOW);
+#endif
+  }
+
+private:
+#ifdef __AVR__
+  // pins 0-7 are on port D, 8-13 on port B, and A0-A5 on port C
+  static constexpr uint8_t BIT = (P < 8U) ? P : (P < 14U) ? P - 8U : P - 14U;
+
+  static volatile uint8_t &in() {
+    return (P < 8U) ? PIND : (P < 14U) ? PINB : PINC;
+  }
+  static volatile uint8_t &out() {
+    return (P < 8U) ? PORTD : (P < 14U) ? PORTB : PORTC;
+  }
+#endif
+};
+
+using EncPinA = FastPin<ENC_PIN_A>;
+using EncPinB = FastPin<ENC_PIN_B>;
+using EncPinC = FastPin<ENC_PIN_C>;
+using EolPinR = FastPin<EOL_PIN_R>;
+using EolPinRL = FastPin<EOL_PIN_R_L>;
+using LedPinA = FastPin<LED_PIN_A>;
+using LedPinB = FastPin<LED_PIN_B>;
+
+#endif // FAST_PIN_H_
@@ -32,6 +32,7 @@
 #include <Arduino.h>
 
 #include "com.h"
+#include "fast_pin.h"
 #include "fsm.h"
 #include "knitter.h"
 
@@ -109,14 +110,14 @@ void Fsm::dispatch() {
  * \brief Action of machine in state `wait_for_machine`.
  */
 void Fsm::state_wait_for_machine() const {
-  digitalWrite(LED_PIN_A, LOW); // green LED off
+  LedPinA::write(LOW); // green LED off
 }
 
 /*!
  * \brief Action of machine in state `OpState::init`.
  */
 void Fsm::state_init() {
-  digitalWrite(LED_PIN_A, LOW); // green LED off
+  LedPinA::write(LOW); // green LED off
   if (GlobalKnitter::isReady()) {
     setState(OpState::ready);
   }
@@ -126,14 +127,14 @@ void Fsm::state_init() {
  * \brief Action of machine in state `OpState::ready`.
  */
 void Fsm::state_ready() const {
-  digitalWrite(LED_PIN_A, LOW); // green LED off
+  LedPinA::write(LOW); // green LED off
 }
 
 /*!
  * \brief Action of machine in state `OpState::knit`.
  */
 void Fsm::state_knit() const {
-  digitalWrite(LED_PIN_A, HIGH); // green LED on
+  LedPinA::write(HIGH); // green LED on
   GlobalKnitter::knit();
 }
 
@@ -155,7 +156,7 @@ void Fsm::state_test() const {
 void Fsm::state_error() {
   if (m_nextState == OpState::init) {
     // exit error state
-    digitalWrite(LED_PIN_B, LOW); // yellow LED off
+    LedPinB::write(LOW); // yellow LED off
     GlobalKnitter::init();
     return;
   }
@@ -163,8 +164,8 @@ void Fsm::state_error() {
   // send `indState` and flash LEDs
   unsigned long now = millis();
   if (now - m_flashTime >= FLASH_DELAY) {
-    digitalWrite(LED_PIN_A, m_flash);  // green LED
-    digitalWrite(LED_PIN_B, !m_flash); // yellow LED
+    LedPinA::write(m_flash);  // green LED
+    LedPinB::write(!m_flash); // yellow LED
     m_flash = !m_flash;
     m_flashTime = now;
 
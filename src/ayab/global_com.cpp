@@ -44,10 +44,18 @@ void GlobalCom::sendMsg(AYAB_API_t id, const char *msg) {
   m_instance->sendMsg(id, msg);
 }
 
+void GlobalCom::sendMsg_P(AYAB_API_t id, const char *msg) {
+  m_instance->sendMsg_P(id, msg);
+}
+
 // GCOVR_EXCL_START
 void GlobalCom::onPacketReceived(const uint8_t *buffer, size_t size) {
   m_instance->onPacketReceived(buffer, size);
 }
+
+uint32_t GlobalCom::getBaudRate() {
+  return m_instance->getBaudRate();
+}
 // GCOVR_EXCL_STOP
 
 void GlobalCom::send_reqLine(const uint8_t lineNumber, Err_t error) {
@@ -58,3 +66,10 @@ void GlobalCom::send_indState(Carriage_t carriage, uint8_t position,
                               Err_t error) {
   m_instance->send_indState(carriage, position, error);
 }
+
+bool GlobalCom::send_indPositions(Carriage_t carriage, Direction_t direction,
+                                  uint16_t passed, const uint8_t *positions,
+                                  uint8_t count) {
+  return m_instance->send_indPositions(carriage, direction, passed, positions,
+                                       count);
+}
@@ -29,6 +29,14 @@ void GlobalEncoders::encA_interrupt() {
   m_instance->encA_interrupt();
 }
 
+void GlobalEncoders::encB_interrupt() {
+  m_instance->encB_interrupt();
+}
+
+void GlobalEncoders::adc_interrupt() {
+  m_instance->adc_interrupt();
+}
+
 uint16_t GlobalEncoders::getHallValue(Direction_t pSensor) {
   return m_instance->getHallValue(pSensor);
 }
@@ -56,3 +64,7 @@ Direction_t GlobalEncoders::getHallActive() {
 uint8_t GlobalEncoders::getPosition() {
   return m_instance->getPosition();
 }
+
+uint8_t GlobalEncoders::getIllegalTransitions(bool reset) {
+  return m_instance->getIllegalTransitions(reset);
+}
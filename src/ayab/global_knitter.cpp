@@ -46,7 +46,7 @@ Err_t GlobalKnitter::initMachine(Machine_t machine) {
 }
 
 Err_t GlobalKnitter::startKnitting(uint8_t startNeedle,
-                                   uint8_t stopNeedle, uint8_t *pattern_start,
+                                   uint8_t stopNeedle, uint8_t *const *pattern_start,
                                    bool continuousReportingEnabled) {
   return m_instance->startKnitting(startNeedle, stopNeedle,
                                    pattern_start, continuousReportingEnabled);
@@ -84,6 +84,32 @@ void GlobalKnitter::setLastLine() {
   m_instance->setLastLine();
 }
 
+void GlobalKnitter::nackLine(Err_t error) {
+  m_instance->nackLine(error);
+}
+
 void GlobalKnitter::setMachineType(Machine_t machineType) {
   m_instance->setMachineType(machineType);
 }
+
+Err_t GlobalKnitter::setMotif(uint8_t width, uint8_t height, uint16_t rows,
+                              uint8_t firstRow, const uint8_t *bitmap,
+                              uint8_t len) {
+  return m_instance->setMotif(width, height, rows, firstRow, bitmap, len);
+}
+
+void GlobalKnitter::getStats(KnitterStats &stats, bool reset) {
+  m_instance->getStats(stats, reset);
+}
+
+void GlobalKnitter::setReportPolicy(ReportMode_t mode, uint8_t interval) {
+  m_instance->setReportPolicy(mode, interval);
+}
+
+bool GlobalKnitter::popEdge(EdgeRecord &edge) {
+  return m_instance->popEdge(edge);
+}
+
+uint8_t GlobalKnitter::getEdgesLost() {
+  return m_instance->getEdgesLost();
+}
@@ -62,8 +62,8 @@ void GlobalTester::readEncodersCmd() {
   m_instance->readEncodersCmd();
 }
 
-void GlobalTester::autoReadCmd() {
-  m_instance->autoReadCmd();
+void GlobalTester::autoReadCmd(const uint8_t *buffer, size_t size) {
+  m_instance->autoReadCmd(buffer, size);
 }
 
 void GlobalTester::autoTestCmd() {
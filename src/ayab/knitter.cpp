@@ -40,6 +40,11 @@ constexpr uint8_t UINT8_MAX = 0xFFU;
 constexpr uint16_t UINT16_MAX = 0xFFFFU;
 #endif
 
+#if ENABLE_EDGE_LOG && defined(__AVR__)
+// Timer1 overflows, counted for the edge log
+static volatile uint8_t edgeTimerOverflows = 0U;
+#endif
+
 /*!
  * \brief Initialize Knitter object.
  *
@@ -67,10 +72,33 @@ void Knitter::init() {
   m_stopNeedle = 0U;
   m_lineBuffer = nullptr;
   m_continuousReportingEnabled = false;
+  m_reportMode = ReportMode::everyPosition;
+  m_reportInterval = 1U;
+  m_reportHead = 0U;
+  m_reportPassed = 0U;
+  m_reportTime = 0U;
+  m_reportDirection = Direction_t::NoDirection;
+  m_reportEvent = false;
 
+  m_currentLine = nullptr;
+  m_linesBuffered = 0U;
+  m_awaitingLine = true;
   m_lineRequested = false;
   m_currentLineNumber = 0U;
   m_lastLineFlag = false;
+  m_motifWidth = 0U;
+  m_motifHeight = 0U;
+  m_motifRowLen = 0U;
+  m_motifRowsLoaded = 0U;
+  m_motifRows = 0U;
+  m_motifActive = false;
+  m_motifRow = 0U;
+  m_motifLinesLeft = 0U;
+  m_reqLineTime = 0U;
+  m_reqLineTravel = 0U;
+  m_reqLineSent = 0U;
+  m_lineRetries = 0U;
+  m_lineTimeouts = 0U;
   m_sOldPosition = 0U;
   m_firstRun = true;
   m_workedOnLine = false;
@@ -79,6 +107,25 @@ void Knitter::init() {
   m_carriage = Carriage_t::NoCarriage;
   m_hallActive = Direction_t::NoDirection;
   m_pixelToSet = 0;
+  m_scheduleValid = false;
+  m_scheduleStartOffset = 0U;
+  m_scheduleSolenoidOffset = 0U;
+  m_scheduleEntry = &Knitter::scheduleEntry<Machine_t::Kh910>;
+  m_lastQueuedPosition = 0U;
+  m_encoderEvents.clear();
+  m_encoderOverflows = 0U;
+#if ENABLE_EDGE_LOG
+  m_edgeLog.clear();
+  m_edgesLost = 0U;
+#endif
+  m_startPending = false;
+  m_actuationLatencyMax = 0U;
+  m_lastEdgeTime = 0U;
+  m_stepPeriod = UINT16_MAX;
+  setLeadTime(SOLENOID_LEAD_TIME_US);
+  m_actuatedDirection = Direction_t::NoDirection;
+  resetStats();
+  m_actuatedPosition = 0U;
 #ifdef DBG_NOMACHINE
   m_prevState = false;
 #endif
@@ -88,24 +135,62 @@ void Knitter::init() {
  * \brief Initialize interrupt service routine for Knitter object.
  */
 void Knitter::setUpInterrupt() {
-  // (re-)attach ENC_PIN_A(=2), interrupt #0
+  // (re-)attach ENC_PIN_A(=2), interrupt #0, and ENC_PIN_B(=3), interrupt #1
   detachInterrupt(digitalPinToInterrupt(ENC_PIN_A));
+  detachInterrupt(digitalPinToInterrupt(ENC_PIN_B));
+#if ENABLE_EDGE_LOG && defined(__AVR__)
+  // Timer1 runs at clk/8 in fast PWM mode up to ICR1, keeping the PWM
+  // on PIEZO_PIN for the beeper, and times the encoder edges.
+  TCCR1A = (TCCR1A & ~_BV(WGM10)) | _BV(WGM11);
+  TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11);
+  ICR1 = BEEP_PWM_TOP;
+  TIMSK1 |= _BV(TOIE1);
+#endif
 #ifndef AYAB_TESTS
   // Attaching ENC_PIN_A, Interrupt #0
   // This interrupt cannot be enabled until
   // the machine type has been validated.
   attachInterrupt(digitalPinToInterrupt(ENC_PIN_A), GlobalKnitter::isr, CHANGE);
+  // ENC_PIN_B, Interrupt #1, is serviced by the same routine, since
+  // an edge of A can be decoded by either interrupt, and has to be
+  // timed and queued wherever it is found.
+  attachInterrupt(digitalPinToInterrupt(ENC_PIN_B), GlobalKnitter::isr, CHANGE);
 #endif // AYAB_TESTS
 }
 
 /*!
- * \brief Interrupt service routine.
+ * \brief Interrupt service routine, for the edges of both encoder signals.
  *
  * Update machine state data.
  * Must execute as fast as possible.
  * Machine type assumed valid.
  */
 void Knitter::isr() {
+#if ENABLE_EDGE_LOG && defined(__AVR__)
+  // Timer1 is read first, so that the time of the edge
+  // does not depend on the work done below.
+  uint16_t count = TCNT1;
+  uint8_t overflows = edgeTimerOverflows;
+  // an overflow that is still waiting for this interrupt to end
+  if (bit_is_set(TIFR1, TOV1) && (count < (BEEP_PWM_TOP / 2U))) {
+    ++overflows;
+  }
+  auto ticks = static_cast<uint16_t>(
+      (static_cast<uint16_t>(overflows) << EDGE_TIMER_BITS) | count);
+#endif
+  uint32_t time = 0U;
+#if ENABLE_EDGE_LOG && !defined(__AVR__)
+  // there is no Timer1 on the host, `micros()` stands in for it
+  time = micros();
+  auto ticks = static_cast<uint16_t>(time * EDGE_TICKS_PER_US);
+#else
+  // `micros()` is not free in an interrupt, and only the lead time
+  // needs the time of the edge.
+  if (timesEdges()) {
+    time = micros();
+  }
+#endif
+
   // update machine state data
   GlobalEncoders::encA_interrupt();
   m_position = GlobalEncoders::getPosition();
@@ -113,6 +198,28 @@ void Knitter::isr() {
   m_hallActive = GlobalEncoders::getHallActive();
   m_beltShift = GlobalEncoders::getBeltShift();
   m_carriage = GlobalEncoders::getCarriage();
+
+#if ENABLE_EDGE_LOG
+  // Every edge of either signal is logged, including those that
+  // do not move the carriage.
+  if (!m_edgeLog.push({ticks, m_position, m_direction}) &&
+      (m_edgesLost < UINT8_MAX)) {
+    ++m_edgesLost;
+  }
+#endif
+
+  // Queue every change of position for `knit()`, so that no needle
+  // is skipped while the main loop is busy.
+  if (m_position == m_lastQueuedPosition) {
+    return;
+  }
+  m_lastQueuedPosition = m_position;
+  updateVelocity(time);
+  EncoderEvent event = {m_position, m_direction, m_beltShift, m_carriage,
+                        static_cast<uint16_t>(time)};
+  if (!m_encoderEvents.push(event) && (m_encoderOverflows < UINT8_MAX)) {
+    ++m_encoderOverflows;
+  }
 }
 
 /*!
@@ -142,12 +249,13 @@ Err_t Knitter::initMachine(Machine_t machineType) {
  * \brief Enter `OpState::knit` machine state.
  * \param startNeedle Position of first needle in the pattern.
  * \param stopNeedle Position of last needle in the pattern.
- * \param patternStart Pointer to buffer containing pattern data.
+ * \param patternStart Pointer to the ring of `NUM_LINE_BUFFERS` pointers to
+ *   line buffers. The pointers may be swapped while knitting.
  * \param continuousReportingEnabled Flag variable indicating whether the device continuously reports its status to the host.
  * \return Error code (0 = success, other values = error).
  */
 Err_t Knitter::startKnitting(uint8_t startNeedle,
-                             uint8_t stopNeedle, uint8_t *pattern_start,
+                             uint8_t stopNeedle, uint8_t *const *pattern_start,
                              bool continuousReportingEnabled) {
   if (GlobalFsm::getState() != OpState::ready) {
     return ErrorCode::wrong_machine_state;
@@ -164,12 +272,36 @@ Err_t Knitter::startKnitting(uint8_t startNeedle,
   m_stopNeedle = stopNeedle;
   m_lineBuffer = pattern_start;
   m_continuousReportingEnabled = continuousReportingEnabled;
+  m_reportPassed = 0U;
+  m_reportTime = 0U;
+  m_reportDirection = Direction_t::NoDirection;
+  m_reportEvent = false;
 
   // reset variables to start conditions
-  m_currentLineNumber = UINT8_MAX; // because counter will
-                                   // be incremented before request
+  m_currentLineNumber = UINT8_MAX; // so that the first line
+                                   // requested is line 0
+  m_currentLine = getLine(m_currentLineNumber);
+  m_linesBuffered = 0U;
+  m_awaitingLine = true;
   m_lineRequested = false;
   m_lastLineFlag = false;
+  m_scheduleValid = false;
+
+  // Tile a complete motif instead of requesting lines from the host.
+  // The motif is used by this job only.
+  m_motifActive = (m_motifHeight > 0U) && (m_motifRowsLoaded == m_motifHeight);
+  m_motifRow = 0U;
+  m_motifLinesLeft = m_motifRows;
+  m_motifRowsLoaded = 0U;
+
+  // discard positions queued before knitting started,
+  // and start from the position where the carriage is now
+  m_encoderEvents.clear();
+  m_encoderOverflows = 0U;
+  m_startEvent = {m_position, m_direction, m_beltShift, m_carriage,
+                  static_cast<uint16_t>(micros())};
+  m_startPending = true;
+  m_actuatedDirection = Direction_t::NoDirection;
 
   // proceed to next state
   GlobalFsm::setState(OpState::knit);
@@ -243,69 +375,210 @@ void Knitter::knit() {
   if (m_firstRun) {
     m_firstRun = false;
     GlobalBeeper::finishedLine();
-    ++m_currentLineNumber;
-    reqLine(m_currentLineNumber);
   }
 
+  // keep the line buffers topped up so that the next row
+  // is already on the device when the carriage turns
+  prefetchLine();
+
 #ifdef DBG_NOMACHINE
   // TODO(who?): check if debounce is needed
   bool state = digitalRead(DBG_BTN_PIN);
 
-  if (m_prevState && !state && !m_lineRequested) {
-      ++m_currentLineNumber;
-      reqLine(m_currentLineNumber);
+  if (m_prevState && !state) {
+    finishLine();
   }
   m_prevState = state;
 #else
-  // only act if there is an actual change of position
-  if (m_sOldPosition == m_position) {
-    return;
+  if (m_startPending) {
+    m_startPending = false;
+    knitStep(m_startEvent);
   }
 
-  // store current carriage position for next call of this function
-  m_sOldPosition = m_position;
+  // act on every position the carriage has passed since the last call
+  EncoderEvent event;
+  while (m_encoderEvents.pop(event)) {
+    knitStep(event);
+  }
+#endif // DBG_NOMACHINE
+}
 
-  if (m_continuousReportingEnabled) {
+/*!
+ * \brief Set the solenoid for one carriage position.
+ * \param event Carriage state at that position.
+ */
+void Knitter::knitStep(const EncoderEvent &event) {
+  if (m_continuousReportingEnabled &&
+      (m_reportMode == ReportMode::everyPosition)) {
     // send current position to GUI
     indState(ErrorCode::success);
   }
 
-  if (!calculatePixelAndSolenoid()) {
+  if (m_lineRequested && (m_reqLineTravel < UINT16_MAX)) {
+    ++m_reqLineTravel;
+  }
+
+  if (!updateSchedule(event)) {
     // This will only happen if there's an error
     GlobalBeeper::error();
+    reportPosition(event);
     return;
   }
 
   // Desktop software is setting flanking needles so we need to set
   // these even outside of the working needles.
-  // find the right byte from the currentLine array,
-  // then read the appropriate Pixel(/Bit) for the current needle to set
-  uint8_t currentByte = m_pixelToSet >> 3;
-  bool pixelValue =
-      bitRead(m_lineBuffer[currentByte], m_pixelToSet & 0x07);
-  // write Pixel state to the appropriate needle
-  GlobalSolenoids::setSolenoid(m_solenoidToSet, pixelValue);
-
-  if ((m_pixelToSet >= m_startNeedle) && (m_pixelToSet <= m_stopNeedle)) {
+  actuate(event);
+
+  uint8_t entry = scheduleEntry(event.position);
+  if (bitRead(entry, SCHEDULE_WORKING_BIT)) {
     m_workedOnLine = true;
   }
 
-  if (((m_pixelToSet < m_startNeedle - END_OF_LINE_OFFSET_L[static_cast<uint8_t>(m_machineType)]) ||
-       (m_pixelToSet > m_stopNeedle + END_OF_LINE_OFFSET_R[static_cast<uint8_t>(m_machineType)])) &&
-      m_workedOnLine) {
+  if (bitRead(entry, SCHEDULE_END_OF_LINE_BIT) && m_workedOnLine) {
     // outside of the active needles and
     // already worked on the current line -> finished the line
     m_workedOnLine = false;
+    m_reportEvent = true;
+    finishLine();
+  }
+  reportPosition(event);
+}
+
+/*!
+ * \brief Collect a position for `indPositions`, and send the positions
+ * collected when the reporting policy asks for it.
+ * \param event Carriage state at the position just passed.
+ *
+ * A report that does not fit in the transmit buffer is put off until
+ * the next position, so that reporting never holds up knitting.
+ * With `ReportMode::everyPosition`, `indState` is sent instead.
+ */
+void Knitter::reportPosition(const EncoderEvent &event) {
+  if (!m_continuousReportingEnabled ||
+      (m_reportMode == ReportMode::everyPosition)) {
+    return;
+  }
+  m_reportPositions[m_reportHead++ & (REPORT_BATCH_LEN - 1U)] = event.position;
+  if (m_reportPassed < UINT16_MAX) {
+    ++m_reportPassed;
+  }
+  if (event.direction != m_reportDirection) {
+    // the carriage has turned
+    m_reportDirection = event.direction;
+    m_reportEvent = true;
+  }
+
+  bool due;
+  uint32_t now = m_reportTime;
+  switch (m_reportMode) {
+  case ReportMode::needles:
+    due = m_reportPassed >= m_reportInterval;
+    break;
+  case ReportMode::time:
+    now = millis();
+    due = now - m_reportTime >= m_reportInterval;
+    break;
+  default:
+    due = m_reportEvent;
+    break;
+  }
+  if (!due) {
+    return;
+  }
+
+  uint8_t count = (m_reportPassed < REPORT_BATCH_LEN) ? m_reportPassed : REPORT_BATCH_LEN;
+  uint8_t positions[REPORT_BATCH_LEN];
+  for (uint8_t i = 0U; i < count; i++) {
+    positions[i] = m_reportPositions[(m_reportHead - count + i) & (REPORT_BATCH_LEN - 1U)];
+  }
+  if (GlobalCom::send_indPositions(m_carriage, event.direction, m_reportPassed,
+                                   positions, count)) {
+    m_reportPassed = 0U;
+    m_reportEvent = false;
+    m_reportTime = now;
+  }
+}
+
+/*!
+ * \brief Set the solenoids for one carriage position from the schedule.
+ * \param event Carriage state at that position.
+ *
+ * The schedule tells us which solenoid to set at each position, and the
+ * value of the corresponding pixel of the current line. Solenoids are
+ * selected up to `m_leadSteps` positions ahead of the carriage. Each
+ * position is selected once, even when the lead changes with speed.
+ */
+void Knitter::actuate(const EncoderEvent &event) {
+  int8_t step = (Direction_t::Right == event.direction) ? 1 : -1;
+
+  // Start again from the carriage position after a change of direction
+  // or schedule, or unless the last position selected lies between the
+  // carriage and the furthest it may be selected ahead.
+  int ahead = static_cast<int8_t>(m_actuatedPosition - event.position) * step;
+  if ((event.direction != m_actuatedDirection) ||
+      (ahead < 0) || (ahead > MAX_LEAD_STEPS)) {
+    m_actuatedDirection = event.direction;
+    m_actuatedPosition = event.position - step;
+  }
 
-    if (!m_lineRequested && !m_lastLineFlag) {
-      // request new line from host
-      ++m_currentLineNumber;
-      reqLine(m_currentLineNumber);
-    } else if (m_lastLineFlag) {
-      stopKnitting();
+  auto target = static_cast<uint8_t>(event.position + step * m_leadSteps);
+  while (static_cast<int8_t>(target - m_actuatedPosition) * step > 0) {
+    m_actuatedPosition += step;
+    uint8_t entry = scheduleEntry(m_actuatedPosition);
+    GlobalSolenoids::setSolenoid(entry & SCHEDULE_SOLENOID_MASK,
+                                 bitRead(entry, SCHEDULE_PIXEL_BIT));
+  }
+
+  if (timesEdges()) {
+    auto latency = static_cast<uint16_t>(static_cast<uint16_t>(micros()) - event.time);
+    if (latency > m_actuationLatencyMax) {
+      m_actuationLatencyMax = latency;
     }
   }
-#endif // DBG_NOMACHINE
+}
+
+/*!
+ * \brief Check whether the encoder edges need to be timed.
+ * \return `true` if the lead time is enabled.
+ */
+bool Knitter::timesEdges() const {
+  return m_leadThreshold[0] > 0U;
+}
+
+/*!
+ * \brief Set the time by which solenoids are selected ahead of the needle.
+ * \param leadTime Lead time in microseconds.
+ *
+ * The carriage is `n` needles ahead after the lead time when
+ * a needle takes less than `leadTime / n` to pass. Work out these
+ * thresholds here, so that the interrupt does not have to divide.
+ */
+void Knitter::setLeadTime(uint16_t leadTime) {
+  for (uint8_t i = 0; i < MAX_LEAD_STEPS; i++) {
+    m_leadThreshold[i] = leadTime / (i + 1U);
+  }
+  m_leadSteps = 0U;
+}
+
+/*!
+ * \brief Update the carriage speed estimate at a change of position.
+ * \param time `micros()` at the encoder edge.
+ *
+ * Called from the interrupt service routine.
+ */
+void Knitter::updateVelocity(uint32_t time) {
+  uint32_t elapsed = time - m_lastEdgeTime;
+  m_lastEdgeTime = time;
+  uint16_t period = elapsed > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(elapsed);
+
+  // exponential moving average over about 4 needles
+  m_stepPeriod = m_stepPeriod - (m_stepPeriod >> 2) + (period >> 2);
+
+  uint8_t lead = 0U;
+  while ((lead < MAX_LEAD_STEPS) && (m_stepPeriod < m_leadThreshold[lead])) {
+    ++lead;
+  }
+  m_leadSteps = lead;
 }
 
 /*!
@@ -329,12 +602,7 @@ Machine_t Knitter::getMachineType() {
  * \return Start offset, or 0 if unobtainable.
  */
 uint8_t Knitter::getStartOffset(const Direction_t direction) {
-  if ((direction == Direction_t::NoDirection) ||
-      (m_carriage == Carriage_t::NoCarriage) ||
-      (m_machineType == Machine_t::NoMachine)) {
-    return 0U;
-  }
-  return START_OFFSET[static_cast<uint8_t>(m_machineType)][static_cast<uint8_t>(direction)][static_cast<uint8_t>(m_carriage)];
+  return getStartOffset(direction, m_carriage);
 }
 
 /*!
@@ -345,18 +613,49 @@ uint8_t Knitter::getStartOffset(const Direction_t direction) {
 bool Knitter::setNextLine(uint8_t lineNumber) {
   if (m_lineRequested) {
     // Is there even a need for a new line?
-    if (lineNumber == m_currentLineNumber) {
+    uint8_t requestedLineNumber = m_currentLineNumber + m_linesBuffered + 1U;
+    if (lineNumber == requestedLineNumber) {
       m_lineRequested = false;
-      GlobalBeeper::finishedLine();
+      recordLineStats();
+      acceptLine(lineNumber);
       return true;
     } else {
       // line numbers didn't match -> request again
-      reqLine(m_currentLineNumber);
+      reqLine(requestedLineNumber);
     }
   }
   return false;
 }
 
+/*!
+ * \brief Request the outstanding line again because the host's answer
+ * was rejected.
+ * \param error Why it was rejected, sent with the request.
+ *
+ * Gives up after `LINE_REQUEST_RETRIES` attempts, so that a host that
+ * keeps sending bad lines is not flooded with requests. The request
+ * is still sent again when it times out.
+ */
+void Knitter::nackLine(Err_t error) {
+  if (m_lineRequested && (m_lineRetries < LINE_REQUEST_RETRIES)) {
+    ++m_lineRetries;
+    retryLine(error);
+  }
+}
+
+/*!
+ * \brief Set how the carriage position is reported while knitting.
+ * \param mode Reporting policy.
+ * \param interval Needles or milliseconds between reports, depending
+ *   on `mode`.
+ *
+ * Only applies if continuous reporting is enabled when knitting starts.
+ */
+void Knitter::setReportPolicy(ReportMode_t mode, uint8_t interval) {
+  m_reportMode = mode;
+  m_reportInterval = (interval > 0U) ? interval : 1U;
+}
+
 /*!
  * \brief Get value of last line flag.
  * \param `true` if current line is the last line in the pattern, `false` otherwise.
@@ -373,60 +672,569 @@ void Knitter::setMachineType(Machine_t machineType) {
   m_machineType = machineType;
 }
 
+/*!
+ * \brief Upload part of a motif to be tiled on the device.
+ * \param width Width of the motif in needles.
+ * \param height Height of the motif in rows.
+ * \param rows Number of rows to knit, or 0 to knit until stopped.
+ * \param firstRow First motif row contained in `bitmap`.
+ * \param bitmap Whole motif rows of `(width + 7) / 8` bytes each,
+ *        with the same bit order as in the `cnfLine` message.
+ * \param len Number of bytes in `bitmap`.
+ * \return Error code (0 = success, other values = error).
+ *
+ * Motifs too big to fit in one message are uploaded in order, starting
+ * with row 0. The next job tiles the motif once all rows have arrived.
+ */
+Err_t Knitter::setMotif(uint8_t width, uint8_t height, uint16_t rows,
+                        uint8_t firstRow, const uint8_t *bitmap,
+                        uint8_t len) {
+  OpState_t state = GlobalFsm::getState();
+  if ((state != OpState::init) && (state != OpState::ready)) {
+    return ErrorCode::wrong_machine_state;
+  }
+  if (bitmap == nullptr) {
+    return ErrorCode::null_pointer_argument;
+  }
+  uint8_t rowLen = (width + 7U) >> 3U;
+  if ((width == 0U) || (height == 0U) ||
+      (width > NUM_NEEDLES[static_cast<uint8_t>(m_machineType)]) ||
+      (rowLen * height > MAX_MOTIF_LEN)) {
+    return ErrorCode::argument_invalid;
+  }
+  if (firstRow == 0U) {
+    // start a new motif
+    m_motifWidth = width;
+    m_motifHeight = height;
+    m_motifRowLen = rowLen;
+    m_motifRowsLoaded = 0U;
+    m_motifRows = rows;
+  }
+  if ((width != m_motifWidth) || (height != m_motifHeight) ||
+      (rows != m_motifRows) || (firstRow != m_motifRowsLoaded) ||
+      (len == 0U) || (len % rowLen != 0U) ||
+      (len / rowLen > height - firstRow)) {
+    return ErrorCode::arguments_incompatible;
+  }
+  memcpy(m_motif + firstRow * rowLen, bitmap, len);
+  m_motifRowsLoaded += len / rowLen;
+  return ErrorCode::success;
+}
+
+/*!
+ * \brief Take the oldest encoder edge from the edge log.
+ * \param edge The edge, if there is one.
+ * \return `false` if the log is empty, or the firmware was built
+ *   without it.
+ */
+bool Knitter::popEdge(EdgeRecord &edge) {
+#if ENABLE_EDGE_LOG
+  return m_edgeLog.pop(edge);
+#else
+  (void)edge;
+  return false;
+#endif
+}
+
+/*!
+ * \brief Get the number of encoder edges lost because the edge log
+ * was full, since this was last asked for.
+ */
+uint8_t Knitter::getEdgesLost() {
+#if ENABLE_EDGE_LOG
+  noInterrupts();
+  uint8_t edgesLost = m_edgesLost;
+  m_edgesLost = 0U;
+  interrupts();
+  return edgesLost;
+#else
+  return 0U;
+#endif
+}
+
+/*!
+ * \brief Get line telemetry.
+ * \param stats Telemetry since it was last reset.
+ * \param reset Start collecting afresh.
+ */
+void Knitter::getStats(KnitterStats &stats, bool reset) {
+  stats = m_stats;
+  stats.encoderOverflows = m_encoderOverflows;
+  stats.actuationLatencyMax = m_actuationLatencyMax;
+  stats.illegalTransitions = GlobalEncoders::getIllegalTransitions(reset);
+  if (reset) {
+    resetStats();
+  }
+}
+
 // private methods
 
 /*!
  * \brief Send `reqLine` message.
  * \param lineNumber Line number requested.
+ * \param error Error code, if the line is requested again because
+ *   the host's answer was rejected.
  */
-void Knitter::reqLine(uint8_t lineNumber) {
-  GlobalCom::send_reqLine(lineNumber, ErrorCode::success);
+void Knitter::reqLine(uint8_t lineNumber, Err_t error) {
+  if (!m_lineRequested) {
+    // time the request, but not repeats of it
+    m_reqLineTime = micros();
+    m_reqLineTravel = 0U;
+    m_lineRetries = 0U;
+    m_lineTimeouts = 0U;
+  }
+  GlobalCom::send_reqLine(lineNumber, error);
+  m_reqLineSent = millis();
   m_lineRequested = true;
 }
 
+/*!
+ * \brief Request the outstanding line again.
+ * \param error Error code sent with the request.
+ */
+void Knitter::retryLine(Err_t error) {
+  if (m_stats.lineRetries < UINT16_MAX) {
+    ++m_stats.lineRetries;
+  }
+  reqLine(m_currentLineNumber + m_linesBuffered + 1U, error);
+}
+
+/*!
+ * \brief Request the next line from the host if there is room for it.
+ *
+ * At most one request is outstanding at any time, and no more lines
+ * are requested once the last line of the pattern has been received.
+ * An outstanding request that has not been answered in time is sent
+ * again, waiting twice as long each time it times out.
+ */
+void Knitter::prefetchLine() {
+  if (m_motifActive) {
+    // generate lines on the device until the buffers are full
+    while (!m_lastLineFlag &&
+           (m_awaitingLine || (m_linesBuffered < NUM_LINE_BUFFERS - 1U))) {
+      uint8_t lineNumber = m_currentLineNumber + m_linesBuffered + 1U;
+      tileMotif(getLine(lineNumber));
+      acceptLine(lineNumber);
+      if ((m_motifLinesLeft > 0U) && (--m_motifLinesLeft == 0U)) {
+        m_lastLineFlag = true;
+      }
+    }
+    return;
+  }
+  if (m_lineRequested) {
+    uint32_t timeout = static_cast<uint32_t>(LINE_REQUEST_TIMEOUT_MS) << m_lineTimeouts;
+    if (millis() - m_reqLineSent >= timeout) {
+      // the request or the answer has been lost
+      if (m_lineTimeouts < LINE_REQUEST_BACKOFF) {
+        ++m_lineTimeouts;
+      }
+      retryLine(ErrorCode::success);
+    }
+    return;
+  }
+  if (m_lastLineFlag) {
+    return;
+  }
+  if (m_awaitingLine || (m_linesBuffered < NUM_LINE_BUFFERS - 1U)) {
+    reqLine(m_currentLineNumber + m_linesBuffered + 1U);
+  }
+}
+
+/*!
+ * \brief Take up the next line once it is in its line buffer.
+ * \param lineNumber Line number (0-indexed and modulo 256).
+ */
+void Knitter::acceptLine(uint8_t lineNumber) {
+  if (m_awaitingLine) {
+    // the carriage is already waiting for this line
+    m_awaitingLine = false;
+    m_currentLineNumber = lineNumber;
+    m_currentLine = getLine(lineNumber);
+    m_scheduleValid = false;
+    GlobalBeeper::finishedLine();
+  } else {
+    ++m_linesBuffered;
+  }
+}
+
+/*!
+ * \brief Generate the next line from the motif.
+ * \param line Line buffer to fill.
+ *
+ * The motif is repeated across the working needles, starting at the
+ * start needle, and from one line to the next. Needles outside the
+ * working needles are left unset.
+ */
+void Knitter::tileMotif(uint8_t *line) {
+  // line buffers hold inverted needle states
+  memset(line, 0xFF, MAX_LINE_BUFFER_LEN);
+  const uint8_t *row = m_motif + m_motifRow * m_motifRowLen;
+  uint8_t column = 0U;
+  for (uint8_t needle = m_startNeedle; needle <= m_stopNeedle; ++needle) {
+    if (bitRead(row[column >> 3], column & 0x07)) {
+      bitClear(line[needle >> 3], needle & 0x07);
+    }
+    if (++column == m_motifWidth) {
+      column = 0U;
+    }
+  }
+  if (++m_motifRow == m_motifHeight) {
+    m_motifRow = 0U;
+  }
+}
+
+/*!
+ * \brief Move on to the next line once the carriage has finished a line.
+ *
+ * If the next line has already been prefetched, this only swaps
+ * the pointer to the current line. Otherwise the carriage waits
+ * for the host, and the line is taken up as soon as it arrives.
+ */
+void Knitter::finishLine() {
+  if (m_lastLineFlag && (m_linesBuffered == 0U)) {
+    // the line that was just finished is the last line of the pattern
+    m_scheduleValid = false;
+    stopKnitting();
+    return;
+  }
+  if (m_linesBuffered > 0U) {
+    --m_linesBuffered;
+    ++m_currentLineNumber;
+    m_currentLine = getLine(m_currentLineNumber);
+    m_scheduleValid = false;
+    GlobalBeeper::finishedLine();
+  } else {
+    m_awaitingLine = true;
+  }
+  prefetchLine();
+}
+
+/*!
+ * \brief Add a sample to a range.
+ */
+static void addSample(SampleRange &range, uint16_t value) {
+  if (value < range.min) {
+    range.min = value;
+  }
+  if (value > range.max) {
+    range.max = value;
+  }
+  range.sum += value;
+}
+
+/*!
+ * \brief Record telemetry for the requested line that has just arrived.
+ */
+void Knitter::recordLineStats() {
+  if (m_stats.lines == UINT16_MAX) {
+    // the sums could overflow
+    return;
+  }
+  ++m_stats.lines;
+
+  uint32_t latency = (micros() - m_reqLineTime) / 1000U;
+  addSample(m_stats.latency, (latency < UINT16_MAX) ? latency : UINT16_MAX);
+  addSample(m_stats.travel, m_reqLineTravel);
+
+  uint16_t slack;
+  if (!getLineSlack(slack)) {
+    // the carriage position is not known
+    return;
+  }
+  addSample(m_stats.slack, slack);
+  uint8_t bin = 0U;
+  while ((slack > 0U) && (bin < SLACK_HISTOGRAM_BINS - 1U)) {
+    slack >>= 1U;
+    ++bin;
+  }
+  ++m_stats.slackHistogram[bin];
+}
+
+/*!
+ * \brief Needles the carriage can pass before the requested line is needed.
+ * \param slack Number of needles, or 0 if the carriage is waiting for it.
+ * \return `true` if successful, `false` if the carriage position is not known.
+ */
+bool Knitter::getLineSlack(uint16_t &slack) const {
+  uint8_t startOffset;
+  switch (m_direction) {
+  case Direction_t::Right:
+    startOffset = getStartOffset(Direction_t::Left, m_carriage);
+    break;
+  case Direction_t::Left:
+    startOffset = getStartOffset(Direction_t::Right, m_carriage);
+    break;
+  default:
+    return false;
+  }
+  auto machine = static_cast<uint8_t>(m_machineType);
+  int offsetL = END_OF_LINE_OFFSET_L[machine];
+  int offsetR = END_OF_LINE_OFFSET_R[machine];
+  int pixel = static_cast<int>(m_position) - startOffset;
+
+  int needles;
+  if (m_awaitingLine) {
+    // The carriage has finished the previous line: the slack is
+    // the way back to the working needles, if it is not there yet.
+    if (pixel > m_stopNeedle) {
+      needles = pixel - m_stopNeedle;
+    } else if (pixel < m_startNeedle) {
+      needles = m_startNeedle - pixel;
+    } else {
+      needles = 0;
+    }
+  } else {
+    // The carriage knits the current and the buffered lines first,
+    // turning past the end of each line.
+    if (m_direction == Direction_t::Right) {
+      needles = m_stopNeedle + 2 * offsetR - pixel;
+    } else {
+      needles = pixel - m_startNeedle + 2 * offsetL;
+    }
+    needles += m_linesBuffered * (m_stopNeedle - m_startNeedle + offsetL + offsetR);
+  }
+  slack = (needles > 0) ? needles : 0;
+  return true;
+}
+
+/*!
+ * \brief Clear line telemetry.
+ */
+void Knitter::resetStats() {
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_stats.latency.min = UINT16_MAX;
+  m_stats.travel.min = UINT16_MAX;
+  m_stats.slack.min = UINT16_MAX;
+  m_encoderOverflows = 0U;
+  m_actuationLatencyMax = 0U;
+}
+
+/*!
+ * \brief Get the line buffer that holds a given line.
+ * \param lineNumber Line number (0-indexed and modulo 256).
+ * \return Pointer to the line buffer.
+ */
+uint8_t *Knitter::getLine(uint8_t lineNumber) const {
+  return m_lineBuffer[lineBufferSlot(lineNumber)];
+}
+
+/*!
+ * \brief Get start offset for a given carriage.
+ * \return Start offset, or 0 if unobtainable.
+ */
+uint8_t Knitter::getStartOffset(const Direction_t direction,
+                                const Carriage_t carriage) const {
+  if ((direction == Direction_t::NoDirection) ||
+      (carriage == Carriage_t::NoCarriage) ||
+      (m_machineType == Machine_t::NoMachine)) {
+    return 0U;
+  }
+  return START_OFFSET[static_cast<uint8_t>(m_machineType)][static_cast<uint8_t>(direction)][static_cast<uint8_t>(carriage)];
+}
+
+/*!
+ * \brief Check whether the solenoid schedule is valid for a carriage state.
+ * \param state Carriage state.
+ * \return `true` if the schedule can be used, `false` otherwise.
+ */
+bool Knitter::scheduleMatches(const EncoderEvent &state) const {
+  return m_scheduleValid &&
+         (m_scheduleState.direction == state.direction) &&
+         (m_scheduleState.carriage == state.carriage) &&
+         (m_scheduleState.beltShift == state.beltShift);
+}
+
+/*!
+ * \brief Make sure the solenoid schedule matches the current line
+ *        and carriage state, recompiling it if necessary.
+ * \param state Carriage state.
+ * \return `true` if successful, `false` otherwise.
+ */
+bool Knitter::updateSchedule(const EncoderEvent &state) {
+  if ((state.direction != Direction_t::Left) && (state.direction != Direction_t::Right)) {
+    return false;
+  }
+  if (scheduleMatches(state)) {
+    return true;
+  }
+  m_scheduleValid = false;
+  m_scheduleState = state;
+  compileSchedule();
+  m_actuatedDirection = Direction_t::NoDirection;
+  m_scheduleValid = true;
+  return true;
+}
+
+/*!
+ * \brief Compile the solenoid schedule for the carriage state.
+ *
+ * This does the offset and belt shift arithmetic once per line
+ * and carriage pass, instead of once per encoder step, and selects
+ * the lookup for the machine type.
+ * Direction of `m_scheduleState` assumed valid.
+ */
+void Knitter::compileSchedule() {
+  // select the kernel for the machine type once per compile
+  switch (m_machineType) {
+  case Machine_t::Kh910:
+    compileSchedule<Machine_t::Kh910>();
+    break;
+  case Machine_t::Kh930:
+    compileSchedule<Machine_t::Kh930>();
+    break;
+  case Machine_t::Kh270:
+    compileSchedule<Machine_t::Kh270>();
+    break;
+  default:
+    break;
+  }
+}
+
+/*!
+ * \brief Compile the solenoid schedule for a given machine type.
+ */
+template <Machine_t M> void Knitter::compileSchedule() {
+  calculateOffsets<M>(m_scheduleState, m_scheduleStartOffset,
+                      m_scheduleSolenoidOffset);
+  m_scheduleEntry = &Knitter::scheduleEntry<M>;
+}
+
+/*!
+ * \brief Look up the solenoid schedule at a carriage position.
+ * \param position Carriage position.
+ * \return Schedule entry, see `SCHEDULE_SOLENOID_MASK` and following.
+ */
+uint8_t Knitter::scheduleEntry(uint8_t position) const {
+  return (this->*m_scheduleEntry)(position);
+}
+
+/*!
+ * \brief Look up the solenoid schedule at a carriage position
+ *        for a given machine type.
+ *
+ * Entries are worked out from the offsets compiled for the
+ * carriage pass and the current line, rather than stored for
+ * every position, which would take 256 bytes of RAM.
+ */
+template <Machine_t M> uint8_t Knitter::scheduleEntry(uint8_t position) const {
+  uint8_t pixel;
+  uint8_t solenoid;
+  calculatePixelAndSolenoid<M>(position, m_scheduleStartOffset,
+                               m_scheduleSolenoidOffset, pixel, solenoid);
+
+  uint8_t entry = solenoid & SCHEDULE_SOLENOID_MASK;
+  // Pixels beyond the line buffer read as unset, just like
+  // the part of the buffer that the host does not send.
+  if ((pixel >= MAX_LINE_BUFFER_LEN * 8U) ||
+      bitRead(m_currentLine[pixel >> 3], pixel & 0x07)) {
+    bitSet(entry, SCHEDULE_PIXEL_BIT);
+  }
+  if ((pixel >= m_startNeedle) && (pixel <= m_stopNeedle)) {
+    bitSet(entry, SCHEDULE_WORKING_BIT);
+  }
+  if ((pixel < m_startNeedle - MachineTraits<M>::endOfLineOffsetL) ||
+      (pixel > m_stopNeedle + MachineTraits<M>::endOfLineOffsetR)) {
+    bitSet(entry, SCHEDULE_END_OF_LINE_BIT);
+  }
+  return entry;
+}
+
 /*!
  * \brief Calculate the solenoid and pixel to be set.
  * \return `true` if successful, `false` otherwise.
  */
 bool Knitter::calculatePixelAndSolenoid() {
-  uint8_t startOffset = 0;
+  return calculatePixelAndSolenoid({m_position, m_direction, m_beltShift, m_carriage, 0U},
+                                   m_pixelToSet, m_solenoidToSet);
+}
 
-  bool beltShift = BeltShift_t::Shifted == m_beltShift;
+/*!
+ * \brief Calculate the solenoid and pixel to be set for a given carriage state.
+ * \param state Carriage state.
+ * \param pixel Pixel to be set.
+ * \param solenoid Solenoid to be set.
+ * \return `true` if successful, `false` otherwise.
+ */
+bool Knitter::calculatePixelAndSolenoid(const EncoderEvent &state, uint8_t &pixel,
+                                        uint8_t &solenoid) const {
+  switch (m_machineType) {
+  case Machine_t::Kh910:
+    return calculatePixelAndSolenoid<Machine_t::Kh910>(state, pixel, solenoid);
+  case Machine_t::Kh930:
+    return calculatePixelAndSolenoid<Machine_t::Kh930>(state, pixel, solenoid);
+  case Machine_t::Kh270:
+    return calculatePixelAndSolenoid<Machine_t::Kh270>(state, pixel, solenoid);
+  default:
+    return false;
+  }
+}
 
-  // 270 Doesn't care about belt shift
-  if (Machine_t::Kh270 == m_machineType) {
-    beltShift = false;
+/*!
+ * \brief Calculate the solenoid and pixel to be set for a given
+ *        carriage state and machine type.
+ */
+template <Machine_t M>
+bool Knitter::calculatePixelAndSolenoid(const EncoderEvent &state, uint8_t &pixel,
+                                        uint8_t &solenoid) const {
+  uint8_t startOffset;
+  uint8_t solenoidOffset;
+  if (!calculateOffsets<M>(state, startOffset, solenoidOffset)) {
+    return false;
   }
+  calculatePixelAndSolenoid<M>(state.position, startOffset, solenoidOffset,
+                               pixel, solenoid);
+  return true;
+}
+
+/*!
+ * \brief Calculate the offsets from carriage position to pixel,
+ *        and from pixel to solenoid, for a given carriage state.
+ * \param state Carriage state.
+ * \param startOffset Carriage position of pixel 0.
+ * \param solenoidOffset Solenoid of pixel 0, before the modulo.
+ * \return `true` if successful, `false` otherwise.
+ */
+template <Machine_t M>
+bool Knitter::calculateOffsets(const EncoderEvent &state, uint8_t &startOffset,
+                               uint8_t &solenoidOffset) const {
+  constexpr bool kh270 = Machine_t::Kh270 == M;
+  constexpr uint8_t halfSolenoidsNum = HALF_SOLENOIDS_NUM[MachineTraits<M>::index];
+
+  startOffset = 0;
+
+  // 270 Doesn't care about belt shift
+  bool beltShift = MachineTraits<M>::hasBeltShift &&
+                   (BeltShift_t::Shifted == state.beltShift);
 
   // 270 needs additional start offsets because of it's wierdness
   uint8_t bulkyOffset = 0;
 
-  switch (m_direction) {
+  switch (state.direction) {
   // calculate the solenoid and pixel to be set
   // implemented according to machine manual
   // magic numbers from machine manual
   case Direction_t::Right:
-    startOffset = getStartOffset(Direction_t::Left);
+    startOffset = getStartOffset(Direction_t::Left, state.carriage);
 
     // The Lace carriage is special
     // See page 7 of the 930 service manual https://mkmanuals.com/downloadable/download/sample/sample_id/27/
-    if (Carriage_t::Lace == m_carriage) {
+    if (Carriage_t::Lace == state.carriage) {
       beltShift = !beltShift;
     }
 
     // Page 6 of the 270 service manual: https://mostlyknittingmachines.weebly.com/uploads/8/4/6/7/846749/brother_kh270_service_manual.pdf
     // Pixel 0 needs to be written into solenoid 4 (indexed from 0) L -> R
-    if (Machine_t::Kh270 == m_machineType) {
+    if (kh270) {
       bulkyOffset = 4;
     }
 
     break;
   case Direction_t::Left:
-    startOffset = getStartOffset(Direction_t::Right);
+    startOffset = getStartOffset(Direction_t::Right, state.carriage);
 
     // Page 6 of the 270 service manual: https://mostlyknittingmachines.weebly.com/uploads/8/4/6/7/846749/brother_kh270_service_manual.pdf
     // Pixel 0 needs to be written into solenoid 10 (indexed from 0) R -> L
-    if (Machine_t::Kh270 == m_machineType) {
+    if (kh270) {
       bulkyOffset = 10;
     }
 
@@ -435,6 +1243,28 @@ bool Knitter::calculatePixelAndSolenoid() {
     return false;
   }
 
+  solenoidOffset = beltShift ? halfSolenoidsNum : bulkyOffset;
+  return true;
+}
+
+/*!
+ * \brief Calculate the solenoid and pixel to be set at a carriage position.
+ * \param position Carriage position.
+ * \param startOffset Carriage position of pixel 0.
+ * \param solenoidOffset Solenoid of pixel 0, before the modulo.
+ * \param pixel Pixel to be set.
+ * \param solenoid Solenoid to be set.
+ *
+ * The machine constants are known at compile time, so that
+ * the modulo operations reduce to cheap arithmetic.
+ */
+template <Machine_t M>
+void Knitter::calculatePixelAndSolenoid(uint8_t position, uint8_t startOffset,
+                                        uint8_t solenoidOffset, uint8_t &pixel,
+                                        uint8_t &solenoid) {
+  constexpr bool kh270 = Machine_t::Kh270 == M;
+  constexpr uint8_t solenoidsNum = SOLENOIDS_NUM[MachineTraits<M>::index];
+
   // Unsigned 8-bit arithmetic computes modulo 256 — this is not
   // appropriate when you have 12 solenoids, it causes pixel -1 to
   // have more than 1 solenoid of difference from pixel 0.
@@ -444,25 +1274,20 @@ bool Knitter::calculatePixelAndSolenoid() {
   // We only handle the underflow case, because the machine with 12
   // solenoids (KH270) has only 112 needles and can therefore never
   // have positions that cause an 8-bit overflow.
-  int pixelToSet = (int)m_position - startOffset;
+  int pixelToSet = (int)position - startOffset;
 
   if (pixelToSet < 0) {
-    pixelToSet += Machine_t::Kh270 == m_machineType ? 252 : 256;
+    pixelToSet += kh270 ? 252 : 256;
   }
 
-  m_pixelToSet = pixelToSet;
+  pixel = pixelToSet;
 
-  if (!beltShift) {
-    m_solenoidToSet = (m_pixelToSet + bulkyOffset) % SOLENOIDS_NUM[static_cast<uint8_t>(m_machineType)];
-  } else {
-    m_solenoidToSet = (m_pixelToSet + HALF_SOLENOIDS_NUM[static_cast<uint8_t>(m_machineType)]) % SOLENOIDS_NUM[static_cast<uint8_t>(m_machineType)];
-  }
+  solenoid = (pixel + solenoidOffset) % solenoidsNum;
 
   // The 270 has 12 solenoids but they get shifted over 3 bits
-  if (m_machineType == Machine_t::Kh270) {
-    m_solenoidToSet = m_solenoidToSet + 3;
+  if (kh270) {
+    solenoid = solenoid + 3;
   }
-  return true;
 }
 
 /*!
@@ -478,3 +1303,12 @@ void Knitter::stopKnitting() const {
   // detaching ENC_PIN_A, Interrupt #0
   /* detachInterrupt(digitalPinToInterrupt(ENC_PIN_A)); */
 }
+
+#if ENABLE_EDGE_LOG && defined(__AVR__)
+/*!
+ * \brief Timer1 overflow, every 2.048 ms.
+ */
+ISR(TIMER1_OVF_vect) {
+  ++edgeTimerOverflows;
+}
+#endif
@@ -27,9 +27,109 @@
 #include "beeper.h"
 #include "com.h"
 #include "encoders.h"
+#include "ring_buffer.h"
 #include "solenoids.h"
 #include "tester.h"
 
+// Layout of an entry in the solenoid schedule
+constexpr uint8_t SCHEDULE_SOLENOID_MASK = 0x0FU; // solenoid to set
+constexpr uint8_t SCHEDULE_PIXEL_BIT = 4U;        // value to set it to
+constexpr uint8_t SCHEDULE_WORKING_BIT = 5U;      // inside the working needles
+constexpr uint8_t SCHEDULE_END_OF_LINE_BIT = 6U;  // past the end of the line
+
+// Number of carriage positions that can be queued by the encoder
+// interrupt before `knit()` has to catch up. Must be a power of 2.
+constexpr uint8_t ENCODER_QUEUE_LEN = 16U;
+
+// Time by which solenoids are selected ahead of the needle, to make up
+// for the response time of the solenoids and of the I2C write.
+#ifndef SOLENOID_LEAD_TIME
+#define SOLENOID_LEAD_TIME 0 // us
+#endif
+constexpr uint16_t SOLENOID_LEAD_TIME_US = SOLENOID_LEAD_TIME;
+
+// Most needles that solenoids are selected ahead of the carriage
+constexpr uint8_t MAX_LEAD_STEPS = 4U;
+
+// Size in bytes of the motif that can be tiled on the device
+constexpr uint8_t MAX_MOTIF_LEN = 64U;
+
+// A requested line is requested again at once if it arrives corrupted,
+// at most `LINE_REQUEST_RETRIES` times. A line that has not arrived
+// within the timeout is always requested again, waiting twice as long
+// each time, up to `LINE_REQUEST_TIMEOUT_MS << LINE_REQUEST_BACKOFF`.
+constexpr uint16_t LINE_REQUEST_TIMEOUT_MS = 200U;
+constexpr uint8_t LINE_REQUEST_RETRIES = 4U;
+constexpr uint8_t LINE_REQUEST_BACKOFF = 3U;
+
+// Encoder edges kept for `reqEdges`, when built with `-DENABLE_EDGE_LOG=1`.
+// Must be a power of 2.
+constexpr uint8_t EDGE_LOG_LEN = 32U;
+// The edges are timed with Timer1 at clk/8, or not at all without the
+// edge log. Timer1 still drives the beeper, so it only counts up to
+// `BEEP_PWM_TOP`, and its overflows make up the top bits of the time.
+#if ENABLE_EDGE_LOG
+constexpr uint8_t EDGE_TICKS_PER_US = 2U;
+constexpr uint8_t EDGE_TIMER_BITS = 12U;
+static_assert(BEEP_PWM_TOP + 1U == 1U << EDGE_TIMER_BITS,
+              "Timer1 must wrap at a power of 2");
+#else
+constexpr uint8_t EDGE_TICKS_PER_US = 0U;
+#endif
+
+/*!
+ * \brief Carriage state at one encoder position.
+ */
+struct EncoderEvent {
+  uint8_t position;
+  Direction_t direction;
+  BeltShift_t beltShift;
+  Carriage_t carriage;
+  uint16_t time;  // `micros()` at the encoder edge, modulo 2^16
+};
+
+/*!
+ * \brief Encoder edge, as kept in the edge log.
+ */
+struct EdgeRecord {
+  uint16_t ticks;  // Timer1 at the encoder edge, wraps every 32.768 ms
+  uint8_t position;
+  Direction_t direction;
+};
+
+// Number of bins in the histogram of line slack
+constexpr uint8_t SLACK_HISTOGRAM_BINS = 8U;
+
+/*!
+ * \brief Smallest, largest, and total of a series of samples.
+ */
+struct SampleRange {
+  uint16_t min;
+  uint16_t max;
+  uint32_t sum;
+};
+
+/*!
+ * \brief Telemetry on how close knitting comes to running out of lines.
+ *
+ * One sample is taken each time the host answers `reqLine` with the
+ * line that was requested.
+ */
+struct KnitterStats {
+  uint16_t lines;         // number of samples
+  SampleRange latency;    // ms from `reqLine` to the accepted `cnfLine`
+  SampleRange travel;     // needles passed in the meantime
+  SampleRange slack;      // needles left before the line is needed
+  // Bin 0 counts lines that arrived too late, with no slack left.
+  // Bin i counts slack from 2^(i-1) to 2^i - 1, and the last bin
+  // everything above.
+  uint16_t slackHistogram[SLACK_HISTOGRAM_BINS];
+  uint8_t encoderOverflows;     // positions lost from the encoder queue
+  uint16_t actuationLatencyMax; // us from encoder edge to solenoid write
+  uint16_t lineRetries;         // lines requested again
+  uint8_t illegalTransitions;   // encoder edges with no known direction
+};
+
 class KnitterInterface {
 public:
   virtual ~KnitterInterface() = default;
@@ -39,7 +139,7 @@ public:
   virtual void setUpInterrupt() = 0;
   virtual void isr() = 0;
   virtual Err_t startKnitting(uint8_t startNeedle,
-                              uint8_t stopNeedle, uint8_t *pattern_start,
+                              uint8_t stopNeedle, uint8_t *const *pattern_start,
                               bool continuousReportingEnabled) = 0;
   virtual Err_t initMachine(Machine_t machine) = 0;
   virtual void encodePosition() = 0;
@@ -50,7 +150,15 @@ public:
   virtual Machine_t getMachineType() = 0;
   virtual bool setNextLine(uint8_t lineNumber) = 0;
   virtual void setLastLine() = 0;
+  virtual void nackLine(Err_t error) = 0;
   virtual void setMachineType(Machine_t) = 0;
+  virtual Err_t setMotif(uint8_t width, uint8_t height, uint16_t rows,
+                         uint8_t firstRow, const uint8_t *bitmap,
+                         uint8_t len) = 0;
+  virtual void getStats(KnitterStats &stats, bool reset) = 0;
+  virtual void setReportPolicy(ReportMode_t mode, uint8_t interval) = 0;
+  virtual bool popEdge(EdgeRecord &edge) = 0;
+  virtual uint8_t getEdgesLost() = 0;
 };
 
 // Singleton container class for static methods.
@@ -74,7 +182,7 @@ public:
   static void isr();
 #endif
   static Err_t startKnitting(uint8_t startNeedle,
-                             uint8_t stopNeedle, uint8_t *pattern_start,
+                             uint8_t stopNeedle, uint8_t *const *pattern_start,
                              bool continuousReportingEnabled);
   static Err_t initMachine(Machine_t machine);
   static void encodePosition();
@@ -85,7 +193,14 @@ public:
   static Machine_t getMachineType();
   static bool setNextLine(uint8_t lineNumber);
   static void setLastLine();
+  static void nackLine(Err_t error);
   static void setMachineType(Machine_t);
+  static Err_t setMotif(uint8_t width, uint8_t height, uint16_t rows,
+                        uint8_t firstRow, const uint8_t *bitmap, uint8_t len);
+  static void getStats(KnitterStats &stats, bool reset);
+  static void setReportPolicy(ReportMode_t mode, uint8_t interval);
+  static bool popEdge(EdgeRecord &edge);
+  static uint8_t getEdgesLost();
 };
 
 class Knitter : public KnitterInterface {
@@ -94,7 +209,7 @@ public:
   void setUpInterrupt() final;
   void isr() final;
   Err_t startKnitting(uint8_t startNeedle,
-                      uint8_t stopNeedle, uint8_t *pattern_start,
+                      uint8_t stopNeedle, uint8_t *const *pattern_start,
                       bool continuousReportingEnabled) final;
   Err_t initMachine(Machine_t machine) final;
   void encodePosition() final;
@@ -105,19 +220,72 @@ public:
   Machine_t getMachineType() final;
   bool setNextLine(uint8_t lineNumber) final;
   void setLastLine() final;
+  void nackLine(Err_t error) final;
   void setMachineType(Machine_t) final;
+  Err_t setMotif(uint8_t width, uint8_t height, uint16_t rows,
+                 uint8_t firstRow, const uint8_t *bitmap, uint8_t len) final;
+  void getStats(KnitterStats &stats, bool reset) final;
+  void setReportPolicy(ReportMode_t mode, uint8_t interval) final;
+  bool popEdge(EdgeRecord &edge) final;
+  uint8_t getEdgesLost() final;
 
 private:
-  void reqLine(uint8_t lineNumber);
+  void reqLine(uint8_t lineNumber, Err_t error = ErrorCode::success);
+  void retryLine(Err_t error);
+  void prefetchLine();
+  void acceptLine(uint8_t lineNumber);
+  void tileMotif(uint8_t *line);
+  void recordLineStats();
+  bool getLineSlack(uint16_t &slack) const;
+  void resetStats();
+  void finishLine();
+  uint8_t *getLine(uint8_t lineNumber) const;
+  void knitStep(const EncoderEvent &event);
+  void reportPosition(const EncoderEvent &event);
+  bool scheduleMatches(const EncoderEvent &state) const;
+  void actuate(const EncoderEvent &event);
+  bool timesEdges() const;
+  void setLeadTime(uint16_t leadTime);
+  void updateVelocity(uint32_t time);
+  uint8_t getStartOffset(const Direction_t direction,
+                         const Carriage_t carriage) const;
+  bool updateSchedule(const EncoderEvent &state);
+  void compileSchedule();
+  template <Machine_t M> void compileSchedule();
+  uint8_t scheduleEntry(uint8_t position) const;
+  template <Machine_t M> uint8_t scheduleEntry(uint8_t position) const;
   bool calculatePixelAndSolenoid();
+  bool calculatePixelAndSolenoid(const EncoderEvent &state, uint8_t &pixel,
+                                 uint8_t &solenoid) const;
+  template <Machine_t M>
+  bool calculatePixelAndSolenoid(const EncoderEvent &state, uint8_t &pixel,
+                                 uint8_t &solenoid) const;
+  template <Machine_t M>
+  bool calculateOffsets(const EncoderEvent &state, uint8_t &startOffset,
+                        uint8_t &solenoidOffset) const;
+  template <Machine_t M>
+  static void calculatePixelAndSolenoid(uint8_t position, uint8_t startOffset,
+                                        uint8_t solenoidOffset, uint8_t &pixel,
+                                        uint8_t &solenoid);
   void stopKnitting() const;
 
   // job parameters
   Machine_t m_machineType;
   uint8_t m_startNeedle;
   uint8_t m_stopNeedle;
-  uint8_t *m_lineBuffer;
+  uint8_t *const *m_lineBuffer;
   bool m_continuousReportingEnabled;
+  ReportMode_t m_reportMode;
+  uint8_t m_reportInterval;
+
+  // Positions passed since the last `indPositions` report, of which
+  // the last `REPORT_BATCH_LEN` are kept.
+  uint8_t m_reportPositions[REPORT_BATCH_LEN];
+  uint8_t m_reportHead;
+  uint16_t m_reportPassed;
+  uint32_t m_reportTime;
+  Direction_t m_reportDirection;
+  bool m_reportEvent;
 
   // current machine state
   uint8_t m_position;
@@ -126,10 +294,54 @@ private:
   BeltShift_t m_beltShift;
   Carriage_t m_carriage;
 
+  // positions queued by the encoder interrupt for `knit()`,
+  // and the number of positions lost because the queue was full
+  RingBuffer<EncoderEvent, ENCODER_QUEUE_LEN> m_encoderEvents;
+  uint8_t m_lastQueuedPosition;
+  volatile uint8_t m_encoderOverflows;
+#if ENABLE_EDGE_LOG
+  // encoder edges for `reqEdges`, and the number of edges lost
+  // because the log was full
+  RingBuffer<EdgeRecord, EDGE_LOG_LEN> m_edgeLog;
+  volatile uint8_t m_edgesLost;
+#endif
+  // position of the carriage when knitting started
+  EncoderEvent m_startEvent;
+  bool m_startPending;
+
+  // pattern rows: the row being knitted and the prefetched rows behind it
+  uint8_t *m_currentLine;
+  uint8_t m_linesBuffered;
+  bool m_awaitingLine;
+
   bool m_lineRequested;
   uint8_t m_currentLineNumber;
   bool m_lastLineFlag;
 
+  // Motif uploaded with `reqMotif`, one row of `m_motifRowLen` bytes
+  // per motif row. Rows are generated from it by tiling instead of
+  // being requested from the host when the job starts with a
+  // complete motif.
+  uint8_t m_motif[MAX_MOTIF_LEN];
+  uint8_t m_motifWidth;
+  uint8_t m_motifHeight;
+  uint8_t m_motifRowLen;
+  uint8_t m_motifRowsLoaded;
+  uint16_t m_motifRows; // rows to knit, or 0 to knit until stopped
+  bool m_motifActive;
+  uint8_t m_motifRow;   // motif row of the next line to generate
+  uint16_t m_motifLinesLeft;
+
+  // time of the outstanding `reqLine`, and the needles passed since
+  uint32_t m_reqLineTime;
+  uint16_t m_reqLineTravel;
+  // time it was last sent, how often it has been sent again for a
+  // rejected answer, and how often it has timed out
+  uint32_t m_reqLineSent;
+  uint8_t m_lineRetries;
+  uint8_t m_lineTimeouts;
+  KnitterStats m_stats;
+
   uint8_t m_sOldPosition;
   bool m_firstRun;
   bool m_workedOnLine;
@@ -142,10 +354,40 @@ private:
   uint8_t m_solenoidToSet;
   uint8_t m_pixelToSet;
 
+  // solenoid schedule for the current line: the offsets and lookup
+  // for the carriage state for which it was compiled
+  uint8_t m_scheduleStartOffset;
+  uint8_t m_scheduleSolenoidOffset;
+  uint8_t (Knitter::*m_scheduleEntry)(uint8_t position) const;
+  volatile bool m_scheduleValid;
+  EncoderEvent m_scheduleState;
+
+  // longest time from encoder edge to solenoid write, in microseconds,
+  // measured only when the edges are timed (see `timesEdges()`)
+  uint16_t m_actuationLatencyMax;
+
+  // Carriage speed, as the filtered time between needles, and the number
+  // of needles to select ahead of the carriage at that speed.
+  uint32_t m_lastEdgeTime;
+  uint16_t m_stepPeriod;
+  uint16_t m_leadThreshold[MAX_LEAD_STEPS];
+  volatile uint8_t m_leadSteps;
+  // last position whose solenoid was selected, and the direction
+  Direction_t m_actuatedDirection;
+  uint8_t m_actuatedPosition;
+
 #if AYAB_TESTS
   // Note: ideally tests would only rely on the public interface.
   FRIEND_TEST(KnitterTest, test_getStartOffset);
   FRIEND_TEST(KnitterTest, test_knit_lastLine_and_no_req);
+  FRIEND_TEST(KnitterTest, test_compileSchedule);
+  FRIEND_TEST(KnitterTest, test_knit_queue);
+  FRIEND_TEST(KnitterTest, test_knit_isr_actuation);
+  FRIEND_TEST(KnitterTest, test_knit_lead);
+  FRIEND_TEST(KnitterTest, test_motif);
+  FRIEND_TEST(KnitterTest, test_stats);
+  FRIEND_TEST(KnitterTest, test_edge_log);
+  FRIEND_TEST(KnitterBenchmark, bench_knit_step);
 #endif
 };
 
@@ -0,0 +1,154 @@
+/*!
+ * \file line_codec.cpp
+ * \brief Run-length coding of pattern rows sent in `cnfLine` messages.
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include "line_codec.h"
+
+// longest literal or repeated run in a single PackBits header
+constexpr uint8_t MAX_RUN_LEN = 128U;
+constexpr uint8_t NOP_HEADER = 0x80U;
+
+/*!
+ * \brief Length of the data encoded by a PackBits stream.
+ * \param src Pointer to the compressed data.
+ * \param srcLen Number of bytes of compressed data.
+ * \return Number of decoded bytes, or `LINE_CODEC_INVALID_LENGTH` if the
+ * last run is truncated.
+ */
+uint16_t LineCodec::decodedLength(const uint8_t *src, uint8_t srcLen) {
+  uint16_t len = 0U;
+  uint8_t i = 0U;
+  while (i < srcLen) {
+    uint8_t header = src[i++];
+    if (header < NOP_HEADER) {
+      // literal run
+      uint8_t runLen = header + 1U;
+      if (runLen > srcLen - i) {
+        return LINE_CODEC_INVALID_LENGTH;
+      }
+      len += runLen;
+      i += runLen;
+    } else if (header > NOP_HEADER) {
+      // repeated run
+      if (i == srcLen) {
+        return LINE_CODEC_INVALID_LENGTH;
+      }
+      len += 257U - header;
+      i++;
+    }
+  }
+  return len;
+}
+
+/*!
+ * \brief Decode a compressed row into the line buffer.
+ * \param encoding Either `LineEncoding::rle` or `LineEncoding::xorDelta`.
+ * \param src Pointer to the compressed data, validated by `decodedLength()`.
+ * \param srcLen Number of bytes of compressed data.
+ * \param prevLine Previous row in the line buffer. Only used by
+ * `LineEncoding::xorDelta`; may be the same as `line`.
+ * \param line Line buffer slot to decode into.
+ * \param lineLen Length of the row in bytes.
+ *
+ * Like the uncompressed row in `Com::h_cnfLine()`, the decoded row is
+ * stored inverted because of the needle states. The XOR of two rows does
+ * not change when both are inverted, so deltas apply to the stored rows.
+ */
+void LineCodec::decode(LineEncoding_t encoding, const uint8_t *src,
+                       uint8_t srcLen, const uint8_t *prevLine, uint8_t *line,
+                       uint8_t lineLen) {
+  uint8_t pos = 0U;
+  uint8_t i = 0U;
+  while ((i < srcLen) && (pos < lineLen)) {
+    uint8_t header = src[i++];
+    if (header == NOP_HEADER) {
+      continue;
+    }
+    bool literal = header < NOP_HEADER;
+    uint8_t runLen = literal ? header + 1U : 257U - header;
+    for (; runLen && (pos < lineLen); runLen--, pos++) {
+      uint8_t value = literal ? src[i++] : src[i];
+      line[pos] = (encoding == LineEncoding::xorDelta) ? prevLine[pos] ^ value
+                                                       : ~value;
+    }
+    if (!literal) {
+      i++;
+    }
+  }
+}
+
+/*!
+ * \brief Compress a row. Reference encoder for host software.
+ * \param encoding Either `LineEncoding::rle` or `LineEncoding::xorDelta`.
+ * \param row Pointer to the row, as it is sent uncompressed.
+ * \param prevRow Pointer to the previous row, as it was sent uncompressed.
+ * Only used by `LineEncoding::xorDelta`.
+ * \param rowLen Length of the row in bytes.
+ * \param dst Pointer to the output buffer.
+ * \param dstLen Size of the output buffer.
+ * \return Number of bytes of compressed data, or 0 if `dst` is too small.
+ */
+uint8_t LineCodec::encode(LineEncoding_t encoding, const uint8_t *row,
+                          const uint8_t *prevRow, uint8_t rowLen, uint8_t *dst,
+                          uint8_t dstLen) {
+  auto at = [&](uint8_t i) -> uint8_t {
+    return (encoding == LineEncoding::xorDelta) ? row[i] ^ prevRow[i] : row[i];
+  };
+
+  uint8_t len = 0U;
+  uint8_t i = 0U;
+  while (i < rowLen) {
+    // length of the run of equal bytes starting at `i`
+    uint8_t runLen = 1U;
+    while ((i + runLen < rowLen) && (runLen < MAX_RUN_LEN) &&
+           (at(i + runLen) == at(i))) {
+      runLen++;
+    }
+
+    if (runLen > 1U) {
+      if (len + 2U > dstLen) {
+        return 0U;
+      }
+      dst[len++] = 257U - runLen;
+      dst[len++] = at(i);
+      i += runLen;
+      continue;
+    }
+
+    // literal bytes up to the start of the next repeated run
+    runLen = 1U;
+    while ((i + runLen < rowLen) && (runLen < MAX_RUN_LEN) &&
+           ((i + runLen + 1U == rowLen) ||
+            (at(i + runLen) != at(i + runLen + 1U)))) {
+      runLen++;
+    }
+    if (len + runLen + 1U > dstLen) {
+      return 0U;
+    }
+    dst[len++] = runLen - 1U;
+    for (; runLen; runLen--) {
+      dst[len++] = at(i++);
+    }
+  }
+  return len;
+}
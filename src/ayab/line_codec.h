@@ -0,0 +1,71 @@
+/*!
+ * \file line_codec.h
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#ifndef LINE_CODEC_H_
+#define LINE_CODEC_H_
+
+#include <Arduino.h>
+
+// Encoding of the pattern data in a `cnfLine` message, carried in
+// bits 1-2 of the flags byte. Encodings other than `raw` are only
+// accepted once compressed lines have been negotiated in `reqStart`.
+enum class LineEncoding : unsigned char {
+  raw = 0,      // uncompressed bitmap
+  rle = 1,      // PackBits run-length coded bitmap
+  xorDelta = 2, // PackBits run-length coded XOR against the previous row
+};
+using LineEncoding_t = enum LineEncoding;
+
+constexpr uint8_t LINE_ENCODING_SHIFT = 1U;
+constexpr uint8_t LINE_ENCODING_MASK = 0x03U;
+
+// returned by `LineCodec::decodedLength()` for a malformed run
+constexpr uint16_t LINE_CODEC_INVALID_LENGTH = UINT16_MAX;
+
+/*!
+ * \brief Encoder and decoder for compressed pattern rows.
+ *
+ * Compressed rows use PackBits run-length coding. Each run starts with
+ * a header byte `n`: for `n` in 0..127 the next `n + 1` bytes are copied
+ * literally, for `n` in 129..255 the next byte is repeated `257 - n`
+ * times, and `n` = 128 is ignored.
+ *
+ * The firmware only needs the decoder. The encoder is the reference
+ * implementation for host software and is used by the unit tests;
+ * the linker drops it from the firmware image.
+ */
+class LineCodec final {
+public:
+  static uint16_t decodedLength(const uint8_t *src, uint8_t srcLen);
+  static void decode(LineEncoding_t encoding, const uint8_t *src,
+                     uint8_t srcLen, const uint8_t *prevLine, uint8_t *line,
+                     uint8_t lineLen);
+  static uint8_t encode(LineEncoding_t encoding, const uint8_t *row,
+                        const uint8_t *prevRow, uint8_t rowLen, uint8_t *dst,
+                        uint8_t dstLen);
+
+private:
+  LineCodec() = default;
+};
+
+#endif // LINE_CODEC_H_
@@ -73,7 +73,7 @@ void stackCanaryCheck() {
     // Memory has been corrupted. Enter "panic" mode: flash LEDs rapidly,
     // and output "PANIC" on the serial port repeatedly.
     while(true) {
-      Serial.print("PANIC");
+      Serial.print(F("PANIC"));
       pinMode(LED_BUILTIN, OUTPUT);
       pinMode(LED_PIN_B, OUTPUT);
       digitalWrite(LED_PIN_B, LOW);
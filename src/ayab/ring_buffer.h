@@ -0,0 +1,104 @@
+/*!
+ * \file ring_buffer.h
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include <Arduino.h>
+
+/*!
+ * \brief Lock-free single-producer, single-consumer ring buffer.
+ *
+ * Intended for passing data from an interrupt service routine to the
+ * main loop without disabling interrupts. Only the producer calls
+ * `push()`, and only the consumer calls `pop()` and `clear()`.
+ *
+ * The head and tail indices run freely modulo 256 and are each written
+ * by one side only. Single byte loads and stores are atomic on AVR, so
+ * no further locking is needed.
+ */
+template <typename T, uint8_t N> class RingBuffer {
+  static_assert((N > 0U) && ((N & (N - 1U)) == 0U) && (N <= 128U),
+                "ring buffer length must be a power of two no greater than 128");
+
+public:
+  /*!
+   * \brief Append an item. Producer side.
+   * \return `true` if successful, `false` if the buffer is full.
+   */
+  bool push(const T &item) {
+    uint8_t head = m_head;
+    if (static_cast<uint8_t>(head - m_tail) == N) {
+      return false;
+    }
+    m_items[head & (N - 1U)] = item;
+    // the item must be written before it is published
+    __asm__ __volatile__("" ::: "memory");
+    m_head = head + 1U;
+    return true;
+  }
+
+  /*!
+   * \brief Remove the oldest item. Consumer side.
+   * \return `true` if successful, `false` if the buffer is empty.
+   */
+  bool pop(T &item) {
+    uint8_t tail = m_tail;
+    if (tail == m_head) {
+      return false;
+    }
+    item = m_items[tail & (N - 1U)];
+    // the item must be read before its slot is released
+    __asm__ __volatile__("" ::: "memory");
+    m_tail = tail + 1U;
+    return true;
+  }
+
+  /*!
+   * \brief Discard all items. Consumer side.
+   */
+  void clear() {
+    m_tail = m_head;
+  }
+
+  /*!
+   * \brief Number of items in the buffer.
+   */
+  uint8_t size() const {
+    return m_head - m_tail;
+  }
+
+  /*!
+   * \brief Number of items that can be added.
+   */
+  uint8_t space() const {
+    return N - size();
+  }
+
+private:
+  T m_items[N];
+  volatile uint8_t m_head = 0U;
+  volatile uint8_t m_tail = 0U;
+};
+
+#endif // RING_BUFFER_H_
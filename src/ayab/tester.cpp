@@ -26,6 +26,7 @@
 
 #include "beeper.h"
 #include "com.h"
+#include "fast_pin.h"
 #include "fsm.h"
 #include "knitter.h"
 #include "tester.h"
@@ -36,35 +37,35 @@
  * \brief Help command handler.
  */
 void Tester::helpCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "The following commands are available:\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "setSingle [0..15] [1/0]\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "setAll [0..FFFF]\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "readEOLsensors\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "readEncoders\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "beep\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "autoRead\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "autoTest\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "send\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "stop\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "quit\n");
-  GlobalCom::sendMsg(AYAB_API::testRes, "help\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("The following commands are available:\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("setSingle [0..15] [1/0]\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("setAll [0..FFFF]\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("readEOLsensors\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("readEncoders\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("beep\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("autoRead [0/1] [1..255 ms]\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("autoTest\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("send\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("stop\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("quit\n"));
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("help\n"));
 }
 
 /*!
  * \brief Send command handler.
  */
 void Tester::sendCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called send\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called send\n"));
   uint8_t p[] = {0x31, 0x32, 0x33};
   GlobalCom::send(p, 3);
-  GlobalCom::sendMsg(AYAB_API::testRes, "\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("\n"));
 }
 
 /*!
  * \brief Beep command handler.
  */
 void Tester::beepCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called beep\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called beep\n"));
   beep();
 }
 
@@ -74,20 +75,20 @@ void Tester::beepCmd() {
  * \param size Number of bytes of data in the buffer.
  */
 void Tester::setSingleCmd(const uint8_t *buffer, size_t size) {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called setSingle\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called setSingle\n"));
   if (size < 3U) {
-    GlobalCom::sendMsg(AYAB_API::testRes, "Error: invalid arguments\n");
+    GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Error: invalid arguments\n"));
     return;
   }
   uint8_t solenoidNumber = buffer[1];
   if (solenoidNumber > 15) {
-    snprintf(buf, BUFFER_LEN, "Error: invalid solenoid index %i\n", solenoidNumber);
+    snprintf_P(buf, BUFFER_LEN, PSTR("Error: invalid solenoid index %i\n"), solenoidNumber);
     GlobalCom::sendMsg(AYAB_API::testRes, buf);
     return;
   }
   uint8_t solenoidState = buffer[2];
   if (solenoidState > 1) {
-    snprintf(buf, BUFFER_LEN, "Error: invalid solenoid value %i\n", solenoidState);
+    snprintf_P(buf, BUFFER_LEN, PSTR("Error: invalid solenoid value %i\n"), solenoidState);
     GlobalCom::sendMsg(AYAB_API::testRes, buf);
     return;
   }
@@ -100,9 +101,9 @@ void Tester::setSingleCmd(const uint8_t *buffer, size_t size) {
  * \param size Number of bytes of data in the buffer.
  */
 void Tester::setAllCmd(const uint8_t *buffer, size_t size) {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called setAll\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called setAll\n"));
   if (size < 3U) {
-    GlobalCom::sendMsg(AYAB_API::testRes, "Error: invalid arguments\n");
+    GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Error: invalid arguments\n"));
     return;
   }
   uint16_t solenoidState = (buffer[1] << 8) + buffer[2];
@@ -113,33 +114,61 @@ void Tester::setAllCmd(const uint8_t *buffer, size_t size) {
  * \brief Read EOL sensors command handler.
  */
 void Tester::readEOLsensorsCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called readEOLsensors\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called readEOLsensors\n"));
   readEOLsensors();
-  GlobalCom::sendMsg(AYAB_API::testRes, "\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("\n"));
 }
 
 /*!
  * \brief Read encoders command handler.
  */
 void Tester::readEncodersCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called readEncoders\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called readEncoders\n"));
   readEncoders();
-  GlobalCom::sendMsg(AYAB_API::testRes, "\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("\n"));
 }
 
 /*!
  * \brief Auto read command handler.
+ * \param buffer Pointer to a data buffer.
+ * \param size Number of bytes of data in the buffer.
+ *
+ * Without arguments, the sensors are read out as text every second.
+ * With a second byte of 1, they are streamed as binary samples instead,
+ * every as many milliseconds as the third byte gives, but no faster
+ * than the serial rate can carry them. Either mode stops the other.
  */
-void Tester::autoReadCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called autoRead, send stop to quit\n");
-  m_autoReadOn = true;
+void Tester::autoReadCmd(const uint8_t *buffer, size_t size) {
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called autoRead, send stop to quit\n"));
+  if ((size < 2U) || (buffer[1] == 0U)) {
+    m_autoReadOn = true;
+    m_samplePeriod = 0U;
+    return;
+  }
+  if ((buffer[1] != 1U) || (size < 3U) || (buffer[2] == 0U)) {
+    GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Error: invalid arguments\n"));
+    return;
+  }
+  // set up the pins once, rather than for every sample
+  if (m_machineType == Machine_t::Kh910) {
+    pinMode(EOL_PIN_R, INPUT_PULLUP);
+    pinMode(EOL_PIN_R_L, INPUT_PULLUP);
+  } else {
+    pinMode(EOL_PIN_R, INPUT);
+  }
+  uint32_t baudRate = GlobalCom::getBaudRate();
+  auto minPeriod = static_cast<uint8_t>(
+      (TESTRES_SAMPLE_BITS * 1000UL + baudRate - 1U) / baudRate);
+  m_samplePeriod = (buffer[2] < minPeriod) ? minPeriod : buffer[2];
+  m_autoReadOn = false;
+  m_lastSampleTime = millis();
 }
 
 /*!
  * \brief Auto test command handler.
  */
 void Tester::autoTestCmd() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Called autoTest, send stop to quit\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Called autoTest, send stop to quit\n"));
   m_autoTestOn = true;
 }
 
@@ -149,6 +178,7 @@ void Tester::autoTestCmd() {
 void Tester::stopCmd() {
   m_autoReadOn = false;
   m_autoTestOn = false;
+  m_samplePeriod = 0U;
 }
 
 /*!
@@ -183,6 +213,10 @@ Err_t Tester::startTest(Machine_t machineType) {
  */
 void Tester::loop() {
   unsigned long now = millis();
+  if ((m_samplePeriod > 0U) && (now - m_lastSampleTime >= m_samplePeriod)) {
+    m_lastSampleTime = now;
+    sendSample();
+  }
   if (now - m_lastTime >= TEST_LOOP_DELAY) {
     m_lastTime = now;
     handleTimerEvent();
@@ -194,8 +228,8 @@ void Tester::loop() {
  * \brief Interrupt service routine for encoder A.
  */
 void Tester::encoderChange() {
-  digitalWrite(LED_PIN_A, digitalRead(ENC_PIN_A));
-  digitalWrite(LED_PIN_B, digitalRead(ENC_PIN_B));
+  LedPinA::write(EncPinA::read());
+  LedPinB::write(EncPinB::read());
 }
 #endif // AYAB_TESTS
 
@@ -206,17 +240,22 @@ void Tester::encoderChange() {
  */
 void Tester::setUp() {
   // Print welcome message
-  GlobalCom::sendMsg(AYAB_API::testRes, "AYAB Hardware Test, ");
-  snprintf(buf, BUFFER_LEN, "Firmware v%hhu.%hhu.%hhu", FW_VERSION_MAJ, FW_VERSION_MIN, FW_VERSION_PATCH);
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("AYAB Hardware Test, "));
+  snprintf_P(buf, BUFFER_LEN, PSTR("Firmware v%hhu.%hhu.%hhu"), FW_VERSION_MAJ, FW_VERSION_MIN, FW_VERSION_PATCH);
   GlobalCom::sendMsg(AYAB_API::testRes, buf);
   if (*FW_VERSION_SUFFIX != '\0') {
-    snprintf(buf, BUFFER_LEN, "-%s", FW_VERSION_SUFFIX);
+    snprintf_P(buf, BUFFER_LEN, PSTR("-%s"), FW_VERSION_SUFFIX);
     GlobalCom::sendMsg(AYAB_API::testRes, buf);
   }
-  snprintf(buf, BUFFER_LEN, " API v%hhu\n\n", API_VERSION);
+  snprintf_P(buf, BUFFER_LEN, PSTR(" API v%hhu\n\n"), API_VERSION);
   GlobalCom::sendMsg(AYAB_API::testRes, buf);
   helpCmd();
 
+  // The Hall sensors are read from the samples the encoders take in the
+  // background. The test may start before any machine was initialized,
+  // so start them here.
+  GlobalEncoders::init(m_machineType);
+
 #ifndef AYAB_TESTS
   // Attach interrupts for both encoder pins
   attachInterrupt(digitalPinToInterrupt(ENC_PIN_A), GlobalTester::encoderChange, CHANGE);
@@ -225,6 +264,7 @@ void Tester::setUp() {
 
   m_autoReadOn = false;
   m_autoTestOn = false;
+  m_samplePeriod = 0U;
   m_lastTime = millis();
   m_timerEventOdd = false;
 
@@ -243,45 +283,47 @@ void Tester::beep() const {
  * \brief Read the Hall sensors that determine which carriage is in use.
  */
 void Tester::readEncoders() const {
-  GlobalCom::sendMsg(AYAB_API::testRes, "  ENC_A: ");
-  bool state = digitalRead(ENC_PIN_A);
-  GlobalCom::sendMsg(AYAB_API::testRes, state ? "HIGH" : "LOW");
-  GlobalCom::sendMsg(AYAB_API::testRes, "  ENC_B: ");
-  state = digitalRead(ENC_PIN_B);
-  GlobalCom::sendMsg(AYAB_API::testRes, state ? "HIGH" : "LOW");
-  GlobalCom::sendMsg(AYAB_API::testRes, "  ENC_C: ");
-  state = digitalRead(ENC_PIN_C);
-  GlobalCom::sendMsg(AYAB_API::testRes, state ? "HIGH" : "LOW");
+  sendPinState(PSTR("  ENC_A: "), ENC_PIN_A);
+  sendPinState(PSTR("  ENC_B: "), ENC_PIN_B);
+  sendPinState(PSTR("  ENC_C: "), ENC_PIN_C);
+}
+
+/*!
+ * \brief Send the name and state of a digital input.
+ * \param name Name, in program memory.
+ * \param pin Input pin.
+ */
+void Tester::sendPinState(const char *name, uint8_t pin) const {
+  GlobalCom::sendMsg_P(AYAB_API::testRes, name);
+  bool state = digitalRead(pin);
+  GlobalCom::sendMsg_P(AYAB_API::testRes, state ? PSTR("HIGH") : PSTR("LOW"));
 }
 
 /*!
  * \brief Read the End of Line sensors.
  */
 void Tester::readEOLsensors() {
-  auto hallSensor = static_cast<uint16_t>(analogRead(EOL_PIN_L));
-  snprintf(buf, BUFFER_LEN, "  EOL_L: %hu", hallSensor);
+  uint16_t hallSensor = GlobalEncoders::getHallValue(Direction_t::Left);
+  snprintf_P(buf, BUFFER_LEN, PSTR("  EOL_L: %hu"), hallSensor);
   GlobalCom::sendMsg(AYAB_API::testRes, buf);
   if (m_machineType == Machine_t::Kh910) {
     pinMode(EOL_PIN_R, INPUT_PULLUP);
     pinMode(EOL_PIN_R_L, INPUT_PULLUP);
-    snprintf(buf, BUFFER_LEN, "  EOL_R_K: %s", digitalRead(EOL_PIN_R) ? "HIGH" : "LOW");
-    GlobalCom::sendMsg(AYAB_API::testRes, buf);
+    sendPinState(PSTR("  EOL_R_K: "), EOL_PIN_R);
 
     // Set EOL_PIN_R_DETECT to LOW to detect if it is connected to EOL_PIN_R_L
     pinMode(EOL_PIN_R_DETECT, OUTPUT);
     digitalWrite(EOL_PIN_R_DETECT, LOW);
     // If pins EOL_PIN_R_DETECT and EOL_PIN_R_L are shorted,
     // it means the lace signal is connected
-    snprintf(buf, BUFFER_LEN, " EOL_PIN_R_DETECT: %s", digitalRead(EOL_PIN_R_DETECT) ? "HIGH" : "LOW");
-    GlobalCom::sendMsg(AYAB_API::testRes, buf);
+    sendPinState(PSTR(" EOL_PIN_R_DETECT: "), EOL_PIN_R_DETECT);
 
     pinMode(EOL_PIN_R_DETECT, INPUT);
-    snprintf(buf, BUFFER_LEN, " EOL_R_L: %s", digitalRead(EOL_PIN_R_L) ? "HIGH" : "LOW");
-    GlobalCom::sendMsg(AYAB_API::testRes, buf);
+    sendPinState(PSTR(" EOL_R_L: "), EOL_PIN_R_L);
   } else {
     pinMode(EOL_PIN_R, INPUT);
-    hallSensor = static_cast<uint16_t>(analogRead(EOL_PIN_R));
-    snprintf(buf, BUFFER_LEN, "  EOL_R: %hu", hallSensor);
+    hallSensor = GlobalEncoders::getHallValue(Direction_t::Right);
+    snprintf_P(buf, BUFFER_LEN, PSTR("  EOL_R: %hu"), hallSensor);
     GlobalCom::sendMsg(AYAB_API::testRes, buf);
   }
 }
@@ -290,17 +332,53 @@ void Tester::readEOLsensors() {
  * \brief Read both carriage sensors and End of Line sensors.
  */
 void Tester::autoRead() {
-  GlobalCom::sendMsg(AYAB_API::testRes, "\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("\n"));
   readEOLsensors();
   readEncoders();
-  GlobalCom::sendMsg(AYAB_API::testRes, "\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("\n"));
+}
+
+/*!
+ * \brief Send one binary sample of all sensors.
+ *
+ * See `TESTRES_SAMPLE` for the format.
+ */
+void Tester::sendSample() const {
+  uint32_t time = micros();
+  uint16_t eolL = GlobalEncoders::getHallValue(Direction_t::Left);
+  uint16_t eolR = 0U;
+  uint8_t states = 0U;
+  if (m_machineType == Machine_t::Kh910) {
+    bitWrite(states, TESTRES_EOL_R_BIT, digitalRead(EOL_PIN_R));
+    bitWrite(states, TESTRES_EOL_R_L_BIT, digitalRead(EOL_PIN_R_L));
+  } else {
+    eolR = GlobalEncoders::getHallValue(Direction_t::Right);
+  }
+  bitWrite(states, TESTRES_ENC_A_BIT, EncPinA::read());
+  bitWrite(states, TESTRES_ENC_B_BIT, EncPinB::read());
+  bitWrite(states, TESTRES_ENC_C_BIT, EncPinC::read());
+
+  // `payload` will be allocated on stack since length is compile-time constant
+  uint8_t payload[TESTRES_SAMPLE_LEN];
+  payload[0] = static_cast<uint8_t>(AYAB_API::testRes);
+  payload[1] = TESTRES_SAMPLE;
+  payload[2] = static_cast<uint8_t>(time >> 24U);
+  payload[3] = static_cast<uint8_t>(time >> 16U);
+  payload[4] = static_cast<uint8_t>(time >> 8U);
+  payload[5] = static_cast<uint8_t>(time);
+  payload[6] = highByte(eolL);
+  payload[7] = lowByte(eolL);
+  payload[8] = highByte(eolR);
+  payload[9] = lowByte(eolR);
+  payload[10] = states;
+  GlobalCom::send(payload, TESTRES_SAMPLE_LEN);
 }
 
 /*!
  * \brief Set even-numbered solenoids.
  */
 void Tester::autoTestEven() const {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Set even solenoids\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Set even solenoids\n"));
   digitalWrite(LED_PIN_A, HIGH);
   digitalWrite(LED_PIN_B, HIGH);
   GlobalSolenoids::setSolenoids(0xAAAA);
@@ -310,7 +388,7 @@ void Tester::autoTestEven() const {
  * \brief Set odd-numbered solenoids.
  */
 void Tester::autoTestOdd() const {
-  GlobalCom::sendMsg(AYAB_API::testRes, "Set odd solenoids\n");
+  GlobalCom::sendMsg_P(AYAB_API::testRes, PSTR("Set odd solenoids\n"));
   digitalWrite(LED_PIN_A, LOW);
   digitalWrite(LED_PIN_B, LOW);
   GlobalSolenoids::setSolenoids(0x5555);
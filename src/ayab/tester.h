@@ -32,6 +32,24 @@
 constexpr uint8_t BUFFER_LEN = 40;
 constexpr unsigned int TEST_LOOP_DELAY = 500; // ms
 
+// Binary `testRes` message with one sample of the sensors, streamed by
+// `autoReadCmd` when asked for: the message ID, `TESTRES_SAMPLE`,
+// `micros()` (4 bytes), the left and right Hall sensors (2 bytes each,
+// 0 if digital), and the digital sensor states. Values of more than one
+// byte are big-endian. Text results never start with `TESTRES_SAMPLE`.
+constexpr uint8_t TESTRES_SAMPLE = 0x00U;
+constexpr uint8_t TESTRES_SAMPLE_LEN = 11U;
+// Bits a sample takes on the serial line at worst, with every byte
+// escaped, 2 end markers, and 10 bits per byte. This sets the shortest
+// sample period: 3 ms at 115200 baud, 1 ms from 250k baud.
+constexpr uint16_t TESTRES_SAMPLE_BITS = (2U * TESTRES_SAMPLE_LEN + 2U) * 10U;
+// bits of the digital sensor states
+constexpr uint8_t TESTRES_ENC_A_BIT = 0U;
+constexpr uint8_t TESTRES_ENC_B_BIT = 1U;
+constexpr uint8_t TESTRES_ENC_C_BIT = 2U;
+constexpr uint8_t TESTRES_EOL_R_BIT = 3U;   // KH910 only
+constexpr uint8_t TESTRES_EOL_R_L_BIT = 4U; // KH910 only
+
 class TesterInterface {
 public:
   virtual ~TesterInterface() = default;
@@ -46,12 +64,12 @@ public:
   virtual void setAllCmd(const uint8_t *buffer, size_t size) = 0;
   virtual void readEOLsensorsCmd() = 0;
   virtual void readEncodersCmd() = 0;
-  virtual void autoReadCmd() = 0;
+  virtual void autoReadCmd(const uint8_t *buffer, size_t size) = 0;
   virtual void autoTestCmd() = 0;
   virtual void stopCmd() = 0;
   virtual void quitCmd() = 0;
 #ifndef AYAB_TESTS
-  virtual void encoderChange();
+  virtual void encoderChange() = 0;
 #endif
 };
 
@@ -79,7 +97,7 @@ public:
   static void setAllCmd(const uint8_t *buffer, size_t size);
   static void readEOLsensorsCmd();
   static void readEncodersCmd();
-  static void autoReadCmd();
+  static void autoReadCmd(const uint8_t *buffer, size_t size);
   static void autoTestCmd();
   static void stopCmd();
   static void quitCmd();
@@ -99,7 +117,7 @@ public:
   void setAllCmd(const uint8_t *buffer, size_t size) final;
   void readEOLsensorsCmd() final;
   void readEncodersCmd() final;
-  void autoReadCmd() final;
+  void autoReadCmd(const uint8_t *buffer, size_t size) final;
   void autoTestCmd() final;
   void stopCmd() final;
   void quitCmd() final;
@@ -112,7 +130,9 @@ private:
   void beep() const;
   void readEOLsensors();
   void readEncoders() const;
+  void sendPinState(const char *name, uint8_t pin) const;
   void autoRead();
+  void sendSample() const;
   void autoTestEven() const;
   void autoTestOdd() const;
   void handleTimerEvent();
@@ -122,8 +142,14 @@ private:
   bool m_autoTestOn = false;
   unsigned long m_lastTime = 0U;
   bool m_timerEventOdd = false;
+  uint8_t m_samplePeriod = 0U; // ms between binary samples, or 0 for none
+  unsigned long m_lastSampleTime = 0U;
 
   char buf[BUFFER_LEN] = {0};
+
+#if AYAB_TESTS
+  FRIEND_TEST(TesterTest, test_autoReadCmd_binary);
+#endif
 };
 
 #endif // TESTER_H_
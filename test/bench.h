@@ -0,0 +1,53 @@
+/*!`
+ * \file bench.h
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+/*!
+ * \brief Time a loop body on the host.
+ * \param ops Number of operations performed by `body`.
+ * \param body Callable that performs `ops` operations.
+ * \return Mean time per operation in nanoseconds.
+ */
+template <typename F> double benchNsPerOp(uint32_t ops, F body) {
+  // warm up caches and branch predictors
+  body();
+  auto start = std::chrono::steady_clock::now();
+  body();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(stop - start).count() / ops;
+}
+
+/*!
+ * \brief Print a benchmark result in a format that is easy to diff.
+ */
+inline void benchReport(const char *name, double nsPerOp) {
+  std::printf("[ BENCH    ] %-40s %10.2f ns/op\n", name, nsPerOp);
+}
+
+#endif // BENCH_H_
@@ -0,0 +1,248 @@
+/*!`
+ * \file bench_com.cpp
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <bench.h>
+#include <com.h>
+#include <crc8.h>
+#include <fsm.h>
+#include <knitter.h>
+
+extern Com *com;
+extern Fsm *fsm;
+extern Knitter *knitter;
+
+// messages in the synthetic stream, and passes over it
+constexpr uint32_t BENCH_STREAM_MESSAGES = 20000U;
+constexpr uint8_t BENCH_STREAM_PASSES = 10U;
+
+// A recorded stream of bytes from the host, SLIP encoded,
+// is replayed as well if this environment variable names it.
+constexpr char BENCH_STREAM_ENV[] = "AYAB_BENCH_SLIP";
+
+enum class BenchKind : uint8_t {
+  cnfLine,
+  reqStart,
+  testCmd,
+  request, // `reqInfo` and `reqStats`
+  garbage,
+  recorded
+};
+constexpr uint8_t NUM_BENCH_KINDS = 6U;
+constexpr const char *BENCH_KIND_NAMES[NUM_BENCH_KINDS] = {
+    "cnfLine", "reqStart", "test command", "reqInfo/reqStats", "garbage",
+    "recorded"};
+
+struct BenchStream {
+  std::vector<uint8_t> bytes;
+  std::vector<size_t> ends; // index of the `END` byte of each message
+  std::vector<BenchKind> kinds;
+
+  void append(const std::vector<uint8_t> &msg, BenchKind kind) {
+    std::vector<uint8_t> encoded(SLIP::getEncodedBufferSize(msg.size()));
+    size_t len = SLIP::encode(msg.data(), msg.size(), encoded.data());
+    bytes.insert(bytes.end(), encoded.begin(), encoded.begin() + len);
+    ends.push_back(bytes.size());
+    bytes.push_back(static_cast<uint8_t>(SLIP::END));
+    kinds.push_back(kind);
+  }
+  void appendWithCrc(std::vector<uint8_t> msg, BenchKind kind) {
+    msg.push_back(Crc8::compute(msg.data(), msg.size()));
+    append(msg, kind);
+  }
+};
+
+// the mix of messages sent while knitting a KH910 job, with some noise
+static BenchStream benchSyntheticStream() {
+  BenchStream stream;
+  uint32_t seed = 1U;
+  auto next = [&seed]() -> uint8_t {
+    seed = seed * 1103515245U + 12345U;
+    return static_cast<uint8_t>(seed >> 16U);
+  };
+  uint8_t lineLen = LINE_BUFFER_LEN[static_cast<uint8_t>(Machine_t::Kh910)];
+  uint8_t lineNumber = 0U;
+  for (uint32_t n = 0U; n < BENCH_STREAM_MESSAGES; n++) {
+    uint8_t dice = next() % 20U;
+    if (dice < 12U) {
+      std::vector<uint8_t> msg = {static_cast<uint8_t>(AYAB_API::cnfLine),
+                                  lineNumber++, 0U, 0U};
+      for (uint8_t i = 0U; i < lineLen; i++) {
+        msg.push_back(next());
+      }
+      stream.appendWithCrc(msg, BenchKind::cnfLine);
+    } else if (dice < 14U) {
+      stream.appendWithCrc({static_cast<uint8_t>(AYAB_API::reqStart), 0U,
+                            199U, 0U},
+                           BenchKind::reqStart);
+    } else if (dice < 17U) {
+      auto id = static_cast<uint8_t>(
+          static_cast<uint8_t>(AYAB_API::helpCmd) + next() % 11U);
+      stream.append({id, next(), next()}, BenchKind::testCmd);
+    } else if (dice < 19U) {
+      stream.append({static_cast<uint8_t>((dice & 1U) ? AYAB_API::reqInfo
+                                                      : AYAB_API::reqStats)},
+                    BenchKind::request);
+    } else {
+      std::vector<uint8_t> msg(1U + next() % 40U);
+      for (auto &c : msg) {
+        do {
+          c = next();
+        } while (c == SLIP::END);
+      }
+      // escaped as it is, as line noise would leave it
+      stream.bytes.insert(stream.bytes.end(), msg.begin(), msg.end());
+      stream.ends.push_back(stream.bytes.size());
+      stream.bytes.push_back(static_cast<uint8_t>(SLIP::END));
+      stream.kinds.push_back(BenchKind::garbage);
+    }
+  }
+  return stream;
+}
+
+static BenchStream benchRecordedStream(const char *path) {
+  BenchStream stream;
+  std::ifstream file(path, std::ios::binary);
+  stream.bytes.assign(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+  for (size_t i = 0U; i < stream.bytes.size(); i++) {
+    if (stream.bytes[i] == SLIP::END) {
+      stream.ends.push_back(i);
+      stream.kinds.push_back(BenchKind::recorded);
+    }
+  }
+  return stream;
+}
+
+/*!
+ * \brief Time a stream of bytes from the host.
+ * \param receive Hands one byte to `Com`.
+ * \param discard Throws away the replies queued for the serial port.
+ *
+ * Each message is handled when its last byte arrives, so the bytes
+ * before it are timed as decoding, and the last byte on its own as
+ * dispatch, from the last byte arriving to the handler returning.
+ */
+template <typename F, typename G>
+void benchStream(const BenchStream &stream, F receive, G discard) {
+  using Clock = std::chrono::steady_clock;
+  auto ns = [](Clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+  };
+  if (stream.ends.empty()) {
+    return;
+  }
+
+  // the cost of reading the clock, taken off each timing
+  double overhead = benchNsPerOp(BENCH_STREAM_MESSAGES, [&] {
+    for (uint32_t n = 0U; n < BENCH_STREAM_MESSAGES; n++) {
+      volatile auto t = Clock::now();
+      (void)t;
+    }
+  });
+
+  double decodeSum = 0.0;
+  double dispatchSum = 0.0;
+  std::vector<double> latencies[NUM_BENCH_KINDS];
+  for (uint8_t pass = 0U; pass < BENCH_STREAM_PASSES; pass++) {
+    size_t i = 0U;
+    for (size_t m = 0U; m < stream.ends.size(); m++) {
+      auto start = Clock::now();
+      for (; i < stream.ends[m]; i++) {
+        receive(stream.bytes[i]);
+      }
+      auto end = Clock::now();
+      receive(stream.bytes[i++]);
+      auto handled = Clock::now();
+      decodeSum += std::max(0.0, ns(end - start) - overhead);
+      double t = std::max(0.0, ns(handled - end) - overhead);
+      dispatchSum += t;
+      latencies[static_cast<uint8_t>(stream.kinds[m])].push_back(t);
+      discard();
+    }
+  }
+
+  size_t messages = stream.ends.size();
+  benchReport("slip decode, per byte",
+              decodeSum / (BENCH_STREAM_PASSES * (stream.bytes.size() - messages)));
+  benchReport("dispatch, per message",
+              dispatchSum / (BENCH_STREAM_PASSES * messages));
+  char name[64];
+  for (uint8_t k = 0U; k < NUM_BENCH_KINDS; k++) {
+    std::vector<double> &t = latencies[k];
+    if (t.empty()) {
+      continue;
+    }
+    std::sort(t.begin(), t.end());
+    double sum = 0.0;
+    for (double x : t) {
+      sum += x;
+    }
+    snprintf(name, sizeof(name), "%s, mean", BENCH_KIND_NAMES[k]);
+    benchReport(name, sum / t.size());
+    snprintf(name, sizeof(name), "%s, 99th percentile", BENCH_KIND_NAMES[k]);
+    benchReport(name, t[t.size() * 99U / 100U]);
+    snprintf(name, sizeof(name), "%s, worst case", BENCH_KIND_NAMES[k]);
+    benchReport(name, t.back());
+  }
+}
+
+TEST(ComBenchmark, bench_protocol) {
+  // The serial port never has room, so that replies are only queued,
+  // as they are on the device before the UART takes them.
+  ArduinoMock *arduinoMock = arduinoMockInstance();
+  SerialMock *serialMock = serialMockInstance();
+  ON_CALL(*serialMock, availableForWrite).WillByDefault(testing::Return(0));
+  testing::GMOCK_FLAG(verbose) = "error";
+
+  fsm->init();
+  knitter->initMachine(Machine_t::Kh910);
+  com->init();
+
+  auto receive = [](uint8_t c) { com->receive(c); };
+  auto discard = []() {
+    com->m_txHigh.clear();
+    com->m_txLow.clear();
+    com->m_txRemaining = 0U;
+  };
+  benchStream(benchSyntheticStream(), receive, discard);
+  const char *path = std::getenv(BENCH_STREAM_ENV);
+  if (path != nullptr) {
+    BenchStream stream = benchRecordedStream(path);
+    std::printf("[ BENCH    ] %s: %zu bytes, %zu messages\n", path,
+                stream.bytes.size(), stream.ends.size());
+    benchStream(stream, receive, discard);
+  }
+
+  testing::GMOCK_FLAG(verbose) = "warning";
+  (void)arduinoMock;
+  releaseSerialMock();
+  releaseArduinoMock();
+}
@@ -0,0 +1,72 @@
+/*!`
+ * \file bench_crc8.cpp
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <gtest/gtest.h>
+
+#include <bench.h>
+#include <com.h>
+#include <crc8.h>
+
+// checksums of a `cnfLine` message
+constexpr uint32_t BENCH_MESSAGES = 1000000U;
+constexpr uint8_t CNFLINE_LEN = MAX_LINE_BUFFER_LEN + 4U;
+
+static uint8_t crc8Bitwise(const uint8_t *buffer, size_t len) {
+  uint8_t crc = 0x00U;
+  while (len--) {
+    uint8_t extract = *buffer++;
+    for (uint8_t tempI = 8U; tempI; tempI--) {
+      uint8_t sum = (crc ^ extract) & 0x01U;
+      crc >>= 1U;
+      if (sum) {
+        crc ^= 0x8CU;
+      }
+      extract >>= 1U;
+    }
+  }
+  return crc;
+}
+
+TEST(Crc8Benchmark, bench_crc8) {
+  uint8_t msg[CNFLINE_LEN];
+  for (uint8_t i = 0; i < CNFLINE_LEN; i++) {
+    msg[i] = 0x5A ^ (13U * i);
+  }
+
+  volatile uint8_t sink = 0U;
+  double bitwise = benchNsPerOp(BENCH_MESSAGES * CNFLINE_LEN, [&] {
+    for (uint32_t n = 0; n < BENCH_MESSAGES; n++) {
+      msg[0] = n;
+      sink = sink ^ crc8Bitwise(msg, CNFLINE_LEN);
+    }
+  });
+  double table = benchNsPerOp(BENCH_MESSAGES * CNFLINE_LEN, [&] {
+    for (uint32_t n = 0; n < BENCH_MESSAGES; n++) {
+      msg[0] = n;
+      sink = sink ^ Crc8::compute(msg, CNFLINE_LEN);
+    }
+  });
+  benchReport("crc8 bitwise, per byte", bitwise);
+  benchReport("crc8 table, per byte", table);
+  (void)sink;
+}
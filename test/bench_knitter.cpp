@@ -0,0 +1,95 @@
+/*!`
+ * \file bench_knitter.cpp
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <gtest/gtest.h>
+
+#include <bench.h>
+#include <knitter.h>
+
+extern Knitter *knitter;
+
+// carriage passes over the full range of encoder positions
+constexpr uint32_t BENCH_PASSES = 20000U;
+constexpr uint32_t BENCH_POSITIONS = UINT8_MAX + 1U;
+
+TEST(KnitterBenchmark, bench_knit_step) {
+  uint8_t line[MAX_LINE_BUFFER_LEN];
+  for (uint8_t i = 0; i < MAX_LINE_BUFFER_LEN; i++) {
+    line[i] = 0x5A ^ i;
+  }
+  knitter->m_currentLine = line;
+  knitter->m_startNeedle = 0;
+  knitter->m_stopNeedle = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 1;
+  knitter->m_machineType = Machine_t::Kh910;
+  knitter->m_scheduleValid = false;
+  EncoderEvent state = {0U, Direction_t::Right, BeltShift::Regular, Carriage_t::Knit, 0U};
+
+  volatile uint8_t sink = 0U;
+  const int endOfLineLeft = knitter->m_startNeedle - END_OF_LINE_OFFSET_L[static_cast<uint8_t>(Machine_t::Kh910)];
+  const int endOfLineRight = knitter->m_stopNeedle + END_OF_LINE_OFFSET_R[static_cast<uint8_t>(Machine_t::Kh910)];
+
+  // what `knit()` did for every encoder step before the schedule
+  double perStep = benchNsPerOp(BENCH_PASSES * BENCH_POSITIONS, [&] {
+    for (uint32_t pass = 0; pass < BENCH_PASSES; pass++) {
+      state.position = 0U;
+      do {
+        uint8_t pixel;
+        uint8_t solenoid;
+        knitter->calculatePixelAndSolenoid(state, pixel, solenoid);
+        bool value = (pixel < MAX_LINE_BUFFER_LEN * 8U) &&
+                     bitRead(line[pixel >> 3], pixel & 0x07);
+        bool working = (pixel >= knitter->m_startNeedle) && (pixel <= knitter->m_stopNeedle);
+        bool endOfLine = (pixel < endOfLineLeft) || (pixel > endOfLineRight);
+        sink = sink ^ solenoid ^ value ^ working ^ endOfLine;
+      } while (++state.position != 0U);
+    }
+  });
+
+  // what `knit()` does now
+  double scheduled = benchNsPerOp(BENCH_PASSES * BENCH_POSITIONS, [&] {
+    for (uint32_t pass = 0; pass < BENCH_PASSES; pass++) {
+      knitter->updateSchedule(state);
+      uint8_t position = 0U;
+      do {
+        uint8_t entry = knitter->scheduleEntry(position);
+        sink = sink ^ (entry & SCHEDULE_SOLENOID_MASK) ^
+               bitRead(entry, SCHEDULE_PIXEL_BIT) ^
+               bitRead(entry, SCHEDULE_WORKING_BIT) ^
+               bitRead(entry, SCHEDULE_END_OF_LINE_BIT);
+      } while (++position != 0U);
+    }
+  });
+
+  // paid once per line and carriage pass
+  double compile = benchNsPerOp(BENCH_PASSES, [&] {
+    for (uint32_t pass = 0; pass < BENCH_PASSES; pass++) {
+      knitter->compileSchedule();
+    }
+  });
+
+  // Host timings only: they compare the two, but say little about
+  // the cycles either takes on the AVR.
+  benchReport("knit step, per-step calculation", perStep);
+  benchReport("knit step, schedule entry", scheduled);
+  benchReport("schedule compile, per line", compile);
+}
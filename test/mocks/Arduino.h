@@ -33,6 +33,22 @@
 #define portInputRegister(x) (&x)
 #define portModeRegister(x) (&x)
 
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef pgm_read_byte
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#endif
+#ifndef memcpy_P
+#define memcpy_P memcpy
+#endif
+#ifndef PSTR
+#define PSTR(s) (s)
+#endif
+#ifndef snprintf_P
+#define snprintf_P snprintf
+#endif
+
 #define lowByte(w) ((uint8_t)((w)&0xff))
 #define highByte(w) ((uint8_t)((w) >> 8))
 
@@ -60,6 +60,11 @@ void Com::sendMsg(AYAB_API_t id, const char *msg) {
   gComMock->sendMsg(id, msg);
 }
 
+void Com::sendMsg_P(AYAB_API_t id, const char *msg) {
+  assert(gComMock != nullptr);
+  gComMock->sendMsg_P(id, msg);
+}
+
 void Com::send_reqLine(const uint8_t lineNumber, Err_t error) const {
   assert(gComMock != nullptr);
   gComMock->send_reqLine(lineNumber, error);
@@ -71,7 +76,20 @@ void Com::send_indState(Carriage_t carriage, uint8_t position,
   gComMock->send_indState(carriage, position, error);
 }
 
+bool Com::send_indPositions(Carriage_t carriage, Direction_t direction,
+                            uint16_t passed, const uint8_t *positions,
+                            uint8_t count) const {
+  assert(gComMock != nullptr);
+  return gComMock->send_indPositions(carriage, direction, passed, positions,
+                                     count);
+}
+
 void Com::onPacketReceived(const uint8_t *buffer, size_t size) {
   assert(gComMock != nullptr);
   gComMock->onPacketReceived(buffer, size);
 }
+
+uint32_t Com::getBaudRate() const {
+  assert(gComMock != nullptr);
+  return gComMock->getBaudRate();
+}
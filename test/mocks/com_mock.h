@@ -34,10 +34,16 @@ public:
   MOCK_METHOD0(update, void());
   MOCK_CONST_METHOD2(send, void(uint8_t *payload, size_t length));
   MOCK_METHOD2(sendMsg, void(AYAB_API_t id, const char *msg));
+  MOCK_METHOD2(sendMsg_P, void(AYAB_API_t id, const char *msg));
   MOCK_CONST_METHOD2(send_reqLine, void(const uint8_t lineNumber, Err_t error));
   MOCK_CONST_METHOD3(send_indState, void(Carriage_t carriage, uint8_t position,
                                    Err_t error));
+  MOCK_CONST_METHOD5(send_indPositions,
+                     bool(Carriage_t carriage, Direction_t direction,
+                          uint16_t passed, const uint8_t *positions,
+                          uint8_t count));
   MOCK_METHOD2(onPacketReceived, void(const uint8_t *buffer, size_t size));
+  MOCK_CONST_METHOD0(getBaudRate, uint32_t());
 };
 
 ComMock *comMockInstance();
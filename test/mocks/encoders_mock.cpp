@@ -49,6 +49,16 @@ void Encoders::encA_interrupt() {
   gEncodersMock->encA_interrupt();
 }
 
+void Encoders::encB_interrupt() {
+  assert(gEncodersMock != nullptr);
+  gEncodersMock->encB_interrupt();
+}
+
+void Encoders::adc_interrupt() {
+  assert(gEncodersMock != nullptr);
+  gEncodersMock->adc_interrupt();
+}
+
 uint8_t Encoders::getPosition() {
   assert(gEncodersMock != nullptr);
   return gEncodersMock->getPosition();
@@ -83,3 +93,8 @@ uint16_t Encoders::getHallValue(Direction_t dir) {
   assert(gEncodersMock != nullptr);
   return gEncodersMock->getHallValue(dir);
 }
+
+uint8_t Encoders::getIllegalTransitions(bool reset) {
+  assert(gEncodersMock != nullptr);
+  return gEncodersMock->getIllegalTransitions(reset);
+}
@@ -35,9 +35,12 @@ public:
   MOCK_METHOD0(getCarriage, Carriage_t());
   MOCK_METHOD0(getMachineType, Machine_t());
   MOCK_METHOD0(encA_interrupt, void());
+  MOCK_METHOD0(encB_interrupt, void());
+  MOCK_METHOD0(adc_interrupt, void());
   MOCK_METHOD0(getPosition, uint8_t());
   MOCK_METHOD0(getHallActive, Direction_t());
   MOCK_METHOD1(getHallValue, uint16_t(Direction_t));
+  MOCK_METHOD1(getIllegalTransitions, uint8_t(bool));
 };
 
 EncodersMock *encodersMockInstance();
@@ -55,7 +55,7 @@ void Knitter::isr() {
 }
 
 Err_t Knitter::startKnitting(uint8_t startNeedle,
-                             uint8_t stopNeedle, uint8_t *pattern_start,
+                             uint8_t stopNeedle, uint8_t *const *pattern_start,
                              bool continuousReportingEnabled) {
   assert(gKnitterMock != nullptr);
   return gKnitterMock->startKnitting(startNeedle, stopNeedle,
@@ -107,7 +107,38 @@ void Knitter::setLastLine() {
   gKnitterMock->setLastLine();
 }
 
+void Knitter::nackLine(Err_t error) {
+  assert(gKnitterMock != nullptr);
+  gKnitterMock->nackLine(error);
+}
+
 void Knitter::setMachineType(Machine_t machineType) {
   assert(gKnitterMock != nullptr);
   return gKnitterMock->setMachineType(machineType);
 }
+
+Err_t Knitter::setMotif(uint8_t width, uint8_t height, uint16_t rows,
+                        uint8_t firstRow, const uint8_t *bitmap, uint8_t len) {
+  assert(gKnitterMock != nullptr);
+  return gKnitterMock->setMotif(width, height, rows, firstRow, bitmap, len);
+}
+
+void Knitter::getStats(KnitterStats &stats, bool reset) {
+  assert(gKnitterMock != nullptr);
+  gKnitterMock->getStats(stats, reset);
+}
+
+void Knitter::setReportPolicy(ReportMode_t mode, uint8_t interval) {
+  assert(gKnitterMock != nullptr);
+  gKnitterMock->setReportPolicy(mode, interval);
+}
+
+bool Knitter::popEdge(EdgeRecord &edge) {
+  assert(gKnitterMock != nullptr);
+  return gKnitterMock->popEdge(edge);
+}
+
+uint8_t Knitter::getEdgesLost() {
+  assert(gKnitterMock != nullptr);
+  return gKnitterMock->getEdgesLost();
+}
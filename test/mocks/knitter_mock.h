@@ -33,7 +33,7 @@ public:
   MOCK_METHOD0(setUpInterrupt, void());
   MOCK_METHOD0(isr, void());
   MOCK_METHOD4(startKnitting, Err_t(uint8_t startNeedle,
-                                    uint8_t stopNeedle, uint8_t *pattern_start,
+                                    uint8_t stopNeedle, uint8_t *const *pattern_start,
                                     bool continuousReportingEnabled));
   MOCK_METHOD1(initMachine, Err_t(Machine_t machineType));
   MOCK_METHOD0(encodePosition, void());
@@ -44,7 +44,15 @@ public:
   MOCK_METHOD0(getMachineType, Machine_t());
   MOCK_METHOD1(setNextLine, bool(uint8_t lineNumber));
   MOCK_METHOD0(setLastLine, void());
+  MOCK_METHOD1(nackLine, void(Err_t error));
   MOCK_METHOD1(setMachineType, void(Machine_t));
+  MOCK_METHOD6(setMotif, Err_t(uint8_t width, uint8_t height, uint16_t rows,
+                               uint8_t firstRow, const uint8_t *bitmap,
+                               uint8_t len));
+  MOCK_METHOD2(getStats, void(KnitterStats &stats, bool reset));
+  MOCK_METHOD2(setReportPolicy, void(ReportMode_t mode, uint8_t interval));
+  MOCK_METHOD1(popEdge, bool(EdgeRecord &edge));
+  MOCK_METHOD0(getEdgesLost, uint8_t());
 };
 
 KnitterMock *knitterMockInstance();
@@ -84,9 +84,9 @@ void Tester::readEncodersCmd() {
   gTesterMock->readEncodersCmd();
 }
 
-void Tester::autoReadCmd() {
+void Tester::autoReadCmd(const uint8_t *buffer, size_t size) {
   assert(gTesterMock != nullptr);
-  gTesterMock->autoReadCmd();
+  gTesterMock->autoReadCmd(buffer, size);
 }
 
 void Tester::autoTestCmd() {
@@ -38,7 +38,7 @@ public:
   MOCK_METHOD2(setAllCmd, void(const uint8_t *, size_t));
   MOCK_METHOD0(readEOLsensorsCmd, void());
   MOCK_METHOD0(readEncodersCmd, void());
-  MOCK_METHOD0(autoReadCmd, void());
+  MOCK_METHOD2(autoReadCmd, void(const uint8_t *, size_t));
   MOCK_METHOD0(autoTestCmd, void());
   MOCK_METHOD0(stopCmd, void());
   MOCK_METHOD0(quitCmd, void());
@@ -0,0 +1,340 @@
+/*!
+ * \file sim.h
+ * \brief Host-side knitting simulator built from the firmware sources.
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include <com.h>
+#include <encoders.h>
+#include <solenoids.h>
+
+// Time in the simulator is counted in nanoseconds.
+using SimTime = uint64_t;
+constexpr SimTime SIM_NEVER = UINT64_MAX;
+constexpr SimTime NS_PER_US = 1000U;
+constexpr SimTime NS_PER_S = 1000000000U;
+
+/*!
+ * \brief Index of a serial rate in `SERIAL_BAUDRATES`.
+ * \return `NUM_SERIAL_BAUDRATES` if the rate is not supported.
+ */
+inline uint8_t baudRateIndex(uint32_t baud) {
+  uint8_t i = 0U;
+  while ((i < NUM_SERIAL_BAUDRATES) && (SERIAL_BAUDRATES[i] != baud)) {
+    i++;
+  }
+  return i;
+}
+
+/*!
+ * \brief Parameters of one simulated knitting job.
+ */
+struct SimConfig {
+  Machine_t machine = Machine_t::Kh910;
+  Carriage_t carriage = Carriage_t::Knit;
+  uint8_t startNeedle = 0U;
+  uint8_t stopNeedle = 199U;
+  uint16_t rows = 8U;
+  uint32_t speed = 200U;          // needles per second at full speed
+  uint16_t ramp = 16U;            // needles to reach full speed
+  bool beltShifted = false;       // belt phase at the turn marks
+  uint32_t turnUs = 50000U;       // pause at each end of a row
+  uint32_t startDelayUs = 200000U; // from `cnfStart` to the first row
+  uint32_t loopUs = 40U;          // duration of one main loop iteration
+  uint32_t latencyUs = 5000U;     // host response time
+  bool compressed = false;        // negotiate compressed pattern rows
+  uint32_t baud = SERIAL_BAUDRATE; // serial rate proposed in `reqInit`
+  uint32_t linkBaud = 1000000U;   // fastest rate the USB serial bridge passes
+  bool report = false;            // continuous reporting
+  ReportMode_t reportMode = ReportMode::everyPosition;
+  uint8_t reportInterval = 0U;
+  uint16_t corruptEvery = 0U;     // corrupt every Nth `cnfLine`, if not 0
+  uint16_t maxActuationUs = 0U;   // longest actuation latency allowed, if not 0
+  uint32_t seed = 1U;             // pattern generator
+  bool verbose = false;
+};
+
+/*!
+ * \brief Simulated time, as seen by the firmware.
+ *
+ * Delays and serial transmit stalls in the firmware extend the
+ * current main loop iteration instead of advancing the time at once,
+ * so that encoder edges are still delivered in order.
+ */
+class SimClock {
+public:
+  SimTime now() const {
+    return m_now + m_debt;
+  }
+  void stall(SimTime ns) {
+    m_debt += ns;
+  }
+  // end of the current main loop iteration
+  SimTime endOfLoop(SimTime loopNs) {
+    SimTime end = m_now + m_debt + loopNs;
+    m_debt = 0U;
+    return end;
+  }
+  void set(SimTime now) {
+    m_now = now;
+  }
+
+private:
+  SimTime m_now = 0U;
+  SimTime m_debt = 0U;
+};
+
+/*!
+ * \brief Serial link between the device and the host.
+ *
+ * Bytes take one character time each at the rate of the sender.
+ * The device has 64 byte receive and transmit buffers, like the
+ * hardware serial port of the Uno. Bytes that are received at a
+ * different rate from the one they were sent at, or faster than the
+ * link passes, are lost as framing errors.
+ */
+class SimSerial {
+public:
+  static constexpr uint8_t BUFFER_LEN = 64U;
+
+  SimSerial(SimClock &clock, uint32_t linkBaud)
+      : m_clock(clock), m_linkBaud(linkBaud) {
+  }
+
+  // device side
+  void begin(uint32_t baud);
+  int available();
+  int read();
+  void write(uint8_t c);
+  int availableForWrite() const;
+  void flush();
+
+  // host side
+  void hostBegin(uint32_t baud);
+  uint32_t hostBaud() const {
+    return m_hostBaud;
+  }
+  SimTime hostWrite(SimTime time, const uint8_t *buffer, size_t size);
+  SimTime nextToHost() const;
+  int popToHost();
+
+  uint32_t m_bytesToDevice = 0U;
+  uint32_t m_bytesToHost = 0U;
+  uint32_t m_rxOverruns = 0U;
+  uint32_t m_framingErrors = 0U;
+  SimTime m_txStall = 0U;
+
+private:
+  struct Byte {
+    SimTime time; // arrival
+    uint8_t c;
+    uint32_t baud; // rate it was sent at
+  };
+
+  void receive();
+  bool garbled(const Byte &byte, uint32_t baud) const {
+    return (byte.baud != baud) || (byte.baud > m_linkBaud);
+  }
+
+  SimClock &m_clock;
+  uint32_t m_linkBaud;
+  uint32_t m_deviceBaud = SERIAL_BAUDRATE;
+  uint32_t m_hostBaud = SERIAL_BAUDRATE;
+  SimTime m_hostTxFree = 0U;
+  SimTime m_deviceTxFree = 0U;
+  std::deque<Byte> m_toDevice;
+  std::deque<uint8_t> m_rxBuffer;
+  std::deque<Byte> m_toHost;
+};
+
+/*!
+ * \brief Solenoids that remember their state for the machine model.
+ *
+ * Forwards to the firmware's `Solenoids`, so that the I2C writes
+ * are still made.
+ */
+class SimSolenoids : public SolenoidsInterface {
+public:
+  explicit SimSolenoids(SolenoidsInterface &solenoids) : m_solenoids(solenoids) {
+  }
+
+  void init() final;
+  void setSolenoid(uint8_t solenoid, bool state) final;
+  void setSolenoids(uint16_t state) final;
+
+  uint16_t m_state = SOLENOIDS_BITMASK;
+
+private:
+  SolenoidsInterface &m_solenoids;
+};
+
+/*!
+ * \brief Knitting machine with one carriage.
+ *
+ * Generates the encoder waveforms and the end of line sensor signals
+ * for a carriage moving over the needle bed, and reads back which
+ * needles the solenoids select. Positions are counted in encoder steps
+ * from the left end of the needle bed, like the firmware does once it
+ * has seen a turn mark.
+ */
+class SimMachine {
+public:
+  SimMachine(const SimConfig &config, const SimSolenoids &solenoids);
+
+  // carriage movements
+  void initPass(SimTime time);
+  void knitPasses(SimTime time);
+  bool finished() const {
+    return m_done;
+  }
+
+  // encoder edges
+  SimTime nextEdge() const {
+    return m_nextEdge;
+  }
+  void edge();
+  void attachInterrupt(uint8_t interrupt, void (*isr)()) {
+    if (interrupt == digitalPinToInterrupt(ENC_PIN_A)) {
+      m_isrA = isr;
+    } else if (interrupt == digitalPinToInterrupt(ENC_PIN_B)) {
+      m_isrB = isr;
+    }
+  }
+
+  // sensors
+  int digitalRead(uint8_t pin) const;
+  int analogRead(uint8_t pin) const;
+  void pinMode(uint8_t pin, uint8_t mode);
+  void digitalWrite(uint8_t pin, uint8_t value);
+
+  // Needles selected in each row, one bit per needle
+  // in the same order as in the `cnfLine` message.
+  std::vector<std::vector<uint8_t>> m_knitted;
+  uint32_t m_edges = 0U;
+
+private:
+  struct Segment {
+    uint8_t target;   // position at the end of the segment
+    int16_t row;      // row knitted, or -1
+    SimTime pauseNs;  // wait before moving
+  };
+
+  void startSegment(SimTime time);
+  SimTime stepTime() const;
+  uint8_t offset(Direction_t direction) const;
+  uint8_t solenoid(Direction_t direction, uint8_t pixel) const;
+  void sample();
+  bool magnetAt(uint8_t sensor) const;
+
+  const SimConfig &m_config;
+  const SimSolenoids &m_solenoids;
+  void (*m_isrA)() = nullptr;
+  void (*m_isrB)() = nullptr;
+
+  std::deque<Segment> m_segments;
+  Segment m_segment = {0U, -1, 0U};
+  bool m_knitting = false;
+  bool m_done = false;
+  Direction_t m_direction = Direction_t::Right;
+  uint8_t m_position;
+  uint16_t m_step = 0U;   // steps since the start of the segment
+  uint16_t m_steps = 0U;  // steps in the segment
+  uint8_t m_quarter = 0U; // quarters of the step gone by
+  SimTime m_nextEdge = SIM_NEVER;
+
+  bool m_encA = false;
+  bool m_encB = false;
+  bool m_detectOutput = false;
+  bool m_detectHigh = false;
+};
+
+/*!
+ * \brief Desktop software following a script.
+ *
+ * Initializes the machine, starts a job, and answers line requests
+ * with a pseudo-random pattern. Decodes every message from the device.
+ */
+class SimHost {
+public:
+  SimHost(const SimConfig &config, SimSerial &serial, SimMachine &machine);
+
+  void start(SimTime time);
+  void receive(SimTime time, uint8_t c);
+  void poll(SimTime time);
+  void requestStats(SimTime time);
+  bool done() const {
+    return m_gotStats;
+  }
+
+  const std::vector<uint8_t> &row(uint16_t n) const {
+    return m_rows[n];
+  }
+
+  uint16_t m_rowsSent = 0U;
+  uint32_t m_lineRequests = 0U;
+  uint32_t m_lineRepeats = 0U;
+  uint32_t m_linesCorrupted = 0U;
+  uint32_t m_lineNacks = 0U;      // `reqLine` with an error code
+  uint32_t m_compressedBytes = 0U;
+  uint32_t m_rawBytes = 0U;
+  uint8_t m_stats[CNFSTATS_LEN] = {0};
+  bool m_gotStats = false;
+  bool m_failed = false;
+  SimTime m_jobStart = 0U;
+  // from `reqLine` to the last byte of `cnfLine` arriving on the device
+  SimTime m_lineLatencyMin = SIM_NEVER;
+  SimTime m_lineLatencyMax = 0U;
+  SimTime m_lineLatencySum = 0U;
+  uint32_t m_baudFallbacks = 0U;
+  // continuous reporting
+  uint32_t m_reports = 0U;
+  uint32_t m_positionsReported = 0U;
+  uint32_t m_positionsPassed = 0U;
+
+private:
+  void handle(SimTime time, const uint8_t *msg, size_t size);
+  SimTime send(SimTime time, std::vector<uint8_t> msg, bool corrupt = false);
+  void sendLine(SimTime requested, uint16_t row);
+  static uint8_t crc8(const uint8_t *buffer, size_t len);
+
+  const SimConfig &m_config;
+  SimSerial &m_serial;
+  SimMachine &m_machine;
+  std::vector<std::vector<uint8_t>> m_rows;
+  std::vector<uint8_t> m_packet;
+  bool m_started = false;
+  bool m_compressed = false;
+  uint32_t m_linesSent = 0U;
+  // serial rate negotiated in `reqInit`
+  uint32_t m_fallbackBaud = SERIAL_BAUDRATE;
+  bool m_baudPending = false;
+  SimTime m_baudTime = 0U;
+};
+
+#endif // SIM_H_
@@ -0,0 +1,306 @@
+/*!
+ * \file sim_host.cpp
+ * \brief Scripted desktop software for the host simulator.
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <algorithm>
+#include <cstdio>
+
+#include "sim.h"
+#include <Encoding/SLIP.h>
+#include <line_codec.h>
+
+SimHost::SimHost(const SimConfig &config, SimSerial &serial,
+                 SimMachine &machine)
+    : m_config(config), m_serial(serial), m_machine(machine) {
+  // Pseudo-random rows, some of which repeat the previous row
+  // or leave runs of needles unselected.
+  uint32_t seed = config.seed;
+  auto next = [&seed]() -> uint8_t {
+    seed = seed * 1103515245U + 12345U;
+    return static_cast<uint8_t>(seed >> 16U);
+  };
+  uint8_t lineLen = LINE_BUFFER_LEN[static_cast<uint8_t>(config.machine)];
+  std::vector<uint8_t> prevRow(lineLen, 0U);
+  for (uint16_t n = 0U; n < config.rows; n++) {
+    std::vector<uint8_t> row(lineLen);
+    uint8_t kind = next() & 3U;
+    for (uint8_t i = 0U; i < lineLen; i++) {
+      switch (kind) {
+      case 0:
+        row[i] = prevRow[i];
+        break;
+      case 1:
+        row[i] = (next() & 1U) ? 0x00U : next();
+        break;
+      default:
+        row[i] = next();
+        break;
+      }
+    }
+    m_rows.push_back(row);
+    prevRow = row;
+  }
+}
+
+/*!
+ * \brief Connect to the device.
+ */
+void SimHost::start(SimTime time) {
+  std::vector<uint8_t> msg = {static_cast<uint8_t>(AYAB_API::reqInit),
+                              static_cast<uint8_t>(m_config.machine)};
+  if (m_config.baud != SERIAL_BAUDRATE) {
+    // propose a faster serial rate
+    msg.push_back(baudRateIndex(m_config.baud));
+  }
+  send(time, msg);
+}
+
+/*!
+ * \brief Go back to the previous serial rate if the device has not
+ * answered at the new one.
+ */
+void SimHost::poll(SimTime time) {
+  if (m_baudPending &&
+      (time - m_baudTime >= SERIAL_FALLBACK_MS * 1000U * NS_PER_US)) {
+    m_baudPending = false;
+    m_serial.hostBegin(m_fallbackBaud);
+    ++m_baudFallbacks;
+    m_machine.initPass(time);
+  }
+}
+
+/*!
+ * \brief Ask for the line telemetry at the end of the job.
+ */
+void SimHost::requestStats(SimTime time) {
+  send(time, {static_cast<uint8_t>(AYAB_API::reqStats), 0U});
+}
+
+/*!
+ * \brief Receive a byte from the device.
+ */
+void SimHost::receive(SimTime time, uint8_t c) {
+  if (c != SLIP::END) {
+    m_packet.push_back(c);
+    return;
+  }
+  if (m_packet.empty()) {
+    return;
+  }
+  std::vector<uint8_t> msg(m_packet.size());
+  size_t size = SLIP::decode(m_packet.data(), m_packet.size(), msg.data());
+  m_packet.clear();
+  handle(time, msg.data(), size);
+}
+
+/*!
+ * \brief Act on a message from the device.
+ */
+void SimHost::handle(SimTime time, const uint8_t *msg, size_t size) {
+  auto id = static_cast<AYAB_API_t>(msg[0]);
+  switch (id) {
+  case AYAB_API::cnfInit:
+    if ((size < 2U) || (msg[1] != 0U)) {
+      printf("cnfInit failed\n");
+      m_failed = true;
+      return;
+    }
+    // Switch to the serial rate that the device has confirmed,
+    // and answer with a message that has a checksum. The carriage
+    // is only moved once the link is settled.
+    if ((size > 2U) && (msg[2] < NUM_SERIAL_BAUDRATES) &&
+        (SERIAL_BAUDRATES[msg[2]] != m_serial.hostBaud())) {
+      m_fallbackBaud = m_serial.hostBaud();
+      m_serial.hostBegin(SERIAL_BAUDRATES[msg[2]]);
+      m_baudPending = true;
+      m_baudTime = time;
+      send(time, {static_cast<uint8_t>(AYAB_API::reqInfo)});
+      return;
+    }
+    m_machine.initPass(time);
+    break;
+
+  case AYAB_API::cnfInfo:
+    if (m_baudPending) {
+      m_baudPending = false;
+      m_machine.initPass(time);
+    }
+    break;
+
+  case AYAB_API::indState:
+    // the machine is ready once its state is indicated without error
+    if ((size >= 2U) && !m_started && (msg[1] == 0U)) {
+      m_started = true;
+      uint8_t flags = (m_config.compressed ? 4U : 0U) | (m_config.report ? 1U : 0U);
+      std::vector<uint8_t> msg = {static_cast<uint8_t>(AYAB_API::reqStart),
+                                  m_config.startNeedle, m_config.stopNeedle,
+                                  flags};
+      if (m_config.reportMode != ReportMode::everyPosition) {
+        msg.push_back(static_cast<uint8_t>(m_config.reportMode));
+        msg.push_back(m_config.reportInterval);
+      }
+      send(time + m_config.latencyUs * NS_PER_US, msg);
+    } else if (m_started) {
+      ++m_reports;
+      ++m_positionsReported;
+      ++m_positionsPassed;
+    }
+    break;
+
+  case AYAB_API::indPositions:
+    if (size >= INDPOSITIONS_HEADER_LEN) {
+      ++m_reports;
+      m_positionsReported += msg[5];
+      m_positionsPassed += (msg[3] << 8) | msg[4];
+    }
+    break;
+
+  case AYAB_API::cnfStart:
+    if ((size < 2U) || (msg[1] != 0U)) {
+      printf("cnfStart failed with error %u\n", size > 1U ? msg[1] : 0U);
+      m_failed = true;
+      return;
+    }
+    m_compressed = (size > 2U) && (msg[2] & 4U);
+    m_jobStart = time;
+    m_machine.knitPasses(time);
+    break;
+
+  case AYAB_API::reqLine: {
+    if (size < 2U) {
+      return;
+    }
+    // the line number is sent modulo 256
+    auto delta = static_cast<int8_t>(msg[1] - static_cast<uint8_t>(m_rowsSent));
+    int row = m_rowsSent + delta;
+    ++m_lineRequests;
+    if (delta < 0) {
+      ++m_lineRepeats;
+    }
+    if ((size > 2U) && (msg[2] != 0U)) {
+      ++m_lineNacks;
+    }
+    if ((row < 0) || (row >= m_config.rows)) {
+      printf("reqLine for row %d out of range\n", row);
+      m_failed = true;
+      return;
+    }
+    sendLine(time, row);
+    break;
+  }
+
+  case AYAB_API::cnfStats:
+    if (size >= CNFSTATS_LEN) {
+      memcpy(m_stats, msg, CNFSTATS_LEN);
+    }
+    m_gotStats = true;
+    break;
+
+  default:
+    break;
+  }
+}
+
+/*!
+ * \brief Send a pattern row.
+ *
+ * If compressed rows have been negotiated, the row is sent in the
+ * shortest encoding.
+ */
+void SimHost::sendLine(SimTime requested, uint16_t row) {
+  const std::vector<uint8_t> &data = m_rows[row];
+  auto lineLen = static_cast<uint8_t>(data.size());
+  uint8_t flags = (row + 1U == m_config.rows) ? 1U : 0U;
+  std::vector<uint8_t> msg = {static_cast<uint8_t>(AYAB_API::cnfLine),
+                              static_cast<uint8_t>(row), 0U, flags};
+
+  std::vector<uint8_t> best(data);
+  if (m_compressed) {
+    // the first line is encoded against a blank line
+    std::vector<uint8_t> prevRow =
+        (row > 0U) ? m_rows[row - 1U] : std::vector<uint8_t>(lineLen, 0U);
+    uint8_t encoded[MAX_LINE_BUFFER_LEN];
+    for (auto encoding : {LineEncoding::rle, LineEncoding::xorDelta}) {
+      uint8_t len = LineCodec::encode(encoding, data.data(), prevRow.data(),
+                                      lineLen, encoded, best.size() - 1U);
+      if (len > 0U) {
+        best.assign(encoded, encoded + len);
+        msg[3] = static_cast<uint8_t>(
+            flags | (static_cast<uint8_t>(encoding) << LINE_ENCODING_SHIFT));
+      }
+    }
+  }
+  m_rawBytes += lineLen;
+  m_compressedBytes += best.size();
+  msg.insert(msg.end(), best.begin(), best.end());
+  ++m_linesSent;
+  bool corrupt = (m_config.corruptEvery > 0U) &&
+                 (m_linesSent % m_config.corruptEvery == 0U);
+  if (corrupt) {
+    ++m_linesCorrupted;
+  }
+  SimTime latency =
+      send(requested + m_config.latencyUs * NS_PER_US, msg, corrupt) - requested;
+  m_lineLatencyMin = std::min(m_lineLatencyMin, latency);
+  m_lineLatencyMax = std::max(m_lineLatencyMax, latency);
+  m_lineLatencySum += latency;
+  if (row + 1U > m_rowsSent) {
+    m_rowsSent = row + 1U;
+  }
+}
+
+/*!
+ * \brief Send a message with a trailing checksum.
+ * \param corrupt Flip a bit after the checksum has been calculated,
+ *   as line noise would.
+ * \return Arrival time of the message on the device.
+ */
+SimTime SimHost::send(SimTime time, std::vector<uint8_t> msg, bool corrupt) {
+  msg.push_back(crc8(msg.data(), msg.size()));
+  if (corrupt) {
+    msg[msg.size() / 2U] ^= 0x01U;
+  }
+  std::vector<uint8_t> encoded(SLIP::getEncodedBufferSize(msg.size()) + 1U);
+  size_t size = SLIP::encode(msg.data(), msg.size(), encoded.data());
+  encoded[size++] = SLIP::END;
+  return m_serial.hostWrite(time, encoded.data(), size);
+}
+
+/*!
+ * \brief CRC-8 (Dallas/Maxim), as checked by the firmware.
+ */
+uint8_t SimHost::crc8(const uint8_t *buffer, size_t len) {
+  uint8_t crc = 0x00U;
+  while (len--) {
+    uint8_t extract = *buffer++;
+    for (uint8_t i = 8U; i; i--) {
+      uint8_t sum = (crc ^ extract) & 0x01U;
+      crc >>= 1U;
+      if (sum) {
+        crc ^= 0x8CU;
+      }
+      extract >>= 1U;
+    }
+  }
+  return crc;
+}
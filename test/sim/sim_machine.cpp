@@ -0,0 +1,449 @@
+/*!
+ * \file sim_machine.cpp
+ * \brief Machine model and serial link of the host simulator.
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <algorithm>
+
+#include "sim.h"
+#include <board.h>
+
+// Hall sensor readings
+constexpr int HALL_IDLE = 400;
+constexpr int HALL_KNIT = 700;
+constexpr int HALL_LACE = 100;
+
+// where the carriage waits for the job to start, just past the left turn mark
+constexpr uint8_t PARK_PAST_TURN_MARK = GARTER_SLOP + 2U;
+// position of the carriage before it is first moved
+constexpr uint8_t HOME_POSITION = 8U;
+// turn this far beyond the end of line
+constexpr uint8_t TURN_MARGIN = 2U;
+
+// SimSerial
+
+/*!
+ * \brief Set the baud rate of the device. Each byte takes 10 bit times.
+ */
+void SimSerial::begin(uint32_t baud) {
+  m_deviceBaud = baud;
+}
+
+/*!
+ * \brief Move the bytes that have arrived into the receive buffer.
+ *
+ * Bytes that arrive while the buffer is full are lost.
+ */
+void SimSerial::receive() {
+  SimTime now = m_clock.now();
+  while (!m_toDevice.empty() && (m_toDevice.front().time <= now)) {
+    const Byte &byte = m_toDevice.front();
+    if (garbled(byte, m_deviceBaud)) {
+      ++m_framingErrors;
+    } else if (m_rxBuffer.size() < BUFFER_LEN) {
+      m_rxBuffer.push_back(byte.c);
+    } else {
+      ++m_rxOverruns;
+    }
+    m_toDevice.pop_front();
+  }
+}
+
+int SimSerial::available() {
+  receive();
+  return static_cast<int>(m_rxBuffer.size());
+}
+
+int SimSerial::read() {
+  receive();
+  if (m_rxBuffer.empty()) {
+    return -1;
+  }
+  uint8_t c = m_rxBuffer.front();
+  m_rxBuffer.pop_front();
+  return c;
+}
+
+/*!
+ * \brief Queue a byte for the host.
+ *
+ * Blocks the firmware while the transmit buffer is full.
+ */
+void SimSerial::write(uint8_t c) {
+  SimTime byteNs = 10U * NS_PER_S / m_deviceBaud;
+  SimTime now = m_clock.now();
+  SimTime start = std::max(now, m_deviceTxFree);
+  if (start - now > BUFFER_LEN * byteNs) {
+    SimTime stall = start - now - BUFFER_LEN * byteNs;
+    m_clock.stall(stall);
+    m_txStall += stall;
+  }
+  m_deviceTxFree = start + byteNs;
+  m_toHost.push_back({m_deviceTxFree, c, m_deviceBaud});
+  ++m_bytesToHost;
+}
+
+/*!
+ * \brief Free space in the transmit buffer.
+ */
+int SimSerial::availableForWrite() const {
+  SimTime byteNs = 10U * NS_PER_S / m_deviceBaud;
+  SimTime now = m_clock.now();
+  SimTime queued =
+      (m_deviceTxFree > now) ? (m_deviceTxFree - now + byteNs - 1U) / byteNs : 0U;
+  return (queued < BUFFER_LEN) ? static_cast<int>(BUFFER_LEN - queued) : 0;
+}
+
+/*!
+ * \brief Block the firmware until the transmit buffer is empty.
+ */
+void SimSerial::flush() {
+  SimTime now = m_clock.now();
+  if (m_deviceTxFree > now) {
+    m_clock.stall(m_deviceTxFree - now);
+    m_txStall += m_deviceTxFree - now;
+  }
+}
+
+/*!
+ * \brief Set the baud rate of the host.
+ */
+void SimSerial::hostBegin(uint32_t baud) {
+  m_hostBaud = baud;
+}
+
+/*!
+ * \brief Send bytes from the host, starting at a given time.
+ * \return Arrival time of the last byte.
+ */
+SimTime SimSerial::hostWrite(SimTime time, const uint8_t *buffer, size_t size) {
+  SimTime byteNs = 10U * NS_PER_S / m_hostBaud;
+  for (size_t i = 0U; i < size; i++) {
+    m_hostTxFree = std::max(time, m_hostTxFree) + byteNs;
+    m_toDevice.push_back({m_hostTxFree, buffer[i], m_hostBaud});
+    ++m_bytesToDevice;
+  }
+  return m_hostTxFree;
+}
+
+/*!
+ * \brief Arrival time of the next byte for the host.
+ */
+SimTime SimSerial::nextToHost() const {
+  return m_toHost.empty() ? SIM_NEVER : m_toHost.front().time;
+}
+
+/*!
+ * \brief Take the next byte for the host.
+ * \return The byte, or -1 if it was lost.
+ */
+int SimSerial::popToHost() {
+  Byte byte = m_toHost.front();
+  m_toHost.pop_front();
+  if (garbled(byte, m_hostBaud)) {
+    ++m_framingErrors;
+    return -1;
+  }
+  return byte.c;
+}
+
+// SimSolenoids
+
+void SimSolenoids::init() {
+  m_solenoids.init();
+  m_state = 0U;
+}
+
+void SimSolenoids::setSolenoid(uint8_t solenoid, bool state) {
+  m_solenoids.setSolenoid(solenoid, state);
+  if (solenoid < SOLENOID_BUFFER_SIZE) {
+    bitWrite(m_state, solenoid, state);
+  }
+}
+
+void SimSolenoids::setSolenoids(uint16_t state) {
+  m_solenoids.setSolenoids(state);
+  m_state = state;
+}
+
+// SimMachine
+
+SimMachine::SimMachine(const SimConfig &config, const SimSolenoids &solenoids)
+    : m_knitted(config.rows,
+                std::vector<uint8_t>(MAX_LINE_BUFFER_LEN, 0U)),
+      m_config(config), m_solenoids(solenoids),
+      m_position(HOME_POSITION) {
+}
+
+/*!
+ * \brief Move the carriage past the left turn mark, so that
+ * the firmware can find its position.
+ * \param time Time to start moving.
+ */
+void SimMachine::initPass(SimTime time) {
+  auto machine = static_cast<uint8_t>(m_config.machine);
+  m_segments.push_back(
+      {static_cast<uint8_t>(END_LEFT_PLUS_OFFSET[machine] + PARK_PAST_TURN_MARK),
+       -1, 0U});
+  startSegment(time);
+}
+
+/*!
+ * \brief Knit one row per pass, starting to the right.
+ * \param time Time at which the job has started.
+ *
+ * The carriage turns a little beyond the end of line on either side.
+ */
+void SimMachine::knitPasses(SimTime time) {
+  auto machine = static_cast<uint8_t>(m_config.machine);
+  int left = m_config.startNeedle + offset(Direction_t::Left) -
+             END_OF_LINE_OFFSET_L[machine] - TURN_MARGIN;
+  int right = m_config.stopNeedle + offset(Direction_t::Right) +
+              END_OF_LINE_OFFSET_R[machine] + TURN_MARGIN;
+  auto leftTurn = static_cast<uint8_t>(std::max(left, 0));
+  auto rightTurn = static_cast<uint8_t>(std::min<int>(right, END_RIGHT[machine]));
+
+  for (uint16_t row = 0U; row < m_config.rows; row++) {
+    SimTime pause = (row == 0U) ? m_config.startDelayUs : m_config.turnUs;
+    m_segments.push_back({(row & 1U) ? leftTurn : rightTurn,
+                          static_cast<int16_t>(row), pause * NS_PER_US});
+  }
+  m_knitting = true;
+  if (m_nextEdge == SIM_NEVER) {
+    startSegment(time);
+  }
+}
+
+/*!
+ * \brief Start the next movement of the carriage.
+ * \param time Time at which the carriage is ready to move.
+ */
+void SimMachine::startSegment(SimTime time) {
+  m_nextEdge = SIM_NEVER;
+  while (!m_segments.empty()) {
+    m_segment = m_segments.front();
+    m_segments.pop_front();
+    time += m_segment.pauseNs;
+    if (m_segment.target != m_position) {
+      m_direction = (m_segment.target > m_position) ? Direction_t::Right
+                                                   : Direction_t::Left;
+      m_steps = (m_direction == Direction_t::Right)
+                    ? m_segment.target - m_position
+                    : m_position - m_segment.target;
+      m_step = 0U;
+      m_quarter = 0U;
+      m_nextEdge = time;
+      return;
+    }
+  }
+  m_done = m_knitting;
+}
+
+/*!
+ * \brief Duration of the current step.
+ *
+ * The carriage speeds up linearly at the start of a pass
+ * and slows down at the end.
+ */
+SimTime SimMachine::stepTime() const {
+  uint16_t fromEnd = std::min<uint16_t>(m_step, m_steps - 1U - m_step);
+  double speed = m_config.speed;
+  if (fromEnd < m_config.ramp) {
+    speed = speed * (fromEnd + 1U) / (m_config.ramp + 1U);
+  }
+  return static_cast<SimTime>(NS_PER_S / speed);
+}
+
+/*!
+ * \brief Generate the next edge of encoder signal A or B.
+ *
+ * Each step is a full cycle of both signals, starting and ending with
+ * both low. Signal B leads A when the carriage moves to the right and
+ * lags it when it moves to the left, so the position changes on the
+ * rising edge of A to the right and on the falling edge of A to the left.
+ */
+void SimMachine::edge() {
+  // levels of A and B after each quarter of a step
+  static constexpr uint8_t QUADRATURE_RIGHT[4] = {0x01U, 0x03U, 0x02U, 0x00U};
+  static constexpr uint8_t QUADRATURE_LEFT[4] = {0x02U, 0x03U, 0x01U, 0x00U};
+  SimTime period = stepTime();
+  bool right = m_direction == Direction_t::Right;
+  uint8_t state = right ? QUADRATURE_RIGHT[m_quarter] : QUADRATURE_LEFT[m_quarter];
+  bool encA = (state & 0x02U) != 0U;
+  bool encB = (state & 0x01U) != 0U;
+  bool edgeA = encA != m_encA;
+  if (edgeA && (encA == right)) {
+    sample();
+    if (right) {
+      ++m_position;
+    } else {
+      --m_position;
+    }
+  }
+  m_encA = encA;
+  m_encB = encB;
+  m_nextEdge += (m_quarter < 3U) ? period / 4U : period - 3U * (period / 4U);
+  m_quarter = (m_quarter + 1U) & 0x03U;
+  ++m_edges;
+
+  void (*isr)() = edgeA ? m_isrA : m_isrB;
+  if (isr != nullptr) {
+    isr();
+  }
+
+  if ((m_quarter == 0U) && (++m_step == m_steps)) {
+    startSegment(m_nextEdge);
+  }
+}
+
+/*!
+ * \brief Distance from the carriage position to the needle it selects.
+ */
+uint8_t SimMachine::offset(Direction_t direction) const {
+  // the offsets are tabulated by the side that the carriage comes from
+  Direction_t side = (direction == Direction_t::Right) ? Direction_t::Left
+                                                       : Direction_t::Right;
+  return START_OFFSET[static_cast<uint8_t>(m_config.machine)]
+                     [static_cast<uint8_t>(side)]
+                     [static_cast<uint8_t>(m_config.carriage)];
+}
+
+/*!
+ * \brief Solenoid that selects a needle, from the service manuals.
+ *
+ * The KH270 has 12 solenoids, wired to outputs 3 to 14. The other
+ * machines have 16 solenoids that move by half a turn with the belt.
+ */
+uint8_t SimMachine::solenoid(Direction_t direction, uint8_t pixel) const {
+  bool right = direction == Direction_t::Right;
+  if (m_config.machine == Machine_t::Kh270) {
+    return (pixel + (right ? 4U : 10U)) % 12U + 3U;
+  }
+  bool shifted = m_config.beltShifted;
+  if ((m_config.carriage == Carriage_t::Lace) && right) {
+    // the lace carriage selects from the other side
+    shifted = !shifted;
+  }
+  return (pixel + (shifted ? 8U : 0U)) % 16U;
+}
+
+/*!
+ * \brief Record the selection of the needle that the carriage is leaving.
+ *
+ * A needle is selected when its solenoid is off.
+ */
+void SimMachine::sample() {
+  if (m_segment.row < 0) {
+    return;
+  }
+  int pixel = m_position - offset(m_direction);
+  if ((pixel < m_config.startNeedle) || (pixel > m_config.stopNeedle)) {
+    return;
+  }
+  bool selected = !bitRead(m_solenoids.m_state, solenoid(m_direction, pixel));
+  std::vector<uint8_t> &row = m_knitted[m_segment.row];
+  bitWrite(row[pixel >> 3], pixel & 0x07, selected);
+}
+
+/*!
+ * \brief Whether the carriage magnet is in front of a Hall sensor.
+ * \param sensor `Direction_t::Left` or `Direction_t::Right`.
+ */
+bool SimMachine::magnetAt(uint8_t sensor) const {
+  auto machine = static_cast<uint8_t>(m_config.machine);
+  // The field reaches the sensor half a step ahead of the carriage,
+  // so that the ADC has sampled it by the edge that counts the step.
+  uint8_t position = m_position;
+  bool right = m_direction == Direction_t::Right;
+  if (right && !m_encA) {
+    ++position;
+  } else if (!right && m_encA) {
+    --position;
+  }
+  if (sensor == static_cast<uint8_t>(Direction_t::Left)) {
+    uint8_t mark = END_LEFT_PLUS_OFFSET[machine];
+    return (position == mark) || (position == mark + 1U);
+  }
+  uint8_t mark = END_RIGHT_MINUS_OFFSET[machine];
+  return (position == mark) || (position == mark - 1U);
+}
+
+int SimMachine::digitalRead(uint8_t pin) const {
+  bool lace = m_config.carriage == Carriage_t::Lace;
+  switch (pin) {
+  case ENC_PIN_A:
+    return m_encA;
+  case ENC_PIN_B:
+    return m_encB;
+  case ENC_PIN_C:
+    // The belt phase is only read at the turn marks. It is
+    // opposite at the right turn mark, as seen from the left.
+    return (m_position < END_RIGHT_MINUS_OFFSET[static_cast<uint8_t>(m_config.machine)] - 1U)
+               ? m_config.beltShifted
+               : !m_config.beltShifted;
+  case EOL_PIN_R_L:
+    // KH910 lace signal, connected to the detect pin
+    if (m_detectOutput && !m_detectHigh) {
+      return LOW;
+    }
+    return lace && magnetAt(static_cast<uint8_t>(Direction_t::Right));
+  case EOL_PIN_R:
+    // KH910 knit signal, active low
+    return !(!lace && magnetAt(static_cast<uint8_t>(Direction_t::Right)));
+  default:
+    return LOW;
+  }
+}
+
+int SimMachine::analogRead(uint8_t pin) const {
+  uint8_t sensor;
+  switch (pin) {
+  case EOL_PIN_L:
+    sensor = static_cast<uint8_t>(Direction_t::Left);
+    break;
+  case EOL_PIN_R:
+    if (m_config.machine == Machine_t::Kh910) {
+      // digital sensor
+      return HALL_IDLE;
+    }
+    sensor = static_cast<uint8_t>(Direction_t::Right);
+    break;
+  default:
+    return 0;
+  }
+  if (!magnetAt(sensor)) {
+    return HALL_IDLE;
+  }
+  return (m_config.carriage == Carriage_t::Lace) ? HALL_LACE : HALL_KNIT;
+}
+
+void SimMachine::pinMode(uint8_t pin, uint8_t mode) {
+  if (pin == EOL_PIN_R_DETECT) {
+    m_detectOutput = mode == OUTPUT;
+  }
+}
+
+void SimMachine::digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin == EOL_PIN_R_DETECT) {
+    m_detectHigh = value != LOW;
+  }
+}
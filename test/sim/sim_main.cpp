@@ -0,0 +1,431 @@
+/*!
+ * \file sim_main.cpp
+ * \brief Run the firmware against a simulated machine and host.
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "sim.h"
+#include <board.h>
+#include <fsm.h>
+#include <knitter.h>
+
+using ::testing::_;
+using ::testing::An;
+using ::testing::Invoke;
+
+// firmware entry points and instances, defined in main.cpp
+void setup();
+void loop();
+extern Solenoids _Solenoids;
+
+// time allowed for each row and for getting ready, in seconds
+constexpr double SIM_TIME_PER_ROW = 10.0;
+constexpr double SIM_TIME_TO_START = 10.0;
+
+// one Hall sensor conversion: 13 ADC clocks at 125 kHz
+constexpr SimTime SIM_ADC_CONVERSION_NS = 104U * NS_PER_US;
+
+static const char USAGE[] =
+    "usage: ayab_sim [options]\n"
+    "  --machine kh910|kh930|kh270   machine type (kh910)\n"
+    "  --carriage knit|lace          carriage type (knit)\n"
+    "  --needles START STOP          working needles (all)\n"
+    "  --rows N                      rows to knit (8)\n"
+    "  --speed N                     carriage speed in needles/s (200)\n"
+    "  --ramp N                      needles to reach full speed (16)\n"
+    "  --belt-shift 0|1              belt phase (0)\n"
+    "  --turn-us N                   pause at each end of a row (50000)\n"
+    "  --loop-us N                   duration of a main loop iteration (40)\n"
+    "  --latency-us N                host response time (5000)\n"
+    "  --baud N                      serial rate to propose (115200)\n"
+    "  --link-baud N                 fastest rate the link passes (1000000)\n"
+    "  --compress                    send compressed rows\n"
+    "  --corrupt N                   corrupt every Nth row sent\n"
+    "  --report every|events         report the carriage position\n"
+    "  --report needles|ms N           in batches, every N needles or ms\n"
+    "  --max-actuation-us N          fail unless the device reports an\n"
+    "                                  actuation latency of at most N us\n"
+    "  --seed N                      pattern seed (1)\n"
+    "  --verbose                     print every row\n";
+
+static bool parseArgs(int argc, char *argv[], SimConfig &config) {
+  bool needles = false;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    auto value = [&](int n) -> const char * {
+      return (i + n < argc) ? argv[i + n] : "";
+    };
+    if (!strcmp(arg, "--machine")) {
+      const char *name = value(1);
+      if (!strcmp(name, "kh910")) {
+        config.machine = Machine_t::Kh910;
+      } else if (!strcmp(name, "kh930")) {
+        config.machine = Machine_t::Kh930;
+      } else if (!strcmp(name, "kh270")) {
+        config.machine = Machine_t::Kh270;
+      } else {
+        return false;
+      }
+      i++;
+    } else if (!strcmp(arg, "--carriage")) {
+      const char *name = value(1);
+      if (!strcmp(name, "knit")) {
+        config.carriage = Carriage_t::Knit;
+      } else if (!strcmp(name, "lace")) {
+        config.carriage = Carriage_t::Lace;
+      } else {
+        return false;
+      }
+      i++;
+    } else if (!strcmp(arg, "--needles")) {
+      config.startNeedle = static_cast<uint8_t>(atoi(value(1)));
+      config.stopNeedle = static_cast<uint8_t>(atoi(value(2)));
+      needles = true;
+      i += 2;
+    } else if (!strcmp(arg, "--rows")) {
+      config.rows = static_cast<uint16_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--speed")) {
+      config.speed = static_cast<uint32_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--ramp")) {
+      config.ramp = static_cast<uint16_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--belt-shift")) {
+      config.beltShifted = atoi(value(1)) != 0;
+      i++;
+    } else if (!strcmp(arg, "--turn-us")) {
+      config.turnUs = static_cast<uint32_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--loop-us")) {
+      config.loopUs = static_cast<uint32_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--latency-us")) {
+      config.latencyUs = static_cast<uint32_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--baud")) {
+      config.baud = static_cast<uint32_t>(atol(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--link-baud")) {
+      config.linkBaud = static_cast<uint32_t>(atol(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--report")) {
+      const char *name = value(1);
+      config.report = true;
+      i++;
+      if (!strcmp(name, "every")) {
+        config.reportMode = ReportMode::everyPosition;
+      } else if (!strcmp(name, "events")) {
+        config.reportMode = ReportMode::events;
+      } else if (!strcmp(name, "needles") || !strcmp(name, "ms")) {
+        config.reportMode = name[0] == 'n' ? ReportMode::needles : ReportMode::time;
+        config.reportInterval = static_cast<uint8_t>(atoi(value(1)));
+        i++;
+      } else {
+        return false;
+      }
+    } else if (!strcmp(arg, "--compress")) {
+      config.compressed = true;
+    } else if (!strcmp(arg, "--corrupt")) {
+      config.corruptEvery = static_cast<uint16_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--max-actuation-us")) {
+      config.maxActuationUs = static_cast<uint16_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--seed")) {
+      config.seed = static_cast<uint32_t>(atoi(value(1)));
+      i++;
+    } else if (!strcmp(arg, "--verbose")) {
+      config.verbose = true;
+    } else {
+      return false;
+    }
+  }
+
+  auto machine = static_cast<uint8_t>(config.machine);
+  if (!needles) {
+    config.stopNeedle = NUM_NEEDLES[machine] - 1U;
+  }
+  if ((config.machine == Machine_t::Kh270) &&
+      (config.carriage != Carriage_t::Knit)) {
+    fprintf(stderr, "the KH270 only has a knit carriage\n");
+    return false;
+  }
+  if (baudRateIndex(config.baud) == NUM_SERIAL_BAUDRATES) {
+    fprintf(stderr, "unsupported serial rate %u\n", config.baud);
+    return false;
+  }
+  return (config.rows > 0U) && (config.speed > 0U) &&
+         (config.startNeedle < config.stopNeedle) &&
+         (config.stopNeedle < NUM_NEEDLES[machine]);
+}
+
+static uint16_t get16(const uint8_t *buffer) {
+  return (buffer[0] << 8) | buffer[1];
+}
+
+static void printRange(const char *name, const uint8_t *buffer,
+                       const char *unit) {
+  printf("  %-8s min %u avg %u max %u %s\n", name, get16(buffer),
+         get16(buffer + 2), get16(buffer + 4), unit);
+}
+
+int main(int argc, char *argv[]) {
+  SimConfig config;
+  if (!parseArgs(argc, argv, config)) {
+    fputs(USAGE, stderr);
+    return 2;
+  }
+
+  // The firmware calls are uninteresting to the mocks.
+  int gmockArgc = 2;
+  char gmockName[] = "ayab_sim";
+  char gmockVerbose[] = "--gmock_verbose=error";
+  char *gmockArgv[] = {gmockName, gmockVerbose, nullptr};
+  ::testing::InitGoogleMock(&gmockArgc, gmockArgv);
+
+  SimClock clock;
+  SimSerial serial(clock, config.linkBaud);
+  SimSolenoids solenoids(_Solenoids);
+  SimMachine machine(config, solenoids);
+  SimHost host(config, serial, machine);
+  GlobalSolenoids::m_instance = &solenoids;
+
+  ArduinoMock *arduino = arduinoMockInstance();
+  ON_CALL(*arduino, millis()).WillByDefault(Invoke([&clock]() {
+    return static_cast<unsigned long>(clock.now() / NS_PER_US / 1000U);
+  }));
+  ON_CALL(*arduino, micros()).WillByDefault(Invoke([&clock]() {
+    return static_cast<unsigned long>(clock.now() / NS_PER_US);
+  }));
+  ON_CALL(*arduino, delay(_)).WillByDefault(Invoke([&clock](unsigned long ms) {
+    clock.stall(ms * 1000U * NS_PER_US);
+  }));
+  ON_CALL(*arduino, delayMicroseconds(_))
+      .WillByDefault(Invoke([&clock](unsigned int us) {
+        clock.stall(us * NS_PER_US);
+      }));
+  ON_CALL(*arduino, digitalRead(_)).WillByDefault(Invoke([&machine](int pin) {
+    return machine.digitalRead(static_cast<uint8_t>(pin));
+  }));
+  ON_CALL(*arduino, analogRead(_)).WillByDefault(Invoke([&machine](int pin) {
+    return machine.analogRead(static_cast<uint8_t>(pin));
+  }));
+  ON_CALL(*arduino, pinMode(_, _))
+      .WillByDefault(Invoke([&machine](uint8_t pin, uint8_t mode) {
+        machine.pinMode(pin, mode);
+      }));
+  ON_CALL(*arduino, digitalWrite(_, _))
+      .WillByDefault(Invoke([&machine](uint8_t pin, uint8_t value) {
+        machine.digitalWrite(pin, value);
+      }));
+  ON_CALL(*arduino, attachInterrupt(_, _, _))
+      .WillByDefault(Invoke([&machine](uint8_t interrupt, void (*isr)(), int) {
+        machine.attachInterrupt(interrupt, isr);
+      }));
+
+  SerialMock *serialMock = serialMockInstance();
+  ON_CALL(*serialMock, begin(_)).WillByDefault(Invoke([&serial](unsigned long baud) {
+    serial.begin(baud);
+  }));
+  ON_CALL(*serialMock, flush()).WillByDefault(Invoke([&serial]() {
+    serial.flush();
+  }));
+  ON_CALL(*serialMock, available()).WillByDefault(Invoke([&serial]() {
+    return serial.available();
+  }));
+  ON_CALL(*serialMock, read()).WillByDefault(Invoke([&serial]() {
+    return serial.read();
+  }));
+  ON_CALL(*serialMock, availableForWrite()).WillByDefault(Invoke([&serial]() {
+    return serial.availableForWrite();
+  }));
+  ON_CALL(*serialMock, write(An<uint8_t>()))
+      .WillByDefault(Invoke([&serial](uint8_t c) -> size_t {
+        serial.write(c);
+        return 1U;
+      }));
+  ON_CALL(*serialMock, write(_, _))
+      .WillByDefault(Invoke([&serial](const uint8_t *buffer, size_t size) {
+        for (size_t i = 0U; i < size; i++) {
+          serial.write(buffer[i]);
+        }
+        return size;
+      }));
+
+  setup();
+  host.start(clock.now());
+
+  // Each iteration of the main loop takes `loopUs`. Encoder interrupts,
+  // ADC conversions, and bytes for the host are handled in time order
+  // in the meantime. Give up if the job takes much longer than the
+  // carriage could need.
+  double limit = SIM_TIME_TO_START +
+                 config.rows * (SIM_TIME_PER_ROW + 256.0 / config.speed +
+                                config.turnUs / 1e6);
+  auto timeLimit = static_cast<SimTime>(limit * NS_PER_S);
+  bool statsRequested = false;
+  SimTime now = 0U;
+  SimTime adc = SIM_ADC_CONVERSION_NS;
+  while (!host.done() && !host.m_failed && (now < timeLimit)) {
+    loop();
+    SimTime end = clock.endOfLoop(config.loopUs * NS_PER_US);
+    while (true) {
+      SimTime edge = machine.nextEdge();
+      SimTime toHost = serial.nextToHost();
+      if ((edge > end) && (toHost > end) && (adc > end)) {
+        break;
+      }
+      if ((adc <= edge) && (adc <= toHost)) {
+        clock.set(adc);
+        GlobalEncoders::adc_interrupt();
+        adc += SIM_ADC_CONVERSION_NS;
+      } else if (edge <= toHost) {
+        clock.set(edge);
+        machine.edge();
+      } else {
+        clock.set(toHost);
+        int c = serial.popToHost();
+        if (c >= 0) {
+          host.receive(toHost, static_cast<uint8_t>(c));
+        }
+      }
+    }
+    now = end;
+    clock.set(now);
+    host.poll(now);
+    if (machine.finished() && !statsRequested) {
+      statsRequested = true;
+      host.requestStats(now);
+    }
+  }
+
+  // compare the needles selected with the pattern sent
+  uint16_t rowsCorrect = 0U;
+  for (uint16_t n = 0U; n < config.rows; n++) {
+    const std::vector<uint8_t> &sent = host.row(n);
+    const std::vector<uint8_t> &knitted = machine.m_knitted[n];
+    uint16_t wrong = 0U;
+    int firstWrong = -1;
+    for (int needle = config.startNeedle; needle <= config.stopNeedle; needle++) {
+      if (bitRead(sent[needle >> 3], needle & 0x07) !=
+          bitRead(knitted[needle >> 3], needle & 0x07)) {
+        if (firstWrong < 0) {
+          firstWrong = needle;
+        }
+        ++wrong;
+      }
+    }
+    if (wrong == 0U) {
+      ++rowsCorrect;
+    }
+    if (config.verbose || (wrong > 0U)) {
+      printf("row %3u %c ", n, (n & 1U) ? 'L' : 'R');
+      for (int needle = config.startNeedle; needle <= config.stopNeedle; needle++) {
+        putchar(bitRead(knitted[needle >> 3], needle & 0x07) ? '#' : '.');
+      }
+      if (wrong > 0U) {
+        printf(" %u wrong from needle %d", wrong, firstWrong);
+      }
+      putchar('\n');
+    }
+  }
+
+  bool finished = machine.finished() &&
+                  (GlobalFsm::getState() == OpState::init);
+  double seconds = static_cast<double>(now - host.m_jobStart) / NS_PER_S;
+  printf("%s, %s carriage, needles %u-%u, %u needles/s, belt %s\n",
+         config.machine == Machine_t::Kh910   ? "KH910"
+         : config.machine == Machine_t::Kh930 ? "KH930"
+                                              : "KH270",
+         config.carriage == Carriage_t::Lace ? "lace" : "knit",
+         config.startNeedle, config.stopNeedle, config.speed,
+         config.beltShifted ? "shifted" : "regular");
+  printf("rows      %u/%u correct, job %s\n", rowsCorrect, config.rows,
+         finished ? "finished" : "not finished");
+  printf("time      %.3f s, %.1f rows/min, %u encoder edges\n", seconds,
+         seconds > 0.0 ? 60.0 * config.rows / seconds : 0.0, machine.m_edges);
+  printf("serial    to device %u bytes, to host %u bytes, %u rx overruns, "
+         "%.1f ms tx stalls\n",
+         serial.m_bytesToDevice, serial.m_bytesToHost, serial.m_rxOverruns,
+         static_cast<double>(serial.m_txStall) / NS_PER_US / 1000.0);
+  double total = static_cast<double>(now) / NS_PER_S;
+  printf("link      %u baud (%u proposed), %u fallbacks, %u framing errors, "
+         "%.0f bytes/s to device, %.0f bytes/s to host\n",
+         serial.hostBaud(), config.baud, host.m_baudFallbacks,
+         serial.m_framingErrors, serial.m_bytesToDevice / total,
+         serial.m_bytesToHost / total);
+  printf("lines     %u requests, %u repeated, %u of %u pattern bytes sent\n",
+         host.m_lineRequests, host.m_lineRepeats, host.m_compressedBytes,
+         host.m_rawBytes);
+  if (config.corruptEvery > 0U) {
+    printf("  %u rows corrupted, %u rejected\n", host.m_linesCorrupted,
+           host.m_lineNacks);
+  }
+  if (config.report) {
+    printf("reports   %u messages, %u of %u positions\n", host.m_reports,
+           host.m_positionsReported, host.m_positionsPassed);
+  }
+  if (host.m_lineRequests > 0U) {
+    printf("  latency  min %.2f avg %.2f max %.2f ms from request to row\n",
+           static_cast<double>(host.m_lineLatencyMin) / NS_PER_S * 1000.0,
+           static_cast<double>(host.m_lineLatencySum) / host.m_lineRequests /
+               NS_PER_S * 1000.0,
+           static_cast<double>(host.m_lineLatencyMax) / NS_PER_S * 1000.0);
+  }
+  if (host.done()) {
+    const uint8_t *stats = host.m_stats;
+    printf("device    %u lines\n", get16(stats + 1));
+    printRange("latency", stats + 3, "ms");
+    printRange("travel", stats + 9, "needles");
+    printRange("slack", stats + 15, "needles");
+    printf("  histogram");
+    for (uint8_t i = 0U; i < SLACK_HISTOGRAM_BINS; i++) {
+      printf(" %u", get16(stats + 21 + 2 * i));
+    }
+    printf("\n  encoder overflows %u, illegal encoder transitions %u, "
+           "actuation latency max %u us\n",
+           stats[37], stats[44], get16(stats + 38));
+    printf("  %u messages dropped from the transmit queue, %u lines requested again\n",
+           get16(stats + 40), get16(stats + 42));
+  }
+
+  // The latency is only measured when the firmware times the encoder
+  // edges, as it does with a lead time.
+  bool latencyOk = true;
+  if (config.maxActuationUs > 0U) {
+    uint16_t latency = host.done() ? get16(host.m_stats + 38) : 0U;
+    latencyOk = (latency > 0U) && (latency <= config.maxActuationUs);
+    if (!latencyOk) {
+      printf("actuation latency %u us, expected 1 to %u us\n", latency,
+             config.maxActuationUs);
+    }
+  }
+
+  releaseSerialMock();
+  releaseArduinoMock();
+  return (finished && (rowsCorrect == config.rows) && !host.m_failed &&
+          latencyOk) ? 0 : 1;
+}
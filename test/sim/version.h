@@ -0,0 +1,11 @@
+/*!
+ * \file version.h
+ * \brief Firmware version reported by the host simulator.
+ *
+ * On the device this file is generated by `scripts/preBuild.py`.
+ */
+
+constexpr uint8_t FW_VERSION_MAJ = 0U;
+constexpr uint8_t FW_VERSION_MIN = 0U;
+constexpr uint8_t FW_VERSION_PATCH = 0U;
+constexpr char  FW_VERSION_SUFFIX[] = "sim";
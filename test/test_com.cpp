@@ -21,19 +21,28 @@
  *    http://ayab-knitting.com
  */
 
+#include <algorithm>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include <beeper.h>
 #include <com.h>
 #include <encoders.h>
+#include <line_codec.h>
 
 #include <fsm_mock.h>
 #include <knitter_mock.h>
 
 using ::testing::_;
+using ::testing::An;
 using ::testing::AtLeast;
+using ::testing::DoAll;
 using ::testing::Mock;
+using ::testing::Invoke;
 using ::testing::Return;
+using ::testing::SaveArg;
+using ::testing::SetArgReferee;
 
 extern Com *com;
 extern Beeper *beeper;
@@ -60,6 +69,7 @@ protected:
     beeper->init(true);
     expect_init();
     com->init();
+    expect_state(OpState::wait_for_machine);
   }
 
   void TearDown() override {
@@ -93,11 +103,69 @@ protected:
     com->onPacketReceived(buffer, size);
   }
 
+  // messages are only accepted in the states listed in `API_MESSAGES`
+  void expect_state(OpState_t state) {
+    EXPECT_CALL(*fsmMock, getState).WillRepeatedly(Return(state));
+  }
+
+  // tester commands are only accepted during the hardware test
+  void expect_test_state() {
+    expect_state(OpState::test);
+  }
+
   void reqInit(Machine_t machine) {
     uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqInit), static_cast<uint8_t>(machine)};
     EXPECT_CALL(*fsmMock, setState(OpState::init));
     expected_write_onPacketReceived(buffer, sizeof(buffer), true);
   }
+
+  // Dallas/Maxim CRC-8, as used by the API
+  uint8_t crc8(const uint8_t *buffer, size_t len) {
+    uint8_t crc = 0x00U;
+    while (len--) {
+      uint8_t extract = *buffer++;
+      for (uint8_t i = 8U; i; i--) {
+        uint8_t sum = (crc ^ extract) & 0x01U;
+        crc >>= 1U;
+        if (sum) {
+          crc ^= 0x8CU;
+        }
+        extract >>= 1U;
+      }
+    }
+    return crc;
+  }
+
+  // feed a message to the serial port, SLIP encoded
+  void receive(const uint8_t *msg, size_t size) {
+    std::vector<uint8_t> bytes(SLIP::getEncodedBufferSize(size) + 1U);
+    size_t len = SLIP::encode(msg, size, bytes.data());
+    bytes[len++] = SLIP::END;
+    size_t pos = 0U;
+    EXPECT_CALL(*serialMock, available).WillRepeatedly(Invoke([&]() {
+      return static_cast<int>(len - pos);
+    }));
+    EXPECT_CALL(*serialMock, read).WillRepeatedly(Invoke([&]() {
+      return static_cast<int>(bytes[pos++]);
+    }));
+    com->update();
+    ASSERT_EQ(pos, len);
+    ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+  }
+
+  // build a `cnfLine` message with a compressed row
+  size_t cnfLineCompressed(uint8_t *buffer, uint8_t lineNumber, uint8_t flags,
+                           LineEncoding_t encoding, const uint8_t *row,
+                           const uint8_t *prevRow) {
+    buffer[0] = static_cast<uint8_t>(AYAB_API::cnfLine);
+    buffer[1] = lineNumber;
+    buffer[2] = 0;
+    buffer[3] = flags | (static_cast<uint8_t>(encoding) << LINE_ENCODING_SHIFT);
+    uint8_t len = LineCodec::encode(encoding, row, prevRow, 25U, buffer + 4,
+                                    MAX_MSG_BUFFER_LEN - 5U);
+    buffer[len + 4] = crc8(buffer, len + 4);
+    return len + 5U;
+  }
 };
 
 /*
@@ -130,6 +198,81 @@ TEST_F(ComTest, test_reqInit_checksum_error) {
   ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
 }
 
+TEST_F(ComTest, test_reqInit_baudrate) {
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqInit), static_cast<uint8_t>(Machine_t::Kh910), 3, 0};
+  buffer[3] = crc8(buffer, 3);
+  EXPECT_CALL(*knitterMock, initMachine(Machine_t::Kh910)).WillOnce(Return(ErrorCode::success));
+  // `cnfInit` is sent at the old rate before switching
+  EXPECT_CALL(*serialMock, flush);
+  EXPECT_CALL(*serialMock, begin(1000000U));
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(100U));
+  com->onPacketReceived(buffer, sizeof(buffer));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // not yet confirmed
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(100U + SERIAL_FALLBACK_MS - 1U));
+  EXPECT_CALL(*serialMock, begin).Times(0);
+  com->update();
+
+  // a message with a valid checksum confirms the new rate
+  uint8_t confirm[] = {static_cast<uint8_t>(AYAB_API::reqInfo), 0};
+  confirm[1] = crc8(confirm, 1);
+  com->onPacketReceived(confirm, sizeof(confirm));
+  EXPECT_CALL(*arduinoMock, millis).Times(0);
+  com->update();
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
+TEST_F(ComTest, test_reqInit_baudrate_fallback) {
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqInit), static_cast<uint8_t>(Machine_t::Kh910), 1, 0};
+  buffer[3] = crc8(buffer, 3);
+  EXPECT_CALL(*knitterMock, initMachine(Machine_t::Kh910)).WillOnce(Return(ErrorCode::success));
+  EXPECT_CALL(*serialMock, begin(250000U));
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(100U));
+  com->onPacketReceived(buffer, sizeof(buffer));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // a message without a valid checksum does not confirm the new rate
+  uint8_t garbled[] = {static_cast<uint8_t>(AYAB_API::reqInfo), 0x55};
+  com->onPacketReceived(garbled, sizeof(garbled));
+
+  // no reply from the host at the new rate
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(100U + SERIAL_FALLBACK_MS));
+  EXPECT_CALL(*serialMock, begin(SERIAL_BAUDRATE));
+  com->update();
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // only once
+  EXPECT_CALL(*serialMock, begin).Times(0);
+  com->update();
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
+TEST_F(ComTest, test_reqInit_baudrate_rejected) {
+  // unknown rate
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqInit), static_cast<uint8_t>(Machine_t::Kh910), NUM_SERIAL_BAUDRATES, 0};
+  buffer[3] = crc8(buffer, 3);
+  EXPECT_CALL(*knitterMock, initMachine(Machine_t::Kh910)).WillOnce(Return(ErrorCode::success));
+  EXPECT_CALL(*serialMock, begin).Times(0);
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // the machine could not be initialized
+  buffer[2] = 2;
+  buffer[3] = crc8(buffer, 3);
+  EXPECT_CALL(*knitterMock, initMachine(Machine_t::Kh910)).WillOnce(Return(ErrorCode::machine_type_invalid));
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
 TEST_F(ComTest, test_reqtest) {
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqTest)};
   EXPECT_CALL(*fsmMock, setState(OpState::test));
@@ -165,6 +308,7 @@ TEST_F(ComTest, test_reqstart_fail2) {
 TEST_F(ComTest, test_reqstart_success_KH910) {
   reqInit(Machine_t::Kh910);
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqStart), 0, 10, 1, 0x36};
+  expect_state(OpState::ready);
   EXPECT_CALL(*knitterMock, startKnitting);
   expected_write_onPacketReceived(buffer, sizeof(buffer), false);
 
@@ -172,9 +316,40 @@ TEST_F(ComTest, test_reqstart_success_KH910) {
   ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
 }
 
+TEST_F(ComTest, test_reqstart_report_policy) {
+  // without a policy every position is reported
+  expect_state(OpState::ready);
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqStart), 0, 10, 1, 0, 0, 0};
+  buffer[4] = crc8(buffer, 4);
+  EXPECT_CALL(*knitterMock, setReportPolicy(ReportMode::everyPosition, 0));
+  EXPECT_CALL(*knitterMock, startKnitting);
+  com->onPacketReceived(buffer, 5);
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+
+  // every 4 needles
+  buffer[4] = static_cast<uint8_t>(ReportMode::needles);
+  buffer[5] = 4;
+  buffer[6] = crc8(buffer, 6);
+  EXPECT_CALL(*knitterMock, setReportPolicy(ReportMode::needles, 4));
+  EXPECT_CALL(*knitterMock, startKnitting);
+  com->onPacketReceived(buffer, sizeof(buffer));
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+
+  // unknown policy
+  buffer[4] = static_cast<uint8_t>(ReportMode::events) + 1U;
+  buffer[6] = crc8(buffer, 6);
+  EXPECT_CALL(*knitterMock, setReportPolicy).Times(0);
+  EXPECT_CALL(*knitterMock, startKnitting).Times(0);
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
 TEST_F(ComTest, test_reqstart_success_KH270) {
   reqInit(Machine_t::Kh270);
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqStart), 0, 10, 1, 0x36};
+  expect_state(OpState::ready);
   EXPECT_CALL(*knitterMock, startKnitting);
   expected_write_onPacketReceived(buffer, sizeof(buffer), false);
 
@@ -188,16 +363,19 @@ TEST_F(ComTest, test_reqinfo) {
 }
 
 TEST_F(ComTest, test_helpCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::helpCmd)};
   expected_write_onPacketReceived(buffer, sizeof(buffer), false);
 }
 
 TEST_F(ComTest, test_sendCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::sendCmd)};
   expected_write_onPacketReceived(buffer, sizeof(buffer), false);
 }
 
 TEST_F(ComTest, test_beepCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::beepCmd)};
   expected_write_onPacketReceived(buffer, sizeof(buffer), true);
   EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(0U));
@@ -208,23 +386,27 @@ TEST_F(ComTest, test_beepCmd) {
 }
 
 TEST_F(ComTest, test_setSingleCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::setSingleCmd), 0, 0};
   expected_write_onPacketReceived(buffer, sizeof(buffer), true);
 }
 
 TEST_F(ComTest, test_setAllCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::setAllCmd), 0, 0};
   expected_write_onPacketReceived(buffer, sizeof(buffer), true);
 }
 
 TEST_F(ComTest, test_readEOLsensorsCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::readEOLsensorsCmd)};
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L));
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R));
+  // the Hall sensors are read from the encoders' samples
+  EXPECT_CALL(*arduinoMock, analogRead).Times(0);
   expected_write_onPacketReceived(buffer, sizeof(buffer), false);
 }
 
 TEST_F(ComTest, test_readEncodersCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::readEncodersCmd)};
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A));
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B));
@@ -233,21 +415,25 @@ TEST_F(ComTest, test_readEncodersCmd) {
 }
 
 TEST_F(ComTest, test_autoReadCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::autoReadCmd)};
   expected_write_onPacketReceived(buffer, sizeof(buffer), true);
 }
 
 TEST_F(ComTest, test_autoTestCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::autoTestCmd)};
   expected_write_onPacketReceived(buffer, sizeof(buffer), true);
 }
 
 TEST_F(ComTest, test_stopCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::stopCmd)};
   com->onPacketReceived(buffer, sizeof(buffer));
 }
 
 TEST_F(ComTest, test_quitCmd) {
+  expect_test_state();
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::quitCmd)};
   EXPECT_CALL(*fsmMock, setState(OpState::wait_for_machine));
   com->onPacketReceived(buffer, sizeof(buffer));
@@ -261,6 +447,188 @@ TEST_F(ComTest, test_unrecognized) {
   com->onPacketReceived(buffer, sizeof(buffer));
 }
 
+TEST_F(ComTest, test_api_messages) {
+  // every message is in the slot of its message ID, and has a counter
+  // of its own
+  bool counted[API_COUNTERS] = {false};
+  for (uint8_t slot = 0U; slot < API_SLOTS; slot++) {
+    const Com::ApiMessage &msg = Com::API_MESSAGES[slot];
+    if (msg.handler != nullptr) {
+      ASSERT_EQ(apiSlot(msg.id), slot);
+      ASSERT_GE(msg.minLength, msg.crc ? 2U : 1U);
+      ASSERT_NE(msg.states, 0U);
+      ASSERT_LT(msg.counter, API_COUNTERS);
+      ASSERT_FALSE(counted[msg.counter]);
+      counted[msg.counter] = true;
+    }
+  }
+  for (uint8_t i = 0U; i < API_COUNTERS; i++) {
+    ASSERT_TRUE(counted[i]);
+  }
+}
+
+TEST_F(ComTest, test_dispatch) {
+  // a message ID that shares a slot with a known message
+  uint8_t other[] = {static_cast<uint8_t>(AYAB_API::cnfStart)};
+  com->onPacketReceived(other, sizeof(other));
+  ASSERT_EQ(com->m_rxUnrecognized, 1U);
+
+  // tester commands outside of the hardware test are answered
+  // with `cnfTest` and `wrong_machine_state`
+  std::vector<uint8_t> written;
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(64));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>()))
+      .WillRepeatedly(Invoke([&written](uint8_t c) -> size_t {
+        written.push_back(c);
+        return 1U;
+      }));
+  uint8_t quit[] = {static_cast<uint8_t>(AYAB_API::quitCmd)};
+  EXPECT_CALL(*fsmMock, getState).WillOnce(Return(OpState::ready));
+  EXPECT_CALL(*fsmMock, setState).Times(0);
+  com->onPacketReceived(quit, sizeof(quit));
+  ASSERT_EQ(com->m_rxRejected, 1U);
+  ASSERT_EQ(com->m_rxCount[Com::API_MESSAGES[apiSlot(quit[0])].counter], 1U);
+  ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
+  uint8_t expected[] = {SLIP::END, static_cast<uint8_t>(AYAB_API::cnfTest),
+                        static_cast<uint8_t>(ErrorCode::wrong_machine_state),
+                        SLIP::END};
+  ASSERT_EQ(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+
+  // so are other messages, with their own reply
+  written.clear();
+  uint8_t motif[] = {static_cast<uint8_t>(AYAB_API::reqMotif), 3, 2, 1, 2, 0, 0x05, 0x02, 0};
+  motif[8] = crc8(motif, 8);
+  EXPECT_CALL(*fsmMock, getState).WillOnce(Return(OpState::knit));
+  EXPECT_CALL(*knitterMock, setMotif).Times(0);
+  com->onPacketReceived(motif, sizeof(motif));
+  ASSERT_EQ(com->m_rxRejected, 2U);
+  ASSERT_EQ(com->m_rxCount[Com::API_MESSAGES[apiSlot(motif[0])].counter], 1U);
+  ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
+  expected[1] = static_cast<uint8_t>(AYAB_API::cnfMotif);
+  ASSERT_EQ(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+
+  // the state is not needed for messages accepted in any state
+  uint8_t info[] = {static_cast<uint8_t>(AYAB_API::reqInfo)};
+  EXPECT_CALL(*fsmMock, getState).Times(0);
+  com->onPacketReceived(info, sizeof(info));
+  ASSERT_EQ(com->m_rxRejected, 2U);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_reqCounters) {
+  std::vector<uint8_t> written;
+  uint8_t info[] = {static_cast<uint8_t>(AYAB_API::reqInfo)};
+  uint8_t other[] = {0xFF};
+  uint8_t init[] = {static_cast<uint8_t>(AYAB_API::reqInit)};
+  com->onPacketReceived(info, sizeof(info));
+  com->onPacketReceived(info, sizeof(info));
+  com->onPacketReceived(other, sizeof(other));
+  com->onPacketReceived(init, sizeof(init));
+
+  EXPECT_CALL(*serialMock, available).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(64));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>()))
+      .WillRepeatedly(Invoke([&written](uint8_t c) -> size_t {
+        written.push_back(c);
+        return 1U;
+      }));
+  com->update();
+  written.clear();
+
+  // counters are cleared after sending
+  uint8_t req[] = {static_cast<uint8_t>(AYAB_API::reqCounters), 1};
+  com->onPacketReceived(req, sizeof(req));
+  com->update();
+  uint8_t expected[] = {SLIP::END,
+                        static_cast<uint8_t>(AYAB_API::cnfCounters),
+                        0, 1, // unrecognized
+                        0, 1, // rejected
+                        static_cast<uint8_t>(AYAB_API::reqInfo), 2,
+                        static_cast<uint8_t>(AYAB_API::reqInit), 1,
+                        static_cast<uint8_t>(AYAB_API::reqCounters), 1,
+                        SLIP::END};
+  ASSERT_EQ(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+  ASSERT_EQ(com->m_rxCount[Com::API_MESSAGES[apiSlot(req[0])].counter], 0U);
+  ASSERT_EQ(com->m_rxRejected, 0U);
+  ASSERT_EQ(com->m_rxUnrecognized, 0U);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
+TEST_F(ComTest, test_reqEdges) {
+  std::vector<uint8_t> written;
+  EXPECT_CALL(*serialMock, available).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(64));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>()))
+      .WillRepeatedly(Invoke([&written](uint8_t c) -> size_t {
+        written.push_back(c);
+        return 1U;
+      }));
+
+  // two edges in the log, and one lost
+  EdgeRecord first = {0x1234U, 28U, Direction_t::Right};
+  EdgeRecord second = {0x1300U, 29U, Direction_t::Right};
+  EXPECT_CALL(*knitterMock, getEdgesLost).WillOnce(Return(1U));
+  EXPECT_CALL(*knitterMock, popEdge)
+      .WillOnce(DoAll(SetArgReferee<0>(first), Return(true)))
+      .WillOnce(DoAll(SetArgReferee<0>(second), Return(true)))
+      .WillOnce(Return(false));
+  uint8_t req[] = {static_cast<uint8_t>(AYAB_API::reqEdges)};
+  com->onPacketReceived(req, sizeof(req));
+  com->update();
+  uint8_t expected[] = {SLIP::END,
+                        static_cast<uint8_t>(AYAB_API::cnfEdges),
+                        EDGE_TICKS_PER_US,
+                        1, // lost
+                        2, // edges
+                        0, // no more messages
+                        0x12, 0x34, 28, static_cast<uint8_t>(Direction_t::Right),
+                        0x13, 0x00, 29, static_cast<uint8_t>(Direction_t::Right),
+                        SLIP::END};
+  ASSERT_EQ(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+
+  // a full log is sent in messages that each fit in the transmit queue
+  written.clear();
+  EXPECT_CALL(*knitterMock, getEdgesLost).WillOnce(Return(0U));
+  EXPECT_CALL(*knitterMock, popEdge)
+      .Times(EDGE_LOG_LEN)
+      .WillRepeatedly(DoAll(SetArgReferee<0>(first), Return(true)));
+  com->onPacketReceived(req, sizeof(req));
+  com->update();
+  uint8_t edges = 0U;
+  size_t start = 0U;
+  bool more = true;
+  while (more) {
+    ASSERT_LT(start + 1U + CNFEDGES_HEADER_LEN, written.size());
+    const uint8_t *message = &written[start];
+    ASSERT_EQ(message[1], static_cast<uint8_t>(AYAB_API::cnfEdges));
+    ASSERT_LE(message[4], CNFEDGES_BATCH_LEN);
+    size_t length = 2U + CNFEDGES_HEADER_LEN + CNFEDGES_EDGE_LEN * message[4];
+    ASSERT_LT(length, static_cast<size_t>(TX_QUEUE_LEN));
+    ASSERT_EQ(message[length - 1U], static_cast<uint8_t>(SLIP::END));
+    edges += message[4];
+    more = message[5] == 1U;
+    ASSERT_TRUE(more == (edges < EDGE_LOG_LEN));
+    start += length;
+  }
+  ASSERT_EQ(start, written.size());
+  ASSERT_EQ(edges, EDGE_LOG_LEN);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
 TEST_F(ComTest, test_empty_message_is_ignored) {
   uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqInfo)};
   EXPECT_CALL(*serialMock, write(_, _)).Times(0);
@@ -270,7 +638,7 @@ TEST_F(ComTest, test_empty_message_is_ignored) {
 
 TEST_F(ComTest, test_cnfline_kh910) {
   // dummy pattern
-  uint8_t pattern[] = {1};
+  uint8_t *pattern[NUM_LINE_BUFFERS] = {nullptr};
 
   // message for machine with 200 needles
   uint8_t buffer[30] = {static_cast<uint8_t>(AYAB_API::cnfLine) /* 0x42 */,
@@ -307,6 +675,7 @@ TEST_F(ComTest, test_cnfline_kh910) {
   // start KH910 job
   knitterMock->initMachine(Machine_t::Kh910);
   knitterMock->startKnitting(0, 199, pattern, false);
+  expect_state(OpState::knit);
 
   // first call increments line number to zero, not accepted
   EXPECT_CALL(*knitterMock, setNextLine).WillOnce(Return(false));
@@ -334,6 +703,251 @@ TEST_F(ComTest, test_cnfline_kh910) {
   EXPECT_CALL(*knitterMock, setNextLine).Times(0);
   com->onPacketReceived(buffer, sizeof(buffer) - 1);
 
+  // not knitting
+  expect_state(OpState::ready);
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::wrong_machine_state));
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_reqMotif) {
+  // 3 x 2 motif, 258 rows, both motif rows in one message
+  expect_state(OpState::ready);
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqMotif), 3, 2, 1, 2, 0, 0x05, 0x02, 0};
+  buffer[8] = crc8(buffer, 8);
+  EXPECT_CALL(*knitterMock, setMotif(3, 2, 258, 0, buffer + 6, 2))
+      .WillOnce(Return(ErrorCode::success));
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // checksum wrong
+  buffer[8]++;
+  EXPECT_CALL(*knitterMock, setMotif).Times(0);
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // not enough bytes
+  EXPECT_CALL(*knitterMock, setMotif).Times(0);
+  com->onPacketReceived(buffer, 7);
+
+  // not while knitting
+  buffer[8]--;
+  expect_state(OpState::knit);
+  EXPECT_CALL(*knitterMock, setMotif).Times(0);
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_reqStats) {
+  KnitterStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.lines = 2;
+  stats.latency = {2, 25, 27};
+  stats.slackHistogram[0] = 1;
+
+  com->m_txDropped = 3U;
+
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::reqStats), 1};
+  EXPECT_CALL(*knitterMock, getStats(_, false)).WillOnce(SetArgReferee<0>(stats));
+  com->onPacketReceived(buffer, 1);
+  ASSERT_EQ(com->m_txDropped, 3U);
+
+  // reset after reading
+  EXPECT_CALL(*knitterMock, getStats(_, true)).WillOnce(SetArgReferee<0>(stats));
+  com->onPacketReceived(buffer, sizeof(buffer));
+  ASSERT_EQ(com->m_txDropped, 0U);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_cnfline_compressed) {
+  uint8_t *const *pattern = nullptr;
+  uint8_t buffer[MAX_MSG_BUFFER_LEN];
+
+  // start KH910 job, requesting compressed lines
+  uint8_t req[] = {static_cast<uint8_t>(AYAB_API::reqStart), 0, 199, 4, 0};
+  req[4] = crc8(req, 4);
+  expect_state(OpState::ready);
+  EXPECT_CALL(*knitterMock, startKnitting)
+      .WillOnce(DoAll(SaveArg<2>(&pattern), Return(ErrorCode::success)));
+  com->onPacketReceived(req, sizeof(req));
+  ASSERT_TRUE(pattern != nullptr);
+  expect_state(OpState::knit);
+
+  uint8_t row0[25] = {0xDE, 0xAD, 0xBE, 0xEF};
+  uint8_t row1[25] = {0xDE, 0xAD, 0xBE, 0xEF};
+  row1[20] = 0x18;
+
+  // run-length coded first line
+  size_t size = cnfLineCompressed(buffer, 0, 0, LineEncoding::rle, row0,
+                                  nullptr);
+  ASSERT_LT(size, 25U + 5U);
+  EXPECT_CALL(*knitterMock, setNextLine(0)).WillOnce(Return(true));
+  EXPECT_CALL(*knitterMock, setLastLine).Times(0);
+  com->onPacketReceived(buffer, size);
+  const uint8_t *line = pattern[lineBufferSlot(0)];
+  for (uint8_t i = 0U; i < 25U; i++) {
+    ASSERT_EQ(line[i], static_cast<uint8_t>(~row0[i]));
+  }
+
+  // XOR delta against the first line, last line
+  size = cnfLineCompressed(buffer, 1, 1, LineEncoding::xorDelta, row1, row0);
+  ASSERT_EQ(size, 11U);
+  EXPECT_CALL(*knitterMock, setNextLine(1)).WillOnce(Return(true));
+  EXPECT_CALL(*knitterMock, setLastLine).Times(1);
+  com->onPacketReceived(buffer, size);
+  line = pattern[lineBufferSlot(1)];
+  for (uint8_t i = 0U; i < 25U; i++) {
+    ASSERT_EQ(line[i], static_cast<uint8_t>(~row1[i]));
+  }
+
+  // checksum wrong
+  buffer[size - 1]++;
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  com->onPacketReceived(buffer, size);
+
+  // decodes to the wrong length: the line is requested again
+  buffer[4] = 0xE9; // repeat 24 times
+  buffer[6] = crc8(buffer, 6);
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::needle_value_invalid));
+  com->onPacketReceived(buffer, 7);
+
+  // unknown encoding: the line is requested again
+  size = cnfLineCompressed(buffer, 1, 6, LineEncoding::rle, row0, nullptr);
+  uint16_t rejected = com->m_rxRejected;
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::argument_invalid));
+  com->onPacketReceived(buffer, size);
+  ASSERT_EQ(com->m_rxRejected, rejected + 1U);
+
+  // compressed lines not requested: encoding bits are ignored
+  req[3] = 0;
+  req[4] = crc8(req, 4);
+  expect_state(OpState::ready);
+  EXPECT_CALL(*knitterMock, startKnitting).WillOnce(Return(ErrorCode::success));
+  com->onPacketReceived(req, sizeof(req));
+  expect_state(OpState::knit);
+  size = cnfLineCompressed(buffer, 0, 0, LineEncoding::rle, row0, nullptr);
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::expected_longer_message));
+  com->onPacketReceived(buffer, size);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_cnfline_nack) {
+  EXPECT_CALL(*knitterMock, getMachineType).WillRepeatedly(Return(Machine_t::Kh910));
+  expect_state(OpState::knit);
+  uint8_t buffer[30] = {static_cast<uint8_t>(AYAB_API::cnfLine), 0, 0, 0, 0xDE};
+  buffer[29] = crc8(buffer, 29);
+
+  // the line is requested again at once
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::expected_longer_message)).Times(2);
+  com->onPacketReceived(buffer, 4);
+  com->onPacketReceived(buffer, 29);
+
+  buffer[4] = 0xAD;
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::checksum_error));
+  com->onPacketReceived(buffer, sizeof(buffer));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_cnfline_streamed) {
+  uint8_t *const *pattern = nullptr;
+  EXPECT_CALL(*knitterMock, getMachineType).WillRepeatedly(Return(Machine_t::Kh910));
+
+  // other messages are decoded into the receive buffer
+  uint8_t req[] = {static_cast<uint8_t>(AYAB_API::reqStart), 0, 199, 0, 0};
+  req[4] = crc8(req, 4);
+  expect_state(OpState::ready);
+  EXPECT_CALL(*knitterMock, startKnitting)
+      .WillOnce(DoAll(SaveArg<2>(&pattern), Return(ErrorCode::success)));
+  receive(req, sizeof(req));
+  ASSERT_TRUE(pattern != nullptr);
+  expect_state(OpState::knit);
+
+  // uncompressed row with bytes that have to be escaped
+  uint8_t buffer[30] = {static_cast<uint8_t>(AYAB_API::cnfLine), 0, 0, 0,
+                        SLIP::END, SLIP::ESC, 0x12, 0x34};
+  buffer[29] = crc8(buffer, 29);
+  EXPECT_CALL(*knitterMock, setNextLine(0)).WillOnce(Return(true));
+  receive(buffer, sizeof(buffer));
+  const uint8_t *line = pattern[lineBufferSlot(0)];
+  for (uint8_t i = 0U; i < 25U; i++) {
+    ASSERT_EQ(line[i], static_cast<uint8_t>(~buffer[i + 4]));
+  }
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+
+  // A corrupted row does not change any line buffer.
+  uint8_t before[NUM_LINE_BUFFERS][MAX_LINE_BUFFER_LEN];
+  for (uint8_t i = 0U; i < NUM_LINE_BUFFERS; i++) {
+    memcpy(before[i], pattern[i], MAX_LINE_BUFFER_LEN);
+  }
+  buffer[1] = 1;
+  buffer[6] = 0x56;
+  buffer[29] = crc8(buffer, 29) ^ 1U;
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::checksum_error));
+  receive(buffer, sizeof(buffer));
+
+  // nor does a row that is cut short
+  buffer[29] = crc8(buffer, 28);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::expected_longer_message));
+  receive(buffer, 29);
+
+  // nor a row that is not accepted
+  buffer[29] = crc8(buffer, 29);
+  const uint8_t *slot = pattern[lineBufferSlot(1)];
+  EXPECT_CALL(*knitterMock, setNextLine(1)).WillOnce(Return(false));
+  receive(buffer, sizeof(buffer));
+  ASSERT_EQ(pattern[lineBufferSlot(1)], slot);
+  for (uint8_t i = 0U; i < NUM_LINE_BUFFERS; i++) {
+    ASSERT_EQ(memcmp(before[i], pattern[i], MAX_LINE_BUFFER_LEN), 0);
+  }
+
+  // nor a row sent when not knitting
+  expect_state(OpState::ready);
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::wrong_machine_state));
+  receive(buffer, sizeof(buffer));
+  for (uint8_t i = 0U; i < NUM_LINE_BUFFERS; i++) {
+    ASSERT_EQ(memcmp(before[i], pattern[i], MAX_LINE_BUFFER_LEN), 0);
+  }
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}
+
+TEST_F(ComTest, test_rx_overflow) {
+  EXPECT_CALL(*knitterMock, getMachineType).WillRepeatedly(Return(Machine_t::Kh910));
+  uint8_t req[] = {static_cast<uint8_t>(AYAB_API::reqStart), 0, 199, 4, 0};
+  req[4] = crc8(req, 4);
+  expect_state(OpState::ready);
+  EXPECT_CALL(*knitterMock, startKnitting).WillOnce(Return(ErrorCode::success));
+  receive(req, sizeof(req));
+
+  // a compressed row too long for the receive buffer is requested again
+  uint8_t buffer[MAX_MSG_BUFFER_LEN + 6U] = {
+      static_cast<uint8_t>(AYAB_API::cnfLine), 0, 0,
+      static_cast<uint8_t>(static_cast<uint8_t>(LineEncoding::rle) << LINE_ENCODING_SHIFT)};
+  EXPECT_CALL(*knitterMock, setNextLine).Times(0);
+  EXPECT_CALL(*knitterMock, nackLine(ErrorCode::argument_invalid));
+  receive(buffer, sizeof(buffer));
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+
+  // the next message is received as usual
+  EXPECT_CALL(*knitterMock, startKnitting).WillOnce(Return(ErrorCode::success));
+  receive(req, sizeof(req));
+
   // test expectations without destroying instance
   ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
 }
@@ -384,14 +998,127 @@ TEST_F(ComTest, test_sendMsg2) {
   com->sendMsg(AYAB_API::testRes, buf);
 }
 
+TEST_F(ComTest, test_sendMsg_P) {
+  std::vector<uint8_t> written;
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(64));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>()))
+      .WillRepeatedly(Invoke([&written](uint8_t c) -> size_t {
+        written.push_back(c);
+        return 1U;
+      }));
+  com->sendMsg_P(AYAB_API::testRes, PSTR("abc"));
+  uint8_t expected[] = {SLIP::END, static_cast<uint8_t>(AYAB_API::testRes),
+                        'a', 'b', 'c', SLIP::END};
+  ASSERT_EQ(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
 TEST_F(ComTest, test_send_reqLine) {
   expect_write(true);
   com->send_reqLine(0);
 }
 
+TEST_F(ComTest, test_send_indPositions) {
+  uint8_t positions[] = {10, 11, 12};
+
+  // The serial port has no room, so messages stay in the queue.
+  // Each takes 12 bytes of it: 9 bytes, 2 end markers, and the length.
+  uint8_t queued = (TX_QUEUE_LEN - 1U) / 12U;
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>())).Times(0);
+  for (uint8_t i = 0U; i < queued; i++) {
+    ASSERT_TRUE(com->send_indPositions(Carriage_t::Knit, Direction_t::Right, 3,
+                                       positions, 3));
+  }
+  // never waits for room in the transmit queue
+  ASSERT_FALSE(com->send_indPositions(Carriage_t::Knit, Direction_t::Right, 3,
+                                      positions, 3));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // written out as the serial port has room
+  EXPECT_CALL(*serialMock, available).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(1));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>())).Times(queued * 11U);
+  com->update();
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+}
+
+TEST_F(ComTest, test_send_priority) {
+  uint8_t debug[] = {static_cast<uint8_t>(AYAB_API::debug), 'd', 'e', 'b',
+                     'u', 'g'};
+  std::vector<uint8_t> written;
+
+  // While knitting, low priority messages are dropped once their queue
+  // is full, and nothing waits for the serial port.
+  EXPECT_CALL(*fsmMock, getState).WillRepeatedly(Return(OpState::knit));
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>())).Times(0);
+  for (uint8_t i = 0U; (i < TX_QUEUE_LEN) && (com->m_txDropped == 0U); i++) {
+    com->send(debug, sizeof(debug));
+  }
+  ASSERT_EQ(com->m_txDropped, 1U);
+
+  // high priority messages have their own queue, and go first
+  com->send_reqLine(7U);
+  ASSERT_EQ(com->m_txDropped, 1U);
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  EXPECT_CALL(*serialMock, available).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(1));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>()))
+      .WillRepeatedly(Invoke([&written](uint8_t c) -> size_t {
+        written.push_back(c);
+        return 1U;
+      }));
+  com->update();
+  uint8_t expected[] = {SLIP::END,
+                        static_cast<uint8_t>(AYAB_API::reqLine),
+                        7U,
+                        0U,
+                        SLIP::END,
+                        SLIP::END,
+                        static_cast<uint8_t>(AYAB_API::debug),
+                        'd'};
+  ASSERT_GE(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // High priority messages do not wait either, once their queue is full,
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>())).Times(0);
+  for (uint8_t i = 0U; (i < TX_QUEUE_LEN) && (com->m_txDropped == 1U); i++) {
+    com->send_reqLine(8U);
+  }
+  ASSERT_EQ(com->m_txDropped, 2U);
+
+  // nor do messages too long for the queue.
+  uint8_t counters[TX_QUEUE_LEN] = {static_cast<uint8_t>(AYAB_API::cnfCounters)};
+  com->send(counters, sizeof(counters));
+  ASSERT_EQ(com->m_txDropped, 3U);
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // When not knitting, messages wait for room instead.
+  EXPECT_CALL(*fsmMock, getState).WillRepeatedly(Return(OpState::test));
+  EXPECT_CALL(*serialMock, availableForWrite).WillRepeatedly(Return(0));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>())).Times(AtLeast(1));
+  for (uint8_t i = 0U; i < TX_QUEUE_LEN; i++) {
+    com->send(debug, sizeof(debug));
+  }
+  ASSERT_EQ(com->m_txDropped, 3U);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
+}
+
 TEST_F(ComTest, test_send_indState) {
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L));
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R));
+  // the Hall sensors are read from the encoders' samples
+  EXPECT_CALL(*arduinoMock, analogRead).Times(0);
   expect_write(true);
   com->send_indState(Carriage::Knit, 0, ErrorCode::success);
 }
@@ -0,0 +1,103 @@
+/*!
+ * \file test_crc8.cpp
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <gtest/gtest.h>
+
+#include <crc8.h>
+
+// The original bit-by-bit implementation of `Com::CRC8()`
+static uint8_t crc8Bitwise(const uint8_t *buffer, size_t len) {
+  uint8_t crc = 0x00U;
+  while (len--) {
+    uint8_t extract = *buffer++;
+    for (uint8_t tempI = 8U; tempI; tempI--) {
+      uint8_t sum = (crc ^ extract) & 0x01U;
+      crc >>= 1U;
+      if (sum) {
+        crc ^= 0x8CU;
+      }
+      extract >>= 1U;
+    }
+  }
+  return crc;
+}
+
+TEST(Crc8Test, test_table) {
+  for (uint16_t i = 0U; i < 256U; i++) {
+    auto data = static_cast<uint8_t>(i);
+    ASSERT_EQ(Crc8::compute(&data, 1U), crc8Bitwise(&data, 1U)) << "byte " << i;
+  }
+}
+
+TEST(Crc8Test, test_known_values) {
+  // check value of CRC-8/MAXIM
+  const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  ASSERT_EQ(Crc8::compute(check, sizeof(check)), 0xA1U);
+  ASSERT_EQ(Crc8::compute(check, 0U), 0x00U);
+
+  // `reqStart` message from the API tests
+  const uint8_t reqStart[] = {0x01, 0x00, 0x0A, 0x00};
+  ASSERT_EQ(Crc8::compute(reqStart, sizeof(reqStart)),
+            crc8Bitwise(reqStart, sizeof(reqStart)));
+}
+
+TEST(Crc8Test, test_random_buffers) {
+  uint32_t seed = 4321U;
+  auto next = [&seed]() -> uint8_t {
+    seed = seed * 1103515245U + 12345U;
+    return static_cast<uint8_t>(seed >> 16U);
+  };
+  uint8_t buffer[64];
+  for (uint16_t n = 0U; n < 1000U; n++) {
+    size_t len = next() % sizeof(buffer);
+    for (size_t i = 0U; i < len; i++) {
+      buffer[i] = next();
+    }
+    ASSERT_EQ(Crc8::compute(buffer, len), crc8Bitwise(buffer, len));
+  }
+}
+
+TEST(Crc8Test, test_streaming) {
+  uint8_t buffer[29];
+  for (uint8_t i = 0U; i < sizeof(buffer); i++) {
+    buffer[i] = 0x42U + 7U * i;
+  }
+  uint8_t expected = crc8Bitwise(buffer, sizeof(buffer));
+
+  // a byte at a time
+  Crc8 crc;
+  for (uint8_t i = 0U; i < sizeof(buffer); i++) {
+    crc.update(buffer[i]);
+  }
+  ASSERT_EQ(crc.value(), expected);
+
+  // in pieces
+  crc.reset();
+  crc.update(buffer, 4U);
+  crc.update(buffer + 4U, sizeof(buffer) - 4U);
+  ASSERT_EQ(crc.value(), expected);
+
+  // appending the checksum gives 0
+  crc.update(expected);
+  ASSERT_EQ(crc.value(), 0x00U);
+}
@@ -44,25 +44,67 @@ protected:
     releaseArduinoMock();
   }
 
+  // Have the ADC convert both Hall sensors, after which the encoder
+  // interrupt must only read the samples.
+  void sampleHallSensors(uint16_t left, uint16_t right) {
+    EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L)).WillOnce(Return(left));
+    EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R)).WillOnce(Return(right));
+    encoders->adc_interrupt();
+    encoders->adc_interrupt();
+    ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
+    EXPECT_CALL(*arduinoMock, analogRead).Times(0);
+  }
+
+  // The encoder interrupt neither changes pin modes nor waits.
+  void expect_no_pin_setup() {
+    EXPECT_CALL(*arduinoMock, pinMode).Times(0);
+    EXPECT_CALL(*arduinoMock, digitalWrite).Times(0);
+    EXPECT_CALL(*arduinoMock, delayMicroseconds).Times(0);
+  }
+
+  // Each encoder interrupt reads both signals once.
+  void expect_encoder_read() {
+    EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
+        .WillOnce(Return(m_encA))
+        .RetiresOnSaturation();
+    EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B))
+        .WillOnce(Return(m_encB))
+        .RetiresOnSaturation();
+  }
+
+  // Change the level of encoder signal A, and service its interrupt
+  void edgeA(int level) {
+    m_encA = level;
+    expect_encoder_read();
+    encoders->encA_interrupt();
+  }
+
+  // Change the level of encoder signal B, and service its interrupt
+  void edgeB(int level) {
+    m_encB = level;
+    expect_encoder_read();
+    encoders->encB_interrupt();
+  }
+
   ArduinoMock *arduinoMock;
+
+  // Both signals start low, as `init()` reads them. Moving right,
+  // B leads A: B rises, A rises, B falls, A falls. Moving left,
+  // B lags A: A rises, B rises, A falls, B falls.
+  int m_encA = LOW;
+  int m_encB = LOW;
 };
 
 TEST_F(EncodersTest, test_encA_rising_not_in_front) {
-  // We should not enter the falling function
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R)).Times(0);
-  // Create a rising edge
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-      .WillOnce(Return(false))
-      .WillOnce(Return(true));
-  // We have not entered the rising function yet
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L)).Times(0);
-  encoders->encA_interrupt();
-  // Enter rising function, direction is right
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B)).WillOnce(Return(true));
   // Not in front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillOnce(Return(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())]));
-  encoders->encA_interrupt();
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())],
+                    MID_SENSOR_VALUE);
+  // B leads, the rising function is not entered yet
+  edgeB(HIGH);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::NoDirection);
+  ASSERT_EQ(encoders->getPosition(), 0x00);
+  // Enter rising function, direction is right
+  edgeA(HIGH);
   ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
   ASSERT_EQ(encoders->getPosition(), 0x01);
   ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
@@ -71,25 +113,15 @@ TEST_F(EncodersTest, test_encA_rising_not_in_front) {
 TEST_F(EncodersTest, test_encA_rising_in_front_notKH270) {
   encoders->init(Machine_t::Kh930);
   ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
-  // Not in front of Right Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R))
-      .WillRepeatedly(Return(MID_SENSOR_VALUE));
-  // In front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillRepeatedly(Return(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1));
+  // In front of Left Hall Sensor, not in front of Right Hall Sensor
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1,
+                    MID_SENSOR_VALUE);
   // BeltShift is shifted
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillRepeatedly(Return(HIGH));
 
-  // Create two rising edges (the initial state of A is assumed to be low)
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-    
-  // Always moving to the right: A == B
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-
-  // Process rising edge
-  encoders->encA_interrupt();
+  // Process rising edge, moving to the right
+  edgeB(HIGH);
+  edgeA(HIGH);
 
   uint8_t startPosition = END_LEFT_PLUS_OFFSET[static_cast<int8_t>(encoders->getMachineType())];
 
@@ -100,10 +132,12 @@ TEST_F(EncodersTest, test_encA_rising_in_front_notKH270) {
   ASSERT_EQ(encoders->getPosition(), startPosition);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeB(LOW);
+  edgeA(LOW);
 
   // Process rising edge
-  encoders->encA_interrupt();
+  edgeB(HIGH);
+  edgeA(HIGH);
 
   // Should have moved and not reset position
   ASSERT_EQ(encoders->getPosition(), 1 + startPosition);
@@ -112,25 +146,15 @@ TEST_F(EncodersTest, test_encA_rising_in_front_notKH270) {
 TEST_F(EncodersTest, test_encA_rising_in_front_KH270) {
   encoders->init(Machine_t::Kh270);
   ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
-  // Not in front of Right Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R))
-      .WillRepeatedly(Return(MID_SENSOR_VALUE));
-  // In front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillRepeatedly(Return(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1));
+  // In front of Left Hall Sensor, not in front of Right Hall Sensor
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1,
+                    MID_SENSOR_VALUE);
   // KH270 has no belt shift
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillRepeatedly(Return(HIGH));
 
-  // Create two rising edges (the initial state of A is assumed to be low)
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-
-  // Always moving to the right: A == B
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-
-  // Process rising edge
-  encoders->encA_interrupt();
+  // Process rising edge, moving to the right
+  edgeB(HIGH);
+  edgeA(HIGH);
 
   uint8_t startPosition = END_LEFT_PLUS_OFFSET[static_cast<int8_t>(encoders->getMachineType())];
 
@@ -140,101 +164,77 @@ TEST_F(EncodersTest, test_encA_rising_in_front_KH270) {
   ASSERT_EQ(encoders->getPosition(), startPosition);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeB(LOW);
+  edgeA(LOW);
 
   // Process rising edge
-  encoders->encA_interrupt();
+  edgeB(HIGH);
+  edgeA(HIGH);
 
   // Should have moved and not reset position
   ASSERT_EQ(encoders->getPosition(), 1 + startPosition);
 }
 
 TEST_F(EncodersTest, test_encA_rising_in_front_G_carriage) {
-  // Create a rising edge
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A)).WillOnce(Return(true));
-  // Enter rising function, direction is right
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B)).WillOnce(Return(true));
   // In front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillOnce(Return(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1));
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1,
+                    MID_SENSOR_VALUE);
   // BeltShift is regular
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillOnce(Return(true));
 
-  encoders->encA_interrupt();
+  // Create a rising edge, direction is right
+  edgeB(HIGH);
+  edgeA(HIGH);
 
   ASSERT_EQ(encoders->getCarriage(), Carriage_t::Lace);
 
-  // Create a falling edge
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A)).WillOnce(Return(false));
-  // Enter falling function, direction is right
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B)).WillOnce(Return(false));
   // Not in front of Right Hall sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R))
-      .WillOnce(Return(FILTER_R_MAX[static_cast<int8_t>(encoders->getMachineType())] - 1));
-
-  encoders->encA_interrupt();
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1,
+                    FILTER_R_MAX[static_cast<int8_t>(encoders->getMachineType())] - 1);
+  // Create a falling edge, direction is right
+  edgeB(LOW);
+  edgeA(LOW);
 
-  // Create a rising edge
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A)).WillOnce(Return(true));
-  // Enter rising function, direction is right
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B)).WillOnce(Return(true));
   // In front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillOnce(Return(FILTER_R_MAX[static_cast<int8_t>(encoders->getMachineType())] + 1));
-
-  encoders->encA_interrupt();
+  sampleHallSensors(FILTER_R_MAX[static_cast<int8_t>(encoders->getMachineType())] + 1,
+                    FILTER_R_MAX[static_cast<int8_t>(encoders->getMachineType())] - 1);
+  // Create a rising edge, direction is right
+  edgeB(HIGH);
+  edgeA(HIGH);
 
   ASSERT_EQ(encoders->getCarriage(), Carriage_t::Garter);
 }
 
 TEST_F(EncodersTest, test_encA_falling_not_in_front) {
-  // Create a falling edge
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-      .WillOnce(Return(true))
-      .WillOnce(Return(true));
-  // We have not entered the falling function yet
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R)).Times(0);
+  // Not in front of either Hall Sensor
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())],
+                    FILTER_R_MIN[static_cast<int8_t>(encoders->getMachineType())]);
+  // Create a falling edge, direction is left
+  edgeA(HIGH);
+  edgeB(HIGH);
+  edgeA(LOW);
 
-  // Enter rising function, direction is right
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B)).WillOnce(Return(true)).WillOnce(Return(false));
-  // Not in front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillOnce(Return(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())]));
-  encoders->encA_interrupt();
-  encoders->encA_interrupt();
-
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A)).WillOnce(Return(false));
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R))
-      .WillOnce(Return(FILTER_R_MIN[static_cast<int8_t>(encoders->getMachineType())]));
-
-  encoders->encA_interrupt();
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Left);
+  ASSERT_EQ(encoders->getPosition(), 0xFF);
+  ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
 }
 
 TEST_F(EncodersTest, test_encA_falling_in_front) {
   encoders->init(Machine_t::Kh930);
   ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
-  // Not in front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillRepeatedly(Return(MID_SENSOR_VALUE));
-  // In front of Right Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R))
-      .WillRepeatedly(Return(FILTER_R_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1));
+  // Not in front of Left Hall Sensor, in front of Right Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE,
+                    FILTER_R_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1);
   // BeltShift is shifted
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillRepeatedly(Return(LOW));
 
-  // Create two falling edges (the initial state of A is assumed to be low)
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-    
-  // Always moving to the left: A != B
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B))
-    .WillRepeatedly(ReturnRoundRobin({ LOW, HIGH }));
-
-  // Process rising edge
-  encoders->encA_interrupt();
+  // Process rising edge, moving to the left
+  edgeA(HIGH);
+  edgeB(HIGH);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeA(LOW);
+  edgeB(LOW);
 
   uint8_t startPosition = END_RIGHT_MINUS_OFFSET[static_cast<int8_t>(encoders->getMachineType())];
 
@@ -245,26 +245,30 @@ TEST_F(EncodersTest, test_encA_falling_in_front) {
   ASSERT_EQ(encoders->getPosition(), startPosition);
 
   // Process rising edge
-  encoders->encA_interrupt();
+  edgeA(HIGH);
+  edgeB(HIGH);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeA(LOW);
+  edgeB(LOW);
 
   // Should have moved and not reset position
   ASSERT_EQ(encoders->getPosition(), startPosition - 1);
 }
 
 TEST_F(EncodersTest, test_encA_falling_in_front_KH910_unfixed_K) {
-  encoders->init(Machine_t::Kh910);
-  ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
+  // Not in front of Left Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
 
   // Unfixed shield: lace signal is always high
   EXPECT_CALL(*arduinoMock, digitalRead(EOL_PIN_R_L))
     .WillRepeatedly(Return(HIGH));
 
-  // Not in front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillRepeatedly(Return(MID_SENSOR_VALUE));
+  // The shield is probed once, and the encoder signals read
+  expect_encoder_read();
+  encoders->init(Machine_t::Kh910);
+  ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
+  expect_no_pin_setup();
 
   // K carriage in front of Right Hall Sensor: on a 910, the right sensor only
   // triggers for the K carriage and with a low voltage
@@ -274,19 +278,13 @@ TEST_F(EncodersTest, test_encA_falling_in_front_KH910_unfixed_K) {
   // BeltShift is shifted
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillRepeatedly(Return(LOW));
 
-  // Create two falling edges (the initial state of A is assumed to be low)
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-    
-  // Always moving to the left: A != B
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B))
-    .WillRepeatedly(ReturnRoundRobin({ LOW, HIGH }));
-
-  // Process rising edge
-  encoders->encA_interrupt();
+  // Process rising edge, moving to the left
+  edgeA(HIGH);
+  edgeB(HIGH);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeA(LOW);
+  edgeB(LOW);
 
   uint8_t startPosition = END_RIGHT_MINUS_OFFSET[static_cast<int8_t>(encoders->getMachineType())];
 
@@ -297,18 +295,20 @@ TEST_F(EncodersTest, test_encA_falling_in_front_KH910_unfixed_K) {
   ASSERT_EQ(encoders->getPosition(), startPosition);
 
   // Process rising edge
-  encoders->encA_interrupt();
+  edgeA(HIGH);
+  edgeB(HIGH);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeA(LOW);
+  edgeB(LOW);
 
   // Should have moved and not reset position
   ASSERT_EQ(encoders->getPosition(), startPosition - 1);
 }
 
 TEST_F(EncodersTest, test_encA_falling_in_front_KH910_fixed_L) {
-  encoders->init(Machine_t::Kh910);
-  ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
+  // Not in front of Left Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
 
   uint8_t detectPinLevel = HIGH;
   uint8_t detectPinMode = INPUT;
@@ -321,6 +321,7 @@ TEST_F(EncodersTest, test_encA_falling_in_front_KH910_fixed_L) {
 
   EXPECT_CALL(*arduinoMock, pinMode(EOL_PIN_R_L, INPUT_PULLUP))
     .Times(AtLeast(1));
+  EXPECT_CALL(*arduinoMock, pinMode(EOL_PIN_R, INPUT_PULLUP));
 
   // Fixed shield: lace signal (pin 7) is low if pin 8 is pulled down,
   // and high if pin 8 is left floating which happens when the L carriage
@@ -330,26 +331,23 @@ TEST_F(EncodersTest, test_encA_falling_in_front_KH910_fixed_L) {
       return (detectPinMode == OUTPUT && detectPinLevel == LOW) ? LOW : HIGH;
     });
 
-  // Not in front of Left Hall Sensor
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L))
-      .WillRepeatedly(Return(MID_SENSOR_VALUE));
+  // The shield is probed once, pin 8 released, and the encoder signals read
+  expect_encoder_read();
+  encoders->init(Machine_t::Kh910);
+  ASSERT_EQ(encoders->getCarriage(), Carriage_t::NoCarriage);
+  ASSERT_EQ(detectPinMode, INPUT);
+  expect_no_pin_setup();
 
   // BeltShift is shifted
   EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillRepeatedly(Return(LOW));
 
-  // Create two falling edges (the initial state of A is assumed to be low)
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A))
-    .WillRepeatedly(ReturnRoundRobin({ HIGH, LOW }));
-    
-  // Always moving to the left: A != B
-  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B))
-    .WillRepeatedly(ReturnRoundRobin({ LOW, HIGH }));
-
-  // Process rising edge
-  encoders->encA_interrupt();
+  // Process rising edge, moving to the left
+  edgeA(HIGH);
+  edgeB(HIGH);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeA(LOW);
+  edgeB(LOW);
 
   uint8_t startPosition = END_RIGHT_MINUS_OFFSET[static_cast<int8_t>(encoders->getMachineType())];
 
@@ -360,14 +358,188 @@ TEST_F(EncodersTest, test_encA_falling_in_front_KH910_fixed_L) {
   ASSERT_EQ(encoders->getPosition(), startPosition);
 
   // Process rising edge
-  encoders->encA_interrupt();
+  edgeA(HIGH);
+  edgeB(HIGH);
 
   // Process falling edge
-  encoders->encA_interrupt();
+  edgeA(LOW);
+  edgeB(LOW);
 
   // Should have moved and not reset position
   ASSERT_EQ(encoders->getPosition(), startPosition - 1);
 }
+
+TEST_F(EncodersTest, test_encB_interrupt) {
+  // Not in front of either Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
+
+  // The edges of B never move the carriage
+  edgeB(HIGH);
+  edgeB(LOW);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::NoDirection);
+  ASSERT_EQ(encoders->getPosition(), 0x00);
+
+  // An interrupt that finds no change, as after a bounce, does nothing
+  edgeB(HIGH);
+  edgeA(HIGH);
+  edgeA(HIGH);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
+  ASSERT_EQ(encoders->getPosition(), 0x01);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+}
+
+TEST_F(EncodersTest, test_encB_interrupt_edgeA) {
+  // In front of Left Hall Sensor, not in front of Right Hall Sensor
+  sampleHallSensors(FILTER_L_MIN[static_cast<int8_t>(encoders->getMachineType())] - 1,
+                    MID_SENSOR_VALUE);
+  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillRepeatedly(Return(HIGH));
+  uint8_t startPosition = END_LEFT_PLUS_OFFSET[static_cast<int8_t>(encoders->getMachineType())];
+
+  // A rises while B bounces, and the interrupt of B finds the edge of A
+  edgeB(HIGH);
+  m_encA = HIGH;
+  edgeB(HIGH);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
+  ASSERT_EQ(encoders->getHallActive(), Direction_t::Left);
+  ASSERT_EQ(encoders->getPosition(), startPosition);
+
+  // The interrupt of A then finds no change, and keeps the Hall sensor
+  edgeA(HIGH);
+  ASSERT_EQ(encoders->getHallActive(), Direction_t::Left);
+  ASSERT_EQ(encoders->getPosition(), startPosition);
+
+  // until the next edge of A
+  edgeB(LOW);
+  ASSERT_EQ(encoders->getHallActive(), Direction_t::Left);
+  edgeA(LOW);
+  ASSERT_EQ(encoders->getHallActive(), Direction_t::NoDirection);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+}
+
+TEST_F(EncodersTest, test_reversal) {
+  // Not in front of either Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
+
+  // Two steps to the right
+  for (uint8_t i = 0U; i < 2U; i++) {
+    edgeB(HIGH);
+    edgeA(HIGH);
+    edgeB(LOW);
+    edgeA(LOW);
+  }
+  ASSERT_EQ(encoders->getPosition(), 0x02);
+
+  // Vibration at the turn: A goes back and forth while B stays low
+  edgeA(HIGH);
+  edgeA(LOW);
+  edgeA(HIGH);
+  edgeA(LOW);
+  ASSERT_EQ(encoders->getPosition(), 0x02);
+
+  // One step back to the left
+  edgeA(HIGH);
+  edgeB(HIGH);
+  edgeA(LOW);
+  edgeB(LOW);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Left);
+  ASSERT_EQ(encoders->getPosition(), 0x01);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+}
+
+TEST_F(EncodersTest, test_illegal_transition) {
+  // Not in front of either Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
+
+  // Both signals have changed: an edge of B was missed
+  m_encB = HIGH;
+  edgeA(HIGH);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::NoDirection);
+  ASSERT_EQ(encoders->getPosition(), 0x00);
+
+  // Decoding carries on from the levels that were read
+  edgeB(LOW);
+  edgeA(LOW);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
+  ASSERT_EQ(encoders->getPosition(), 0x00);
+
+  ASSERT_EQ(encoders->getIllegalTransitions(true), 1U);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+
+  // and starts afresh with the machine
+  m_encA = HIGH;
+  edgeB(HIGH);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 1U);
+  expect_encoder_read();
+  encoders->init(Machine_t::Kh930);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+}
+
+TEST_F(EncodersTest, test_init_signal_high) {
+  // Not in front of either Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
+
+  // The carriage stopped with A high: decoding starts from there,
+  // so that the next edge is not mistaken for no change.
+  m_encA = HIGH;
+  expect_encoder_read();
+  encoders->init(Machine_t::Kh930);
+  edgeA(LOW);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
+  edgeB(HIGH);
+  edgeA(HIGH);
+  ASSERT_EQ(encoders->getPosition(), 0x01);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+}
+
+TEST_F(EncodersTest, test_debounce) {
+  // Not in front of either Hall Sensor
+  sampleHallSensors(MID_SENSOR_VALUE, MID_SENSOR_VALUE);
+
+  // The encoder interrupt does not call `micros()` unless asked to
+  ASSERT_EQ(encoders->m_debounceTime, ENCODER_DEBOUNCE_US);
+  encoders->m_debounceTime = 0U;
+  EXPECT_CALL(*arduinoMock, micros).Times(0);
+  edgeB(HIGH);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
+
+  // A bounce 10 us after the last edge is ignored
+  encoders->m_debounceTime = 20U;
+  EXPECT_CALL(*arduinoMock, micros).WillOnce(Return(1000U));
+  edgeA(HIGH);
+  ASSERT_EQ(encoders->getPosition(), 0x01);
+  EXPECT_CALL(*arduinoMock, micros).WillOnce(Return(1010U));
+  edgeA(LOW);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
+
+  // and when the signal is back, there is no change to time
+  EXPECT_CALL(*arduinoMock, micros).Times(0);
+  edgeA(HIGH);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
+
+  // Later edges are decoded as usual
+  EXPECT_CALL(*arduinoMock, micros).WillOnce(Return(1100U));
+  edgeB(LOW);
+  EXPECT_CALL(*arduinoMock, micros).WillOnce(Return(1200U));
+  edgeA(LOW);
+  ASSERT_EQ(encoders->getDirection(), Direction_t::Right);
+  ASSERT_EQ(encoders->getPosition(), 0x01);
+  ASSERT_EQ(encoders->getIllegalTransitions(false), 0U);
+}
+
+TEST_F(EncodersTest, test_adc_interrupt) {
+  // The sensors are converted in turn, from any starting point.
+  sampleHallSensors(0x0123, 0x0234);
+
+  // The next conversion replaces one sample only
+  EXPECT_CALL(*arduinoMock, analogRead(_)).WillOnce(Return(0x0345));
+  encoders->adc_interrupt();
+  uint16_t left = encoders->getHallValue(Direction_t::Left);
+  uint16_t right = encoders->getHallValue(Direction_t::Right);
+  ASSERT_TRUE((left == 0x0345 && right == 0x0234) ||
+              (left == 0x0123 && right == 0x0345));
+}
+
 TEST_F(EncodersTest, test_getPosition) {
   uint8_t p = encoders->getPosition();
   ASSERT_EQ(p, 0x00);
@@ -401,13 +573,26 @@ TEST_F(EncodersTest, test_getMachineType) {
 TEST_F(EncodersTest, test_getHallValue) {
   uint16_t v = encoders->getHallValue(Direction_t::NoDirection);
   ASSERT_EQ(v, 0u);
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L));
+  // the latest samples are read without waiting for the ADC
+  sampleHallSensors(0u, 0xbeefu);
   v = encoders->getHallValue(Direction_t::Left);
   ASSERT_EQ(v, 0u);
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R));
-  v = encoders->getHallValue(Direction_t::Right);
-  ASSERT_EQ(v, 0u);
-  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R)).WillOnce(Return(0xbeefu));
   v = encoders->getHallValue(Direction_t::Right);
   ASSERT_EQ(v, 0xbeefu);
 }
+
+TEST_F(EncodersTest, test_machineTraits) {
+  // traits agree with the run-time tables
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh910>::numNeedles == NUM_NEEDLES[0]);
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh930>::filterRMax == FILTER_R_MAX[1]);
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh270>::endRightMinusOffset == END_RIGHT_MINUS_OFFSET[2]);
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh270>::allMagnetsClearedLeft == ALL_MAGNETS_CLEARED_LEFT[2]);
+
+  // machine-specific behaviour
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh910>::hasBeltShift);
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh930>::hasBeltShift);
+  ASSERT_FALSE(MachineTraits<Machine_t::Kh270>::hasBeltShift);
+  ASSERT_TRUE(MachineTraits<Machine_t::Kh910>::digitalRightSensor);
+  ASSERT_FALSE(MachineTraits<Machine_t::Kh930>::digitalRightSensor);
+  ASSERT_FALSE(MachineTraits<Machine_t::Kh270>::digitalRightSensor);
+}
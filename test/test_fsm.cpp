@@ -77,6 +77,8 @@ protected:
     // start in state `OpState::init`
     EXPECT_CALL(*arduinoMock, millis);
     fsm->init();
+    // the knitter reads the time as it pleases
+    ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
     // expected_isr(NoDirection, NoDirection);
     // EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, LOW));
     // fsm->setState(OpState::init);
@@ -34,7 +34,9 @@
 #include <tester_mock.h>
 
 using ::testing::_;
+using ::testing::AnyNumber;
 using ::testing::AtLeast;
+using ::testing::Invoke;
 using ::testing::Mock;
 using ::testing::Return;
 using ::testing::TypedEq;
@@ -69,10 +71,16 @@ protected:
     Mock::AllowLeak(solenoidsMock);
     Mock::AllowLeak(testerMock);
 
+    for (uint8_t i = 0; i < NUM_LINE_BUFFERS; i++) {
+      lines[i] = lineBuffer[i];
+    }
+
     // start in state `OpState::init`
     expected_isr(Direction_t::NoDirection, Direction_t::NoDirection);
     EXPECT_CALL(*arduinoMock, millis);
     fsm->init();
+    // the knitter reads the time as it pleases
+    ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
     expect_knitter_init();
     knitter->init();
   }
@@ -81,6 +89,10 @@ protected:
     releaseArduinoMock();
   }
 
+  // pattern lines passed to the knitter, which keeps a pointer to them
+  uint8_t lineBuffer[NUM_LINE_BUFFERS][MAX_LINE_BUFFER_LEN] = {{1}};
+  uint8_t *lines[NUM_LINE_BUFFERS] = {nullptr};
+
   ArduinoMock *arduinoMock;
   BeeperMock *beeperMock;
   ComMock *comMock;
@@ -197,9 +209,8 @@ protected:
   void get_to_knit(Machine_t m) {
     EXPECT_CALL(*encodersMock, init);
     get_to_ready(m);
-    uint8_t pattern[] = {1};
     EXPECT_CALL(*beeperMock, ready);
-    ASSERT_EQ(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(m)] - 1, pattern, false), ErrorCode::success);
+    ASSERT_EQ(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(m)] - 1, lines, false), ErrorCode::success);
     expected_dispatch_ready();
 
     // ends in state `OpState::knit`
@@ -277,29 +288,26 @@ TEST_F(KnitterTest, test_isr) {
 }
 
 TEST_F(KnitterTest, test_startKnitting_NoMachine) {
-  uint8_t pattern[] = {1};
   Machine_t m = knitter->getMachineType();
   ASSERT_EQ(m, Machine_t::NoMachine);
   ASSERT_TRUE(knitter->initMachine(m) != ErrorCode::success);
   ASSERT_TRUE(
-      knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(m)] - 1, pattern, false) != ErrorCode::success);
+      knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(m)] - 1, lines, false) != ErrorCode::success);
 
   // test expectations without destroying instance
   ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
 }
 
 TEST_F(KnitterTest, test_startKnitting_invalidMachine) {
-  uint8_t pattern[] = {1};
   ASSERT_TRUE(knitter->initMachine(Machine_t::NoMachine) != ErrorCode::success);
-  ASSERT_TRUE(knitter->startKnitting(0, 1, pattern, false) != ErrorCode::success);
+  ASSERT_TRUE(knitter->startKnitting(0, 1, lines, false) != ErrorCode::success);
 
   // test expectations without destroying instance
   ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
 }
 
 TEST_F(KnitterTest, test_startKnitting_notReady) {
-  uint8_t pattern[] = {1};
-  ASSERT_TRUE(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 1, pattern,
+  ASSERT_TRUE(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 1, lines,
                                      false) != ErrorCode::success);
 
   // test expectations without destroying instance
@@ -327,14 +335,13 @@ TEST_F(KnitterTest, test_startKnitting_Kh270) {
 }
 
 TEST_F(KnitterTest, test_startKnitting_failures) {
-  uint8_t pattern[] = {1};
   get_to_ready(Machine_t::Kh910);
 
   // `m_stopNeedle` lower than `m_startNeedle`
-  ASSERT_TRUE(knitter->startKnitting(1, 0, pattern, false) != ErrorCode::success);
+  ASSERT_TRUE(knitter->startKnitting(1, 0, lines, false) != ErrorCode::success);
 
   // `m_stopNeedle` out of range
-  ASSERT_TRUE(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)], pattern,
+  ASSERT_TRUE(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)], lines,
                                      false) != ErrorCode::success);
 
   // null pattern
@@ -381,13 +388,11 @@ TEST_F(KnitterTest, test_knit_Kh910) {
   get_to_ready(Machine_t::Kh910);
 
   // knit
-  uint8_t pattern[] = {1};
-
   // `m_startNeedle` is greater than `m_pixelToSet`
   EXPECT_CALL(*beeperMock, ready);
   const uint8_t START_NEEDLE = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 2;
   const uint8_t STOP_NEEDLE = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 1;
-  knitter->startKnitting(START_NEEDLE, STOP_NEEDLE, pattern, true);
+  knitter->startKnitting(START_NEEDLE, STOP_NEEDLE, lines, true);
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, LOW)); // green LED off
   expected_dispatch();
 
@@ -421,17 +426,65 @@ TEST_F(KnitterTest, test_knit_Kh910) {
   ASSERT_TRUE(Mock::VerifyAndClear(comMock));
 }
 
+TEST_F(KnitterTest, test_knit_report_needles) {
+  get_to_ready(Machine_t::Kh910);
+
+  // report every 2 needles, in batches
+  knitter->setReportPolicy(ReportMode::needles, 2);
+  EXPECT_CALL(*beeperMock, ready);
+  const uint8_t START_NEEDLE = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 2;
+  const uint8_t STOP_NEEDLE = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 1;
+  knitter->startKnitting(START_NEEDLE, STOP_NEEDLE, lines, true);
+  EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, LOW)); // green LED off
+  expected_dispatch();
+
+  // first position
+  expect_first_knit();
+  EXPECT_CALL(*comMock, send_indState).Times(0);
+  EXPECT_CALL(*comMock, send_indPositions).Times(0);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // no room for the report: try again at the next position
+  expected_isr(START_NEEDLE);
+  EXPECT_CALL(*comMock, send_indPositions(_, _, 2, _, 2)).WillOnce(Return(false));
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  uint8_t positions[REPORT_BATCH_LEN] = {0};
+  expected_isr(START_NEEDLE + 1);
+  EXPECT_CALL(*comMock, send_indPositions(_, _, 3, _, 3))
+      .WillOnce(Invoke([&positions](Carriage_t, Direction_t, uint16_t,
+                                    const uint8_t *sent, uint8_t count) {
+        memcpy(positions, sent, count);
+        return true;
+      }));
+  expected_dispatch_knit(false);
+  ASSERT_EQ(positions[1], START_NEEDLE);
+  ASSERT_EQ(positions[2], START_NEEDLE + 1);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // counting starts again after a report
+  expected_isr(START_NEEDLE);
+  EXPECT_CALL(*comMock, send_indPositions).Times(0);
+  expected_dispatch_knit(false);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
 TEST_F(KnitterTest, test_knit_Kh270) {
   get_to_ready(Machine_t::Kh270);
 
   // knit
-  uint8_t pattern[] = {1};
-
   // `m_startNeedle` is greater than `m_pixelToSet`
   EXPECT_CALL(*beeperMock, ready);
   const uint8_t START_NEEDLE = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh270)] - 2;
   const uint8_t STOP_NEEDLE = NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh270)] - 1;
-  knitter->startKnitting(START_NEEDLE, STOP_NEEDLE, pattern, true);
+  knitter->startKnitting(START_NEEDLE, STOP_NEEDLE, lines, true);
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, LOW));
   expected_dispatch();
 
@@ -530,8 +583,9 @@ TEST_F(KnitterTest, test_knit_lastLine_and_no_req) {
   uint8_t wanted_pixel =
       knitter->m_stopNeedle + END_OF_LINE_OFFSET_R[static_cast<uint8_t>(Machine_t::Kh910)] + 1;
   knitter->m_firstRun = false;
-  knitter->m_direction = Direction_t::Left;
-  knitter->m_position = wanted_pixel + knitter->getStartOffset(Direction_t::Right);
+  knitter->m_startPending = false;
+  knitter->m_encoderEvents.push({static_cast<uint8_t>(wanted_pixel + knitter->getStartOffset(Direction_t::Right)),
+                                 Direction_t::Left, BeltShift::Regular, Carriage_t::Knit, 0U});
   knitter->m_workedOnLine = true;
   knitter->m_lineRequested = false;
   knitter->m_lastLineFlag = true;
@@ -599,6 +653,453 @@ TEST_F(KnitterTest, test_knit_new_line) {
   ASSERT_TRUE(Mock::VerifyAndClear(comMock));
 }
 
+TEST_F(KnitterTest, test_knit_prefetch) {
+  get_to_ready(Machine_t::Kh910);
+
+  // line 0 clears all needles, line 1 sets all needles
+  uint8_t (&pattern)[NUM_LINE_BUFFERS][MAX_LINE_BUFFER_LEN] = lineBuffer;
+  memset(pattern[lineBufferSlot(0)], 0x00, MAX_LINE_BUFFER_LEN);
+  memset(pattern[lineBufferSlot(1)], 0xFF, MAX_LINE_BUFFER_LEN);
+  EXPECT_CALL(*beeperMock, ready);
+  ASSERT_EQ(knitter->startKnitting(0, NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] - 1, lines, false), ErrorCode::success);
+  expected_dispatch_ready();
+
+  // first knit requests line 0
+  EXPECT_CALL(*beeperMock, finishedLine);
+  EXPECT_CALL(*comMock, send_reqLine(0, _));
+  EXPECT_CALL(*solenoidsMock, setSolenoid);
+  expected_dispatch_knit(false);
+
+  // carriage is waiting for line 0, so it is taken up at once
+  EXPECT_CALL(*beeperMock, finishedLine);
+  ASSERT_EQ(knitter->setNextLine(0), true);
+
+  // line 1 is requested while line 0 is being knitted
+  EXPECT_CALL(*comMock, send_reqLine(1, _));
+  expected_dispatch_knit(false);
+  EXPECT_CALL(*beeperMock, finishedLine).Times(0);
+  ASSERT_EQ(knitter->setNextLine(1), true);
+
+  // with two line buffers, no further request while both are full
+  EXPECT_CALL(*comMock, send_reqLine).Times(NUM_LINE_BUFFERS > 2U ? 1 : 0);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // knit inside the working needles using line 0
+  EXPECT_CALL(*solenoidsMock, setSolenoid(_, false));
+  expected_isr(knitter->getStartOffset(Direction_t::Left) + 20);
+  expected_dispatch_knit(false);
+
+  // end of line: switch to the prefetched line 1 without waiting for the host
+  EXPECT_CALL(*solenoidsMock, setSolenoid(_, true));
+  EXPECT_CALL(*beeperMock, finishedLine);
+  EXPECT_CALL(*comMock, send_reqLine(2, _)).Times(NUM_LINE_BUFFERS > 2U ? 0 : 1);
+  expected_isr(NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)] + END_OF_LINE_OFFSET_R[static_cast<uint8_t>(Machine_t::Kh910)] + 1 + knitter->getStartOffset(Direction_t::Left));
+  expected_dispatch_knit(false);
+
+  // knit inside the working needles using line 1
+  EXPECT_CALL(*solenoidsMock, setSolenoid(_, true));
+  expected_isr(knitter->getStartOffset(Direction_t::Left) + 40);
+  expected_dispatch_knit(false);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
+TEST_F(KnitterTest, test_knit_queue) {
+  expected_dispatch_knit(true);
+  const uint8_t POSITION = knitter->getStartOffset(Direction_t::Left) + 20;
+
+  // every position passed between two calls of `knit()` is acted on
+  expected_isr(POSITION, Direction_t::Right, Direction_t::Left);
+  expected_isr(POSITION + 1, Direction_t::Right, Direction_t::Left);
+  expected_isr(POSITION + 1, Direction_t::Right, Direction_t::Left); // no change
+  expected_isr(POSITION + 2, Direction_t::Right, Direction_t::Left);
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(3);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_EQ(knitter->m_encoderOverflows, 0U);
+
+  // positions that do not fit in the queue are counted
+  for (uint8_t i = 0; i < ENCODER_QUEUE_LEN + 2U; i++) {
+    expected_isr(POSITION + 3 + i, Direction_t::Right, Direction_t::Left);
+  }
+  ASSERT_EQ(knitter->m_encoderOverflows, 2U);
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(ENCODER_QUEUE_LEN);
+  expected_dispatch_knit(false);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
+#if ENABLE_EDGE_LOG
+TEST_F(KnitterTest, test_edge_log) {
+  expected_dispatch_knit(true);
+  const uint8_t POSITION = knitter->getStartOffset(Direction_t::Left) + 20;
+
+  // start from the edges logged while getting ready
+  EdgeRecord edge;
+  while (knitter->popEdge(edge)) {
+  }
+
+  // every edge is logged with its time, which `micros()`
+  // stands in for on the host
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(AnyNumber());
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(1000U));
+  expected_isr(POSITION, Direction_t::Right, Direction_t::Left);
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(1250U));
+  expected_isr(POSITION, Direction_t::Right, Direction_t::Left); // no change
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(1500U));
+  expected_isr(POSITION + 1, Direction_t::Right, Direction_t::Left);
+
+  ASSERT_TRUE(knitter->popEdge(edge));
+  ASSERT_EQ(edge.ticks, 1000U * EDGE_TICKS_PER_US);
+  ASSERT_EQ(edge.position, POSITION);
+  ASSERT_EQ(edge.direction, Direction_t::Right);
+  ASSERT_TRUE(knitter->popEdge(edge));
+  ASSERT_EQ(edge.ticks, 1250U * EDGE_TICKS_PER_US);
+  ASSERT_EQ(edge.position, POSITION);
+  ASSERT_TRUE(knitter->popEdge(edge));
+  ASSERT_EQ(edge.ticks, 1500U * EDGE_TICKS_PER_US);
+  ASSERT_EQ(edge.position, POSITION + 1);
+  ASSERT_FALSE(knitter->popEdge(edge));
+  ASSERT_EQ(knitter->getEdgesLost(), 0U);
+
+  // edges that do not fit in the log are counted, until asked for
+  for (uint8_t i = 0U; i < EDGE_LOG_LEN + 2U; i++) {
+    expected_isr(POSITION + 2 + i, Direction_t::Right, Direction_t::Left);
+  }
+  ASSERT_EQ(knitter->getEdgesLost(), 2U);
+  ASSERT_EQ(knitter->getEdgesLost(), 0U);
+  ASSERT_TRUE(knitter->popEdge(edge));
+  ASSERT_EQ(edge.position, POSITION + 2);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+#else
+TEST_F(KnitterTest, test_edge_log_disabled) {
+  // nothing is logged without `-DENABLE_EDGE_LOG=1`
+  EdgeRecord edge;
+  ASSERT_FALSE(knitter->popEdge(edge));
+  ASSERT_EQ(knitter->getEdgesLost(), 0U);
+}
+#endif
+
+TEST_F(KnitterTest, test_knit_lead) {
+  expected_dispatch_knit(true);
+  const uint8_t POSITION = knitter->getStartOffset(Direction_t::Left) + 20;
+
+#if !ENABLE_EDGE_LOG
+  // without lead time the edges are not timed
+  EXPECT_CALL(*arduinoMock, micros).Times(0);
+  expected_isr(POSITION - 1, Direction_t::Right, Direction_t::Left);
+  ASSERT_TRUE(Mock::VerifyAndClearExpectations(arduinoMock));
+  EXPECT_CALL(*solenoidsMock, setSolenoid);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+#endif
+
+  // thresholds for a lead time of 1ms
+  knitter->setLeadTime(1000U);
+  ASSERT_EQ(knitter->m_leadThreshold[0], 1000U);
+  ASSERT_EQ(knitter->m_leadThreshold[3], 250U);
+
+  // a needle every 300us: 3 needles ahead
+  knitter->m_stepPeriod = 300U;
+  knitter->m_lastEdgeTime = 10000U;
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(10300U));
+  expected_isr(POSITION, Direction_t::Right, Direction_t::Left);
+  ASSERT_EQ(knitter->m_stepPeriod, 300U);
+  ASSERT_EQ(knitter->m_leadSteps, 3U);
+
+  // selects the carriage position and the 3 positions ahead of it
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(4);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_EQ(knitter->m_actuatedPosition, POSITION + 3);
+
+  // next position only selects the new position ahead,
+  // 40us after the encoder edge
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(10600U));
+  expected_isr(POSITION + 1, Direction_t::Right, Direction_t::Left);
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(10640U));
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(1);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_EQ(knitter->m_actuatedPosition, POSITION + 4);
+  ASSERT_EQ(knitter->m_actuationLatencyMax, 40U);
+
+  // slowing down does not select positions again
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(30000U));
+  expected_isr(POSITION + 2, Direction_t::Right, Direction_t::Left);
+  ASSERT_EQ(knitter->m_leadSteps, 0U);
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(0);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+
+  // change of direction starts again from the carriage position
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(30300U));
+  knitter->m_stepPeriod = 300U;
+  expected_isr(POSITION + 1, Direction_t::Left, Direction_t::Left);
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(4);
+  expected_dispatch_knit(false);
+  ASSERT_EQ(knitter->m_actuatedPosition, POSITION - 2);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
+TEST_F(KnitterTest, test_motif) {
+  EXPECT_CALL(*encodersMock, init);
+  get_to_ready(Machine_t::Kh910);
+
+  // 3 x 2 motif: row 0 is `X.X`, row 1 is `.X.`
+  const uint8_t motif[2] = {0x05, 0x02};
+  const uint8_t START_NEEDLE = 10;
+  const uint8_t STOP_NEEDLE = 19;
+
+  // invalid motifs
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 0, nullptr, 1), ErrorCode::null_pointer_argument);
+  ASSERT_EQ(knitter->setMotif(0, 2, 3, 0, motif, 1), ErrorCode::argument_invalid);
+  ASSERT_EQ(knitter->setMotif(201, 1, 3, 0, motif, 26), ErrorCode::argument_invalid);
+  ASSERT_EQ(knitter->setMotif(200, 3, 3, 0, motif, 25), ErrorCode::argument_invalid);
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 0, motif, 3), ErrorCode::arguments_incompatible);
+
+  // upload one row at a time, in order
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 0, &motif[0], 1), ErrorCode::success);
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 2, &motif[1], 1), ErrorCode::arguments_incompatible);
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 1, &motif[1], 1), ErrorCode::success);
+
+  uint8_t (&pattern)[NUM_LINE_BUFFERS][MAX_LINE_BUFFER_LEN] = lineBuffer;
+  EXPECT_CALL(*beeperMock, ready);
+  ASSERT_EQ(knitter->startKnitting(START_NEEDLE, STOP_NEEDLE, lines, false), ErrorCode::success);
+  expected_dispatch_ready();
+  ASSERT_TRUE(knitter->m_motifActive);
+
+  // no motif uploads while knitting
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 0, motif, 2), ErrorCode::wrong_machine_state);
+
+  // lines are tiled on the device, not requested from the host
+  auto expect_line = [&](uint8_t lineNumber, uint8_t motifRow) {
+    const uint8_t *line = pattern[lineBufferSlot(lineNumber)];
+    for (uint8_t needle = 0; needle < NUM_NEEDLES[static_cast<uint8_t>(Machine_t::Kh910)]; needle++) {
+      bool set = false;
+      if ((needle >= START_NEEDLE) && (needle <= STOP_NEEDLE)) {
+        set = bitRead(motif[motifRow], (needle - START_NEEDLE) % 3);
+      }
+      // line buffers hold inverted needle states
+      ASSERT_EQ(bitRead(line[needle >> 3], needle & 0x07), !set) << "needle " << +needle;
+    }
+  };
+  EXPECT_CALL(*comMock, send_reqLine).Times(0);
+  EXPECT_CALL(*beeperMock, finishedLine).Times(2);
+  EXPECT_CALL(*solenoidsMock, setSolenoid);
+  expected_dispatch_knit(false);
+  ASSERT_EQ(knitter->m_currentLineNumber, 0U);
+  ASSERT_EQ(knitter->m_linesBuffered, NUM_LINE_BUFFERS - 1U);
+  expect_line(0, 0);
+  if (NUM_LINE_BUFFERS > 1U) {
+    expect_line(1, 1);
+  }
+
+  // the motif repeats vertically until 3 lines have been knitted
+  EXPECT_CALL(*beeperMock, finishedLine).Times(2);
+  knitter->finishLine();
+  knitter->finishLine();
+  ASSERT_EQ(knitter->m_currentLineNumber, 2U);
+  ASSERT_TRUE(knitter->m_lastLineFlag);
+  expect_line(2, 0);
+
+  // host lines are ignored
+  ASSERT_FALSE(knitter->setNextLine(3));
+
+  EXPECT_CALL(*beeperMock, endWork);
+  EXPECT_CALL(*solenoidsMock, setSolenoids(SOLENOIDS_BITMASK));
+  EXPECT_CALL(*beeperMock, finishedLine);
+  knitter->finishLine();
+  expected_dispatch_knit(false);
+  ASSERT_EQ(fsm->getState(), OpState::init);
+
+  // the motif has to be uploaded again for the next job
+  ASSERT_EQ(knitter->setMotif(3, 2, 3, 1, &motif[1], 1), ErrorCode::arguments_incompatible);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
+TEST_F(KnitterTest, test_nackLine) {
+  // no line has been requested
+  EXPECT_CALL(*comMock, send_reqLine).Times(0);
+  knitter->nackLine(ErrorCode::checksum_error);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // line 0 is requested at 1 s
+  EXPECT_CALL(*arduinoMock, millis).WillRepeatedly(Return(1000U));
+  expected_dispatch_knit(true);
+
+  // a rejected line is requested again at once, with the error
+  EXPECT_CALL(*comMock, send_reqLine(0, ErrorCode::checksum_error));
+  knitter->nackLine(ErrorCode::checksum_error);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // a line that does not arrive in time is requested again
+  EXPECT_CALL(*arduinoMock, millis).WillRepeatedly(Return(1000U + LINE_REQUEST_TIMEOUT_MS));
+  EXPECT_CALL(*comMock, send_reqLine(0, ErrorCode::success));
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // but not more than `LINE_REQUEST_RETRIES` times for rejected answers
+  EXPECT_CALL(*comMock, send_reqLine(0, ErrorCode::expected_longer_message))
+      .Times(LINE_REQUEST_RETRIES - 1U);
+  for (uint8_t i = 0U; i < LINE_REQUEST_RETRIES; i++) {
+    knitter->nackLine(ErrorCode::expected_longer_message);
+  }
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // while a lost answer is still requested again, after twice the timeout
+  EXPECT_CALL(*arduinoMock, millis)
+      .WillRepeatedly(Return(1000U + 3U * LINE_REQUEST_TIMEOUT_MS - 1U));
+  EXPECT_CALL(*comMock, send_reqLine).Times(0);
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+  EXPECT_CALL(*arduinoMock, millis)
+      .WillRepeatedly(Return(1000U + 3U * LINE_REQUEST_TIMEOUT_MS));
+  EXPECT_CALL(*comMock, send_reqLine(0, ErrorCode::success));
+  expected_dispatch_knit(false);
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+  // the next line can be requested again
+  EXPECT_CALL(*beeperMock, finishedLine);
+  ASSERT_TRUE(knitter->setNextLine(0));
+  EXPECT_CALL(*comMock, send_reqLine(1, ErrorCode::success));
+  expected_dispatch_knit(false);
+  EXPECT_CALL(*comMock, send_reqLine(1, ErrorCode::checksum_error));
+  knitter->nackLine(ErrorCode::checksum_error);
+
+  KnitterStats stats;
+  knitter->getStats(stats, false);
+  ASSERT_EQ(stats.lineRetries, LINE_REQUEST_RETRIES + 3U);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
+TEST_F(KnitterTest, test_reqLine_timeout) {
+  // line 0 is requested at 1 s
+  EXPECT_CALL(*arduinoMock, millis).WillRepeatedly(Return(1000U));
+  expected_dispatch_knit(true);
+
+  // five answers in a row are lost, and each time the line is
+  // requested again, waiting longer up to the backoff limit
+  uint32_t sent = 1000U;
+  uint32_t timeout = LINE_REQUEST_TIMEOUT_MS;
+  for (uint8_t i = 0U; i < 5U; i++) {
+    EXPECT_CALL(*arduinoMock, millis).WillRepeatedly(Return(sent + timeout - 1U));
+    EXPECT_CALL(*comMock, send_reqLine).Times(0);
+    expected_dispatch_knit(false);
+    ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+    sent += timeout;
+    EXPECT_CALL(*arduinoMock, millis).WillRepeatedly(Return(sent));
+    EXPECT_CALL(*comMock, send_reqLine(0, ErrorCode::success));
+    expected_dispatch_knit(false);
+    ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+
+    if (timeout < (static_cast<uint32_t>(LINE_REQUEST_TIMEOUT_MS) << LINE_REQUEST_BACKOFF)) {
+      timeout *= 2U;
+    }
+  }
+  ASSERT_EQ(timeout, static_cast<uint32_t>(LINE_REQUEST_TIMEOUT_MS) << LINE_REQUEST_BACKOFF);
+
+  // the sixth request is answered
+  EXPECT_CALL(*beeperMock, finishedLine);
+  ASSERT_TRUE(knitter->setNextLine(0));
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
+TEST_F(KnitterTest, test_stats) {
+  // line 0 is requested at 1 ms
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(1000U));
+  expected_dispatch_knit(true);
+  ASSERT_EQ(knitter->m_stats.lines, 0U);
+
+  // the carriage moves to needle 20 while waiting for line 0
+  EXPECT_CALL(*solenoidsMock, setSolenoid).Times(2);
+  expected_isr(40);
+  expected_isr(knitter->getStartOffset(Direction_t::Left) + 20);
+  expected_dispatch_knit(false);
+
+  // line 0 arrives 25 ms later, too late: the carriage is already
+  // inside the working needles
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(26000U));
+  EXPECT_CALL(*beeperMock, finishedLine);
+  ASSERT_TRUE(knitter->setNextLine(0));
+  ASSERT_EQ(knitter->m_stats.lines, 1U);
+  ASSERT_EQ(knitter->m_stats.latency.max, 25U);
+  ASSERT_EQ(knitter->m_stats.travel.max, 3U); // including the start position
+  ASSERT_EQ(knitter->m_stats.slack.max, 0U);
+  ASSERT_EQ(knitter->m_stats.slackHistogram[0], 1U);
+
+  // line 1 is prefetched and arrives 2 ms later, while the carriage
+  // still has to pass needles 21 to 199, the end of the line, and back
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(30000U));
+  EXPECT_CALL(*comMock, send_reqLine(1, _));
+  expected_dispatch_knit(false);
+  EXPECT_CALL(*arduinoMock, micros).WillRepeatedly(Return(32000U));
+  ASSERT_TRUE(knitter->setNextLine(1));
+  const uint16_t SLACK = 199 + 2 * END_OF_LINE_OFFSET_R[static_cast<uint8_t>(Machine_t::Kh910)] - 20;
+
+  // the encoder counts illegal transitions on its own
+  EXPECT_CALL(*encodersMock, getIllegalTransitions(true)).WillOnce(Return(3U));
+
+  KnitterStats stats;
+  knitter->getStats(stats, true);
+  ASSERT_EQ(stats.lines, 2U);
+  ASSERT_EQ(stats.latency.min, 2U);
+  ASSERT_EQ(stats.latency.max, 25U);
+  ASSERT_EQ(stats.latency.sum, 27U);
+  ASSERT_EQ(stats.travel.min, 0U);
+  ASSERT_EQ(stats.slack.min, 0U);
+  ASSERT_EQ(stats.slack.max, SLACK);
+  ASSERT_EQ(stats.slackHistogram[SLACK_HISTOGRAM_BINS - 1], 1U);
+  ASSERT_EQ(stats.illegalTransitions, 3U);
+
+  // reset
+  EXPECT_CALL(*encodersMock, getIllegalTransitions(false)).WillOnce(Return(0U));
+  knitter->getStats(stats, false);
+  ASSERT_EQ(stats.lines, 0U);
+  ASSERT_EQ(stats.latency.min, UINT16_MAX);
+  ASSERT_EQ(stats.slackHistogram[0], 0U);
+  ASSERT_EQ(stats.illegalTransitions, 0U);
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(solenoidsMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(encodersMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(beeperMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(comMock));
+}
+
 TEST_F(KnitterTest, test_calculatePixelAndSolenoid) {
   // initialize
   expected_init_machine(Machine_t::Kh910);
@@ -659,6 +1160,59 @@ TEST_F(KnitterTest, test_calculatePixelAndSolenoid) {
   ASSERT_TRUE(Mock::VerifyAndClear(comMock));
 }
 
+TEST_F(KnitterTest, test_compileSchedule) {
+  for (uint8_t i = 0; i < MAX_LINE_BUFFER_LEN; i++) {
+    lineBuffer[0][i] = 0x5A ^ i;
+  }
+  knitter->m_currentLine = &lineBuffer[0][0];
+  knitter->m_startNeedle = 10;
+  knitter->m_stopNeedle = 150;
+
+  // schedule agrees with the per-step calculation for every position
+  for (uint8_t m = 0; m < NUM_MACHINES; m++) {
+    knitter->m_machineType = static_cast<Machine_t>(m);
+    for (Direction_t d : {Direction_t::Left, Direction_t::Right}) {
+      for (Carriage_t c : {Carriage_t::Knit, Carriage_t::Lace, Carriage_t::Garter}) {
+        for (BeltShift_t b : {BeltShift::Regular, BeltShift::Shifted}) {
+          knitter->m_scheduleState = {0U, d, b, c, 0U};
+          knitter->compileSchedule();
+
+          EncoderEvent state = {0U, d, b, c, 0U};
+          do {
+            uint8_t pixel;
+            uint8_t solenoid;
+            ASSERT_TRUE(knitter->calculatePixelAndSolenoid(state, pixel, solenoid));
+            uint8_t entry = knitter->scheduleEntry(state.position);
+            ASSERT_EQ(entry & SCHEDULE_SOLENOID_MASK, solenoid);
+            ASSERT_EQ(bitRead(entry, SCHEDULE_WORKING_BIT),
+                      (pixel >= 10) && (pixel <= 150));
+            if (pixel < MAX_LINE_BUFFER_LEN * 8U) {
+              ASSERT_EQ(bitRead(entry, SCHEDULE_PIXEL_BIT),
+                        bitRead(lineBuffer[0][pixel >> 3], pixel & 0x07));
+            } else {
+              ASSERT_EQ(bitRead(entry, SCHEDULE_PIXEL_BIT), 1U);
+            }
+          } while (++state.position != 0U);
+        }
+      }
+    }
+  }
+
+  // recompiled only when the carriage state changes
+  EncoderEvent state = {0U, Direction_t::Right, BeltShift::Regular, Carriage_t::Knit, 0U};
+  knitter->m_scheduleValid = false;
+  ASSERT_TRUE(knitter->updateSchedule(state));
+  knitter->m_scheduleStartOffset = 0xFF;
+  state.position = 100U;
+  ASSERT_TRUE(knitter->updateSchedule(state));
+  ASSERT_EQ(knitter->m_scheduleStartOffset, 0xFF);
+  state.direction = Direction_t::Left;
+  ASSERT_TRUE(knitter->updateSchedule(state));
+  ASSERT_NE(knitter->m_scheduleStartOffset, 0xFF);
+  state.direction = Direction_t::NoDirection;
+  ASSERT_FALSE(knitter->updateSchedule(state));
+}
+
 TEST_F(KnitterTest, test_getStartOffset) {
   // out of range values
   knitter->m_carriage = Carriage_t::Knit;
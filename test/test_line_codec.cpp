@@ -0,0 +1,194 @@
+/*!
+ * \file test_line_codec.cpp
+ *
+ * This file is part of AYAB.
+ *
+ *    AYAB is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    AYAB is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with AYAB.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *    Original Work Copyright 2013 Christian Obersteiner, Andreas Müller
+ *    Modified Work Copyright 2020-3 Sturla Lange, Tom Price
+ *    http://ayab-knitting.com
+ */
+
+#include <gtest/gtest.h>
+
+#include <line_codec.h>
+
+constexpr uint8_t ROW_LEN = 25U;
+
+class LineCodecTest : public ::testing::Test {
+protected:
+  // compress `row` and check that it decodes to the stored (inverted) row
+  uint8_t roundTrip(LineEncoding_t encoding, const uint8_t *row,
+                    const uint8_t *prevRow) {
+    uint8_t dst[2U * ROW_LEN];
+    uint8_t len = LineCodec::encode(encoding, row, prevRow, ROW_LEN, dst,
+                                    sizeof(dst));
+    EXPECT_GT(len, 0U);
+    EXPECT_EQ(LineCodec::decodedLength(dst, len), ROW_LEN);
+
+    uint8_t prevLine[ROW_LEN];
+    uint8_t line[ROW_LEN];
+    for (uint8_t i = 0U; i < ROW_LEN; i++) {
+      prevLine[i] = ~prevRow[i];
+      line[i] = 0x5A;
+    }
+    LineCodec::decode(encoding, dst, len, prevLine, line, ROW_LEN);
+    for (uint8_t i = 0U; i < ROW_LEN; i++) {
+      EXPECT_EQ(line[i], static_cast<uint8_t>(~row[i])) << "byte " << +i;
+    }
+    return len;
+  }
+
+  uint8_t blank[ROW_LEN] = {0};
+};
+
+TEST_F(LineCodecTest, test_decodedLength) {
+  // literal run of 3, repeated run of 4, no-op
+  const uint8_t src[] = {0x02, 1, 2, 3, 0xFD, 7, 0x80};
+  ASSERT_EQ(LineCodec::decodedLength(src, sizeof(src)), 7U);
+  ASSERT_EQ(LineCodec::decodedLength(src, 0U), 0U);
+
+  // truncated literal run
+  ASSERT_EQ(LineCodec::decodedLength(src, 3U), LINE_CODEC_INVALID_LENGTH);
+  // truncated repeated run
+  ASSERT_EQ(LineCodec::decodedLength(src, 5U), LINE_CODEC_INVALID_LENGTH);
+}
+
+TEST_F(LineCodecTest, test_decode) {
+  const uint8_t src[] = {0x02, 1, 2, 3, 0xFD, 7, 0x80};
+  uint8_t line[7];
+  LineCodec::decode(LineEncoding::rle, src, sizeof(src), nullptr, line, 7U);
+  const uint8_t expected[7] = {0xFE, 0xFD, 0xFC, 0xF8, 0xF8, 0xF8, 0xF8};
+  for (uint8_t i = 0U; i < 7U; i++) {
+    ASSERT_EQ(line[i], expected[i]);
+  }
+
+  // XOR against the previous row, decoded in place
+  LineCodec::decode(LineEncoding::xorDelta, src, sizeof(src), line, line, 7U);
+  const uint8_t expectedDelta[7] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  for (uint8_t i = 0U; i < 7U; i++) {
+    ASSERT_EQ(line[i], expectedDelta[i]);
+  }
+
+  // output never exceeds the line length
+  uint8_t shortLine[3] = {0};
+  LineCodec::decode(LineEncoding::rle, src, sizeof(src), nullptr, shortLine,
+                    2U);
+  ASSERT_EQ(shortLine[2], 0U);
+}
+
+TEST_F(LineCodecTest, test_rle_blank_row) {
+  // a single repeated run
+  ASSERT_EQ(roundTrip(LineEncoding::rle, blank, blank), 2U);
+}
+
+TEST_F(LineCodecTest, test_rle_literal_row) {
+  uint8_t row[ROW_LEN];
+  for (uint8_t i = 0U; i < ROW_LEN; i++) {
+    row[i] = i;
+  }
+  // a single literal run
+  ASSERT_EQ(roundTrip(LineEncoding::rle, row, blank), ROW_LEN + 1U);
+}
+
+TEST_F(LineCodecTest, test_rle_mixed_row) {
+  uint8_t row[ROW_LEN] = {0xDE, 0xAD, 0xBE, 0xEF, 0, 0, 0, 0,    0,
+                          0,    0xAA, 0xAA, 0x55, 0, 0, 0, 0xFF, 0xFF};
+  row[ROW_LEN - 1U] = 0x01;
+  ASSERT_LT(roundTrip(LineEncoding::rle, row, blank), ROW_LEN);
+}
+
+TEST_F(LineCodecTest, test_xorDelta) {
+  uint8_t prevRow[ROW_LEN];
+  uint8_t row[ROW_LEN];
+  for (uint8_t i = 0U; i < ROW_LEN; i++) {
+    prevRow[i] = 0x33U * i;
+    row[i] = prevRow[i];
+  }
+
+  // unchanged row
+  ASSERT_EQ(roundTrip(LineEncoding::xorDelta, row, prevRow), 2U);
+
+  // a few changed needles
+  row[3] ^= 0x10;
+  row[17] ^= 0x81;
+  ASSERT_LE(roundTrip(LineEncoding::xorDelta, row, prevRow), 10U);
+}
+
+TEST_F(LineCodecTest, test_random_rows) {
+  // deterministic pseudo-random rows with varying run structure
+  uint32_t seed = 12345U;
+  auto next = [&seed]() -> uint8_t {
+    seed = seed * 1103515245U + 12345U;
+    return static_cast<uint8_t>(seed >> 16U);
+  };
+
+  uint8_t prevRow[ROW_LEN] = {0};
+  for (uint16_t n = 0U; n < 500U; n++) {
+    uint8_t row[ROW_LEN];
+    for (uint8_t i = 0U; i < ROW_LEN; i++) {
+      switch (next() & 3U) {
+      case 0:
+        row[i] = next();
+        break;
+      case 1:
+        row[i] = prevRow[i];
+        break;
+      default:
+        row[i] = (i > 0U) ? row[i - 1U] : 0U;
+        break;
+      }
+    }
+    roundTrip(LineEncoding::rle, row, prevRow);
+    roundTrip(LineEncoding::xorDelta, row, prevRow);
+    memcpy(prevRow, row, ROW_LEN);
+  }
+}
+
+TEST_F(LineCodecTest, test_long_runs) {
+  // runs longer than a single PackBits header can hold
+  constexpr uint8_t LONG_LEN = 200U;
+  uint8_t row[LONG_LEN];
+  for (uint8_t i = 0U; i < LONG_LEN; i++) {
+    row[i] = (i < 150U) ? 0xAA : i;
+  }
+  uint8_t dst[LONG_LEN + 4U];
+  uint8_t len = LineCodec::encode(LineEncoding::rle, row, nullptr, LONG_LEN,
+                                  dst, sizeof(dst));
+  ASSERT_GT(len, 0U);
+  ASSERT_EQ(LineCodec::decodedLength(dst, len), LONG_LEN);
+
+  uint8_t line[LONG_LEN];
+  LineCodec::decode(LineEncoding::rle, dst, len, nullptr, line, LONG_LEN);
+  for (uint8_t i = 0U; i < LONG_LEN; i++) {
+    ASSERT_EQ(line[i], static_cast<uint8_t>(~row[i]));
+  }
+}
+
+TEST_F(LineCodecTest, test_encode_overflow) {
+  uint8_t row[ROW_LEN];
+  for (uint8_t i = 0U; i < ROW_LEN; i++) {
+    row[i] = i;
+  }
+  uint8_t dst[ROW_LEN];
+  // incompressible row does not fit
+  ASSERT_EQ(LineCodec::encode(LineEncoding::rle, row, nullptr, ROW_LEN, dst,
+                              sizeof(dst)),
+            0U);
+  // nor does a repeated run in a 1-byte buffer
+  ASSERT_EQ(LineCodec::encode(LineEncoding::rle, blank, nullptr, ROW_LEN, dst,
+                              1U),
+            0U);
+}
@@ -21,6 +21,9 @@
  *    http://ayab-knitting.com
  */
 
+#include <algorithm>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include <beeper.h>
@@ -32,10 +35,12 @@
 using ::testing::_;
 using ::testing::An;
 using ::testing::AtLeast;
+using ::testing::Invoke;
 using ::testing::Mock;
 using ::testing::Return;
 
 extern Beeper *beeper;
+extern Encoders *encoders;
 extern Tester *tester;
 
 extern FsmMock *fsm;
@@ -58,6 +63,9 @@ protected:
     Mock::AllowLeak(fsmMock);
     Mock::AllowLeak(knitterMock);
 
+    // test output is written out at once
+    ON_CALL(*serialMock, availableForWrite).WillByDefault(Return(64));
+
     beeper->init(true);
   }
 
@@ -95,10 +103,9 @@ protected:
     }
   }
 
-  void expect_readEOLsensors(bool flag) {
-    uint8_t n = flag ? 1 : 0;
-    EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L)).Times(n);
-    EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R)).Times(n);
+  void expect_readEOLsensors() {
+    // the Hall sensors are read from the encoders' samples, not the ADC
+    EXPECT_CALL(*arduinoMock, analogRead).Times(0);
   }
 
   void expect_readEncoders(bool flag) {
@@ -167,7 +174,7 @@ TEST_F(TesterTest, test_setAllCmd_success) {
 
 TEST_F(TesterTest, test_readEOLsensorsCmd) {
   expect_write(false);
-  expect_readEOLsensors(true);
+  expect_readEOLsensors();
   tester->readEOLsensorsCmd();
 }
 
@@ -184,8 +191,78 @@ TEST_F(TesterTest, test_readEncodersCmd_high) {
 }
 
 TEST_F(TesterTest, test_autoReadCmd) {
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::autoReadCmd)};
   expect_write(true);
-  tester->autoReadCmd();
+  tester->autoReadCmd(buffer, sizeof(buffer));
+}
+
+TEST_F(TesterTest, test_autoReadCmd_binary) {
+  std::vector<uint8_t> written;
+  expect_startTest(0);
+  EXPECT_CALL(*fsmMock, getState).WillRepeatedly(Return(OpState::test));
+
+  // invalid sample period
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::autoReadCmd), 1, 0};
+  tester->autoReadCmd(buffer, sizeof(buffer));
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(1));
+  EXPECT_CALL(*arduinoMock, micros).Times(0);
+  tester->loop();
+  ASSERT_TRUE(Mock::VerifyAndClear(arduinoMock));
+
+  // A sample every 2 ms is too fast for 115200 baud,
+  // so there is one every 3 ms. The text readout stops.
+  uint8_t text[] = {static_cast<uint8_t>(AYAB_API::autoReadCmd)};
+  tester->autoReadCmd(text, sizeof(text));
+  ASSERT_TRUE(tester->m_autoReadOn);
+  buffer[2] = 2;
+  EXPECT_CALL(*arduinoMock, pinMode(EOL_PIN_R, INPUT));
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(1));
+  tester->autoReadCmd(buffer, sizeof(buffer));
+  ASSERT_EQ(tester->m_samplePeriod, 3U);
+  ASSERT_FALSE(tester->m_autoReadOn);
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(3));
+  EXPECT_CALL(*arduinoMock, micros).Times(0);
+  tester->loop();
+  ASSERT_TRUE(Mock::VerifyAndClear(arduinoMock));
+
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(4));
+  EXPECT_CALL(*arduinoMock, micros).WillOnce(Return(0x01020304));
+  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_L)).WillOnce(Return(0x0123));
+  EXPECT_CALL(*arduinoMock, analogRead(EOL_PIN_R)).WillOnce(Return(0x0234));
+  encoders->adc_interrupt();
+  encoders->adc_interrupt();
+  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_A)).WillOnce(Return(HIGH));
+  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_B)).WillOnce(Return(LOW));
+  EXPECT_CALL(*arduinoMock, digitalRead(ENC_PIN_C)).WillOnce(Return(HIGH));
+  EXPECT_CALL(*serialMock, write(An<uint8_t>()))
+      .WillRepeatedly(Invoke([&written](uint8_t c) -> size_t {
+        written.push_back(c);
+        return 1U;
+      }));
+  tester->loop();
+  uint8_t expected[] = {SLIP::END,
+                        static_cast<uint8_t>(AYAB_API::testRes),
+                        TESTRES_SAMPLE,
+                        1, 2, 3, 4,
+                        0x01, 0x23,
+                        0x02, 0x34,
+                        0x05,
+                        SLIP::END};
+  ASSERT_EQ(written.size(), sizeof(expected));
+  ASSERT_TRUE(std::equal(expected, expected + sizeof(expected), written.begin()));
+  ASSERT_TRUE(Mock::VerifyAndClear(arduinoMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(serialMock));
+
+  // the text readout stops the samples
+  tester->autoReadCmd(text, sizeof(text));
+  ASSERT_EQ(tester->m_samplePeriod, 0U);
+
+  // no more samples after `stopCmd()`
+  tester->autoReadCmd(buffer, sizeof(buffer));
+  tester->stopCmd();
+  EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(10));
+  EXPECT_CALL(*arduinoMock, micros).Times(0);
+  tester->loop();
 }
 
 TEST_F(TesterTest, test_autoTestCmd) {
@@ -215,13 +292,14 @@ TEST_F(TesterTest, test_loop_null) {
 
 TEST_F(TesterTest, test_loop_autoTest) {
   expect_startTest(0);
-  tester->autoReadCmd();
+  uint8_t buffer[] = {static_cast<uint8_t>(AYAB_API::autoReadCmd)};
+  tester->autoReadCmd(buffer, sizeof(buffer));
   tester->autoTestCmd();
 
   // m_timerEventOdd = false
   EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(TEST_LOOP_DELAY));
   expect_write(true);
-  expect_readEOLsensors(false);
+  expect_readEOLsensors();
   expect_readEncoders(false);
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, HIGH));
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_B, HIGH));
@@ -230,7 +308,7 @@ TEST_F(TesterTest, test_loop_autoTest) {
   // m_timerEventOdd = false
   EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(2 * TEST_LOOP_DELAY));
   expect_write(false);
-  expect_readEOLsensors(true);
+  expect_readEOLsensors();
   expect_readEncoders(true);
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, LOW));
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_B, LOW));
@@ -239,7 +317,7 @@ TEST_F(TesterTest, test_loop_autoTest) {
   // after `stopCmd()`
   tester->stopCmd();
   EXPECT_CALL(*arduinoMock, millis).WillOnce(Return(3 * TEST_LOOP_DELAY));
-  expect_readEOLsensors(false);
+  expect_readEOLsensors();
   expect_readEncoders(false);
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_A, _)).Times(0);
   EXPECT_CALL(*arduinoMock, digitalWrite(LED_PIN_B, _)).Times(0);
@@ -262,3 +340,30 @@ TEST_F(TesterTest, test_startTest_success) {
   ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
   ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
 }
+
+TEST_F(TesterTest, test_startTest_wait_for_machine) {
+  // No machine was initialized, so the test sets up
+  // the encoders and their Hall sensor samples itself.
+  EXPECT_CALL(*fsmMock, getState).WillRepeatedly(Return(OpState::wait_for_machine));
+  EXPECT_CALL(*fsmMock, setState(OpState::test));
+  EXPECT_CALL(*knitterMock, setMachineType(Machine_t::Kh930));
+  EXPECT_CALL(*arduinoMock, pinMode(EOL_PIN_R, INPUT));
+  ASSERT_TRUE(tester->startTest(Machine_t::Kh930) == ErrorCode::success);
+  ASSERT_TRUE(Mock::VerifyAndClear(arduinoMock));
+
+  // samples from the ADC interrupt are read by the test
+  EXPECT_CALL(*arduinoMock, analogRead).WillRepeatedly(Return(0x0155));
+  encoders->adc_interrupt();
+  encoders->adc_interrupt();
+  ASSERT_EQ(GlobalEncoders::getHallValue(Direction_t::Left), 0x0155);
+  ASSERT_EQ(GlobalEncoders::getHallValue(Direction_t::Right), 0x0155);
+
+  // stopping the test leaves the encoders alone
+  EXPECT_CALL(*arduinoMock, pinMode).Times(0);
+  tester->stopCmd();
+
+  // test expectations without destroying instance
+  ASSERT_TRUE(Mock::VerifyAndClear(arduinoMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(fsmMock));
+  ASSERT_TRUE(Mock::VerifyAndClear(knitterMock));
+}